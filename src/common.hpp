@@ -16,7 +16,9 @@ enum { SYSTEM_ERROR = 1, PARSING_ERROR, TYPE_CHECK_ERROR, CODEGEN_ERROR };
 #define UNREACHABLE() ERR_EXIT(SYSTEM_ERROR, "control flow should never reach here")
 
 using i32 = int32_t;
+using i64 = int64_t;
 using u32 = uint32_t;
+using u64 = uint64_t;
 
 #define DEFINE_CLASSOF(cls, cond) \
   static bool classof(const cls *p) { return cond; }
@@ -51,6 +53,9 @@ inline bool can_encode_imm(i32 imm) {
   return false;
 }
 
+// number of q registers allocate_vector_register can hand out, vectorize_loop keeps the vectors of a loop within it
+constexpr u32 NUM_VECTOR_REGS = 8;
+
 template <class Node>
 struct ilist {
   Node *head;
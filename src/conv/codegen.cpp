@@ -1,11 +1,14 @@
 #include "codegen.hpp"
 
 #include <algorithm>
-#include <cassert>
 #include <map>
 #include <optional>
 #include <set>
 
+#include "../passes/ir/cfg.hpp"
+#include "../passes/ir/value_range.hpp"
+#include "../thread_pool.hpp"
+
 // list of assignments (lhs, rhs)
 using ParMv = std::vector<std::pair<MachineOperand, MachineOperand>>;
 using u64 = uint64_t;
@@ -47,20 +50,43 @@ static MachineOperand generate_imm_operand(i32 imm, MachineBB *mbb, bool force_r
   }
 }
 
+// whether an array argument of the call may be the address of a local array or a part of it
+// only arrays reached from a parameter or a global through GEPs are known to be off the stack, other sources such as
+// phis are assumed to point into the frame of the caller
+static bool passes_stack_address(CallInst *x) {
+  auto &params = x->func->func->params;
+  for (u32 i = 0; i < x->args.size(); i++) {
+    if (!params[i].is_param_array()) continue;
+    Value *value = x->args[i].value;
+    while (auto y = dyn_cast<GetElementPtrInst>(value)) value = y->arr.value;
+    if (!isa<ParamRef>(value) && !isa<GlobalRef>(value)) return true;
+  }
+  return false;
+}
+
 MachineProgram *machine_code_generation(IrProgram *p) {
   auto ret = new MachineProgram;
   ret->glob_decl = p->glob_decl;
+  // MachineFunc按IrFunc的顺序先创建好，之后每个函数的代码生成是独立的，可以并行
+  std::vector<std::pair<IrFunc *, MachineFunc *>> funcs;
   for (auto f = p->func.head; f; f = f->next) {
     if (f->builtin) continue;
     auto mf = new MachineFunc;
     ret->func.insertAtEnd(mf);
     mf->func = f;
+    funcs.emplace_back(f, mf);
+  }
+  parallel_for(funcs.size(), [&](u32 idx) {
+    IrFunc *f = funcs[idx].first;
+    MachineFunc *mf = funcs[idx].second;
 
     // 1. create machine bb 1-to-1
     std::map<BasicBlock *, MachineBB *> bb_map;
+    auto &loop_info = compute_loop_info(f);
     for (auto bb = f->bb.head; bb; bb = bb->next) {
       auto mbb = new MachineBB;
       mbb->bb = bb;
+      mbb->loop_depth = loop_info.depth_of(bb);
       mf->bb.insertAtEnd(mbb);
       bb_map[bb] = mbb;
     }
@@ -82,6 +108,10 @@ MachineProgram *machine_code_generation(IrProgram *p) {
       }
     }
 
+    // 能证明被除数非负时，除以常数和模2^n不需要修正负数的结果
+    ValueRange ranges = compute_value_range(f);
+    auto non_negative = [&](Value *value, Inst *inst) { return ranges.get(value, inst->bb).non_negative(); };
+
     // map value to MachineOperand
     std::map<Value *, MachineOperand> val_map;
     // map global decl to MachineOperand
@@ -116,7 +146,7 @@ MachineProgram *machine_code_generation(IrProgram *p) {
                 // read from sp + (i-4)*4 in entry bb
                 // will be fixed up in later pass
                 auto vreg = new_virtual_reg();
-                auto new_inst = new MILoad(mbb, 0);
+                auto new_inst = new MILoad(mf->bb.head, 0);
                 new_inst->addr = MachineOperand::R(ArmReg::sp);
                 new_inst->offset = vreg;
                 new_inst->dst = res;
@@ -163,6 +193,14 @@ MachineProgram *machine_code_generation(IrProgram *p) {
       }
     };
 
+    // map vector value to virtual vector register, see MIVector
+    std::map<Value *, i32> vector_map;
+    auto resolve_vector = [&](Value *value) {
+      auto [it, inserted] = vector_map.insert({value, (i32)mf->vector_virtual_max});
+      if (inserted) ++mf->vector_virtual_max;
+      return it->second;
+    };
+
     auto resolve_no_imm = [&](Value *value, MachineBB *mbb) {
       if (auto y = dyn_cast<ConstValue>(value)) {
         // can't store an immediate directly
@@ -177,6 +215,19 @@ MachineProgram *machine_code_generation(IrProgram *p) {
       }
     };
 
+    // vld1/vst1 have no offset operand, so arr + index * 4 is computed first
+    auto vector_addr = [&](Value *arr, Value *index, MachineBB *mbb) {
+      auto arr_reg = resolve(arr, mbb);
+      auto index_reg = resolve_no_imm(index, mbb);
+      auto addr_inst = new MIBinary(MachineInst::Tag::Add, mbb);
+      addr_inst->dst = new_virtual_reg();
+      addr_inst->lhs = arr_reg;
+      addr_inst->rhs = index_reg;
+      addr_inst->shift.type = ArmShift::Lsl;
+      addr_inst->shift.shift = 2;
+      return addr_inst->dst;
+    };
+
     // Peephole: expand small zero-filling memset calls into straight-line word
     // stores.  Example: `memset(a, 0, 16)` becomes four `str zero, [a, #i]`
     // stores and avoids a runtime call.
@@ -213,9 +264,9 @@ MachineProgram *machine_code_generation(IrProgram *p) {
       return true;
     };
 
-    // Peephole: lower unsigned-style `x % 2^k`, or the canonical
-    // `x - (x / 2^k) * 2^k`, to `x & (2^k - 1)`.  This mirrors the current
-    // Div-by-pow2 lowering; signed-correct remainders need a different sequence.
+    // Peephole: lower `x % 2^k`, or the canonical `x - (x / 2^k) * 2^k`, to
+    // `x & (2^k - 1)` when x is known to be non-negative.  Otherwise `x % 2^k`
+    // becomes `x - ((x + bias) >> k << k)`, where bias is 2^k - 1 for negative x.
     auto try_emit_pow2_remainder = [&](BinaryInst *inst, MachineBB *mbb) {
       Value *lhs = nullptr;
       ConstValue *factor = nullptr;
@@ -253,6 +304,37 @@ MachineProgram *machine_code_generation(IrProgram *p) {
         return false;
       }
 
+      u32 k = __builtin_ctz(value);
+      if (k > 0 && !non_negative(lhs, inst)) {
+        // 只有Mod需要这样生成，x - (x / 2^k) * 2^k交给Div和Mul各自生成即可
+        if (inst->tag != Value::Tag::Mod) return false;
+        auto dst = resolve(inst, mbb);
+        auto src = resolve_no_imm(lhs, mbb);
+        auto sign = new MIMove(mbb);
+        sign->dst = new_virtual_reg();
+        sign->rhs = src;
+        sign->shift.shift = 31;
+        sign->shift.type = ArmShift::Asr;
+        auto biased = new MIBinary(MachineInst::Tag::Add, mbb);
+        biased->dst = new_virtual_reg();
+        biased->lhs = src;
+        biased->rhs = sign->dst;
+        biased->shift.shift = 32 - k;
+        biased->shift.type = ArmShift::Lsr;
+        auto quotient = new MIMove(mbb);
+        quotient->dst = new_virtual_reg();
+        quotient->rhs = biased->dst;
+        quotient->shift.shift = k;
+        quotient->shift.type = ArmShift::Asr;
+        auto sub_inst = new MIBinary(MachineInst::Tag::Sub, mbb);
+        sub_inst->dst = dst;
+        sub_inst->lhs = src;
+        sub_inst->rhs = quotient->dst;
+        sub_inst->shift.shift = k;
+        sub_inst->shift.type = ArmShift::Lsl;
+        return true;
+      }
+
       auto dst = resolve(inst, mbb);
       auto src = resolve_no_imm(lhs, mbb);
       auto rhs = get_imm_operand(factor->imm - 1, mbb);
@@ -495,8 +577,7 @@ MachineProgram *machine_code_generation(IrProgram *p) {
           MachineOperand rhs{};
           auto rhs_const = x->rhs.value->tag == Value::Tag::Const;
           auto imm = rhs_const ? static_cast<ConstValue *>(x->rhs.value)->imm : 0;
-          assert(!(x->lhs.value->tag == Value::Tag::Const && rhs_const));  // should be optimized out
-
+          // -O0不做常量折叠，两个操作数可能都是常数，这时lhs和其他情况一样由resolve_no_imm放进寄存器
           auto lhs = resolve_no_imm(x->lhs.value, mbb);
           // Optimization 2:
           // 提前检查两个特殊情况：除常数和乘2^n，里面用continue来跳过后续的操作
@@ -505,8 +586,9 @@ MachineProgram *machine_code_generation(IrProgram *p) {
               auto dst = resolve(inst, mbb);
               u32 d = static_cast<ConstValue *>(x->rhs.value)->imm;
               u32 s = __builtin_ctz(d);
+              bool unsigned_dividend = non_negative(x->lhs.value, x);
               if (d == (u32(1) << s)) {  // d是2的幂次，转化成移位
-                if (false) {
+                if (s > 0 && !unsigned_dividend) {
                   // handle negative dividend
                   auto i1 = new MIMove(mbb);
                   i1->dst = new_virtual_reg();
@@ -550,10 +632,12 @@ MachineProgram *machine_code_generation(IrProgram *p) {
                   i1->rhs = magic;
                 }
                 auto i2 = new MIMove(mbb);
-                i2->dst = new_virtual_reg();
+                i2->dst = unsigned_dividend ? dst : new_virtual_reg();
                 i2->rhs = temp_dst;
                 i2->shift.shift = shift;
                 i2->shift.type = ArmShift::Asr;
+                // 被除数非负时商也非负，不需要加上符号位来向0取整
+                if (unsigned_dividend) continue;
                 auto i3 = new MIBinary(MachineInst::Tag::Add, mbb);
                 i3->dst = dst;
                 i3->lhs = i2->dst;
@@ -613,7 +697,7 @@ MachineProgram *machine_code_generation(IrProgram *p) {
             if (y && ((y->tag == Value::Tag::Add && (y->lhs.value == x || y->rhs.value == x)) ||
                       (y->tag == Value::Tag::Sub && y->rhs.value == x))) {
               dbg("Multiply-Add/Sub fused to MLA/MLS");
-              auto acc = resolve(y->lhs.value == x ? y->rhs.value : y->lhs.value, mbb);
+              auto acc = resolve_no_imm(y->lhs.value == x ? y->rhs.value : y->lhs.value, mbb);
               auto x4 = resolve(y, mbb);
               auto fma_inst = new MIFma(y->tag == Value::Tag::Add, false, mbb);
               fma_inst->dst = x4;
@@ -713,15 +797,20 @@ MachineProgram *machine_code_generation(IrProgram *p) {
           }
         } else if (auto x = dyn_cast<BranchInst>(inst)) {
           // Emit one ARM compare and return the condition code that represents
-          // the IR comparison result.
-          auto emit_cmp = [&](BinaryInst *cmp) {
+          // the IR comparison result.  The operands of both compares are
+          // resolved before the first one, since resolving a constant may emit
+          // a mov, which must not land between the two conditional branches.
+          auto cmp_operands = [&](BinaryInst *cmp) {
+            auto lhs = resolve_no_imm(cmp->lhs.value, mbb);
+            auto rhs = cmp->rhs.value->tag == Value::Tag::Const
+                           ? get_imm_operand(static_cast<ConstValue *>(cmp->rhs.value)->imm, mbb)
+                           : resolve_no_imm(cmp->rhs.value, mbb);
+            return std::pair(lhs, rhs);
+          };
+          auto emit_cmp = [&](BinaryInst *cmp, std::pair<MachineOperand, MachineOperand> operands) {
             auto cmp_inst = new MICompare(mbb);
-            cmp_inst->lhs = resolve_no_imm(cmp->lhs.value, mbb);
-            if (cmp->rhs.value->tag == Value::Tag::Const) {
-              cmp_inst->rhs = get_imm_operand(static_cast<ConstValue *>(cmp->rhs.value)->imm, mbb);
-            } else {
-              cmp_inst->rhs = resolve_no_imm(cmp->rhs.value, mbb);
-            }
+            cmp_inst->lhs = operands.first;
+            cmp_inst->rhs = operands.second;
             return std::pair(cmp_inst, cmp_cond(cmp->tag));
           };
           auto cond_and = dyn_cast<BinaryInst>(x->cond.value);
@@ -729,14 +818,16 @@ MachineProgram *machine_code_generation(IrProgram *p) {
               is_cmp(cond_and->rhs.value)) {
             auto lhs_cmp = static_cast<BinaryInst *>(cond_and->lhs.value);
             auto rhs_cmp = static_cast<BinaryInst *>(cond_and->rhs.value);
-            auto [lhs_cmp_inst, lhs_cond] = emit_cmp(lhs_cmp);
+            auto lhs_operands = cmp_operands(lhs_cmp);
+            auto rhs_operands = cmp_operands(rhs_cmp);
+            auto [lhs_cmp_inst, lhs_cond] = emit_cmp(lhs_cmp, lhs_operands);
             mbb->control_transfer_inst = lhs_cmp_inst;
 
             auto lhs_fail = new MIBranch(mbb);
             lhs_fail->cond = opposite_cond(lhs_cond);
             lhs_fail->target = bb_map[x->right];
 
-            auto [rhs_cmp_inst, rhs_cond] = emit_cmp(rhs_cmp);
+            auto [rhs_cmp_inst, rhs_cond] = emit_cmp(rhs_cmp, rhs_operands);
             (void)rhs_cmp_inst;
             auto rhs_branch = new MIBranch(mbb);
             if (x->left == bb->next) {
@@ -784,6 +875,13 @@ MachineProgram *machine_code_generation(IrProgram *p) {
           auto tail_return = dyn_cast_nullable<ReturnInst>(x->next);
           bool self_tail_call =
               x->func == f && n <= 4 && tail_return && tail_return->ret.value == x && x->uses.head == x->uses.tail;
+          // Sibling call: the callee reuses our return address, so its args must all fit in r0-r3 (stack args
+          // would have to outlive our frame) and must not point into our frame. Library functions may be Thumb
+          // code, which `b` cannot switch to, so only functions of this program are called this way.
+          bool sibling_call =
+              !self_tail_call && !x->func->builtin && n <= 4 && tail_return &&
+              (tail_return->ret.value ? tail_return->ret.value == x && x->uses.head == x->uses.tail : !x->uses.head) &&
+              !passes_stack_address(x);
           for (int i = 0; i < n; i++) {
             if (i < 4) {
               // move args to r0-r3
@@ -814,6 +912,15 @@ MachineProgram *machine_code_generation(IrProgram *p) {
             continue;
           }
 
+          if (sibling_call) {
+            auto ret_inst = new MIReturn(mbb);
+            ret_inst->tail_call = x->func->func;
+            mbb->control_transfer_inst = ret_inst;
+            skipped_tail_returns.insert(tail_return);
+            dbg("Converted tail call to sibling call");
+            continue;
+          }
+
           if (n > 4) {
             // sub sp, sp, (n-4)*4
             auto add_inst = new MIBinary(MachineInst::Tag::Sub, mbb);
@@ -842,6 +949,56 @@ MachineProgram *machine_code_generation(IrProgram *p) {
             mv_inst->dst = dst;
             mv_inst->rhs = MachineOperand::R(ArmReg::r0);
           }
+        } else if (auto x = dyn_cast<VectorLoadInst>(inst)) {
+          auto addr = vector_addr(x->arr.value, x->index.value, mbb);
+          auto load_inst = new MIVectorLoad(mbb);
+          load_inst->dst = resolve_vector(inst);
+          load_inst->addr = addr;
+        } else if (auto x = dyn_cast<VectorStoreInst>(inst)) {
+          auto addr = vector_addr(x->arr.value, x->index.value, mbb);
+          auto store_inst = new MIVectorStore(mbb);
+          store_inst->data = resolve_vector(x->data.value);
+          store_inst->addr = addr;
+        } else if (auto x = dyn_cast<VectorBinaryInst>(inst)) {
+          // vector mul followed by an add of its only use becomes vmla, like MIFma
+          auto y = dyn_cast_nullable<VectorBinaryInst>(x->next);
+          if (x->op == Value::Tag::Mul && x->uses.head == x->uses.tail && y && y->op == Value::Tag::Add &&
+              (y->lhs.value == x || y->rhs.value == x)) {
+            dbg("Vector Multiply-Add fused to VMLA");
+            auto fma_inst = new MIVectorFma(mbb);
+            fma_inst->dst = resolve_vector(y);
+            fma_inst->acc = resolve_vector(y->lhs.value == x ? y->rhs.value : y->lhs.value);
+            fma_inst->lhs = resolve_vector(x->lhs.value);
+            fma_inst->rhs = resolve_vector(x->rhs.value);
+            // skip y
+            inst = inst->next;
+            continue;
+          }
+          auto new_inst = new MIVectorBinary((MachineInst::Tag)x->op, mbb);
+          new_inst->dst = resolve_vector(x);
+          new_inst->lhs = resolve_vector(x->lhs.value);
+          new_inst->rhs = resolve_vector(x->rhs.value);
+        } else if (auto x = dyn_cast<VectorReduceInst>(inst)) {
+          // vmov.32 each lane to a core register, then (l0 op l1) op (l2 op l3)
+          MachineOperand lanes[4];
+          for (i32 i = 0; i < 4; ++i) {
+            auto extract_inst = new MIVectorExtract(mbb);
+            extract_inst->dst = lanes[i] = new_virtual_reg();
+            extract_inst->src = resolve_vector(x->value.value);
+            extract_inst->lane = i;
+          }
+          for (i32 i = 0; i < 3; ++i) {
+            auto new_inst = new MIBinary((MachineInst::Tag)x->op, mbb);
+            new_inst->dst = i < 2 ? new_virtual_reg() : resolve(inst, mbb);
+            new_inst->lhs = i < 2 ? lanes[2 * i] : lanes[0];
+            new_inst->rhs = i < 2 ? lanes[2 * i + 1] : lanes[2];
+            if (i < 2) lanes[2 * i] = new_inst->dst;
+          }
+        } else if (auto x = dyn_cast<VectorDupInst>(inst)) {
+          auto src = resolve_no_imm(x->value.value, mbb);
+          auto new_inst = new MIVectorDup(mbb);
+          new_inst->dst = resolve_vector(x);
+          new_inst->src = src;
         } else if (auto x = dyn_cast<AllocaInst>(inst)) {
           i32 size = 1;
           if (!x->sym->dims.empty()) {
@@ -902,6 +1059,16 @@ MachineProgram *machine_code_generation(IrProgram *p) {
       for (auto inst = bb->insts.head; inst; inst = inst->next) {
         // phi insts must appear at the beginning of bb
         if (auto x = dyn_cast<PhiInst>(inst)) {
+          if (is_vector_value(x)) {
+            // vectorize_loop only creates vector phis for reductions, where the incoming values are not used by
+            // other phis of this bb and the phi is dead in the other successors, so the moves need no care
+            for (u32 i = 0; i < x->incoming_values.size(); i++) {
+              auto mv_inst = new MIVectorMove(bb_map[x->incoming_bbs()[i]]->control_transfer_inst);
+              mv_inst->dst = resolve_vector(x);
+              mv_inst->src = resolve_vector(x->incoming_values[i].value);
+            }
+            continue;
+          }
           has_phi = true;
           // for each phi:
           // lhs = phi [r1 bb1], [r2 bb2] ...
@@ -948,6 +1115,6 @@ MachineProgram *machine_code_generation(IrProgram *p) {
     }
 
     mf->virtual_max = virtual_max;
-  }
+  });
   return ret;
 }
@@ -313,6 +313,7 @@ IrProgram *convert_ssa(Program &p) {
   for (auto &g : p.glob) {
     if (Func *f = std::get_if<0>(&g)) {
       IrFunc *func = f->val;
+      ArenaScope scope(&func->arena);
       BasicBlock *entryBB = new BasicBlock;
       func->bb.insertAtEnd(entryBB);
 
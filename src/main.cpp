@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
@@ -12,14 +13,18 @@
 #include "conv/ssa.hpp"
 #include "conv/typeck.hpp"
 #include "passes/pass_manager.hpp"
+#include "passes/time_report.hpp"
+#include "thread_pool.hpp"
 
 
 int main(int argc, char *argv[]) {
-  bool opt = false, print_usage = false, print_pass = false;
-  char *src = nullptr, *output = nullptr, *ir_file = nullptr;
+  // 没有指定-O时使用完整的优化
+  u32 opt_level = 2;
+  bool print_usage = false, print_pass = false;
+  char *src = nullptr, *output = nullptr, *ir_file = nullptr, *report_file = nullptr;
 
   // parse command line options and check
-  for (int ch; (ch = getopt(argc, argv, "Sdpl:o:O:h")) != -1;) {
+  for (int ch; (ch = getopt(argc, argv, "SdpLl:o:O:T:j:h")) != -1;) {
     switch (ch) {
       case 'S':
         // do nothing
@@ -30,6 +35,9 @@ int main(int argc, char *argv[]) {
       case 'p':
         print_pass = true;
         break;
+      case 'L':
+        use_linear_scan = true;
+        break;
       case 'l':
         ir_file = strdup(optarg);
         break;
@@ -37,7 +45,14 @@ int main(int argc, char *argv[]) {
         output = strdup(optarg);
         break;
       case 'O':
-        opt = atoi(optarg) > 0;
+        opt_level = std::max(atoi(optarg), 0);
+        break;
+      case 'T':
+        time_report.enabled = true;
+        report_file = strdup(optarg);
+        break;
+      case 'j':
+        num_jobs = std::max(atoi(optarg), 1);
         break;
       case 'h':
         print_usage = true;
@@ -51,15 +66,18 @@ int main(int argc, char *argv[]) {
     src = argv[optind];
   }
 
-  dbg(src, output, ir_file, opt, print_usage, print_pass, debug_mode);
+  dbg(src, output, ir_file, report_file, opt_level, num_jobs, print_usage, print_pass, debug_mode);
+
+  // 多个线程的调试输出会交错在一起，没法看
+  if (debug_mode) num_jobs = 1;
 
   if (print_pass) {
-    print_passes();
+    print_passes(opt_level);
     return 0;
   }
 
   if (src == nullptr || print_usage) {
-    fprintf(stderr, "Usage: %s [-l ir_file] [-S] [-p (print passes)] [-d (debug mode)] [-o output_file] [-O level] input_file\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-l ir_file] [-S] [-p (print passes)] [-d (debug mode)] [-L (linear scan register allocation)] [-o output_file] [-O level] [-T report_file] [-j jobs] input_file\n", argv[0]);
     return !print_usage && SYSTEM_ERROR;
   }
 
@@ -73,33 +91,58 @@ int main(int argc, char *argv[]) {
   fstat(fd, &st);
   char *input = (char *)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
+  // 不需要-T时stage和end_stage什么都不做，也不会统计程序的大小
+  auto stage = [](const char *name, auto... before) {
+    if (time_report.enabled) time_report.begin(name, "frontend", ProgramSize{program_size(before)...});
+  };
+  auto end_stage = [](auto... after) {
+    if (time_report.enabled) time_report.end(ProgramSize{program_size(after)...});
+  };
+
   // run lexer
+  stage("parse");
   Lexer l(std::string_view(input, st.st_size));
   auto result = Parser{}.parse(l);
+  end_stage();
 
   // run parser
   if (Program *p = std::get_if<0>(&result)) {
     dbg("parsing success");
+    stage("type_check");
     type_check(*p);  // 失败时直接就exit(1)了
+    end_stage();
     dbg("type_check success");
+    stage("convert_ssa");
     auto *ir = convert_ssa(*p);
-    run_passes(ir, opt);
+    end_stage(ir);
+    run_passes(ir, opt_level);
     if (ir_file != nullptr) {
       std::ofstream(ir_file) << *ir;
     }
     if (output != nullptr) {
+      stage("machine_code_generation", ir);
       auto *code = machine_code_generation(ir);
-      run_passes(code, opt);
+      end_stage(code);
+      // 机器码不再引用IR中的Inst和BasicBlock，尽早释放以降低后端的内存峰值
+      ir->release();
+      run_passes(code, opt_level);
+      stage("emit_asm", code);
       std::ofstream(output) << *code;
+      end_stage(code);
+    } else {
+      ir->release();
     }
   } else if (Token *t = std::get_if<1>(&result)) {
     ERR_EXIT(PARSING_ERROR, "parsing error", t->kind, t->line, t->col, t->piece);
   }
 
+  if (time_report.enabled) time_report.dump(src, report_file);
+
   // post-precess
   munmap(input, st.st_size);
   free(output);
   free(ir_file);
+  free(report_file);
 
   return 0;
 }
@@ -1,9 +1,9 @@
 // Register allocation pass.
 //
 // Lowers virtual machine operands to ARM registers, spilling to stack slots when
-// live ranges exceed available registers.  It also knows about writeback memory
-// operands, e.g. `ldr r0, [r1], #4`, where the address register is both used and
-// defined by the access.
+// live ranges exceed available registers.  Liveness and the def/use of each
+// instruction come from liveness.hpp, which also handles writeback memory
+// operands, e.g. `ldr r0, [r1], #4`.
 #include "allocate_register.hpp"
 
 #include <algorithm>
@@ -11,650 +11,960 @@
 #include <map>
 #include <optional>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 
-#include "../ir/cfg.hpp"
-
-std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use(MachineInst *inst) {
-  std::vector<MachineOperand> def;
-  std::vector<MachineOperand> use;
-
-  if (auto x = dyn_cast<MIBinary>(inst)) {
-    def = {x->dst};
-    use = {x->lhs, x->rhs};
-  } else if (auto x = dyn_cast<MILongMul>(inst)) {
-    def = {x->dst};
-    use = {x->lhs, x->rhs};
-  } else if (auto x = dyn_cast<MIFma>(inst)) {
-    def = {x->dst};
-    use = {x->lhs, x->rhs, x->acc};
-  } else if (auto x = dyn_cast<MIMove>(inst)) {
-    def = {x->dst};
-    use = {x->rhs};
-  } else if (auto x = dyn_cast<MILoad>(inst)) {
-    def = {x->dst};
-    use = {x->addr, x->offset};
-    if (x->mode != MIAccess::Mode::Offset) {
-      def.push_back(x->addr);
-    }
-  } else if (auto x = dyn_cast<MIStore>(inst)) {
-    use = {x->data, x->addr, x->offset};
-    if (x->mode != MIAccess::Mode::Offset) {
-      def.push_back(x->addr);
-    }
-  } else if (auto x = dyn_cast<MICompare>(inst)) {
-    use = {x->lhs, x->rhs};
-  } else if (auto x = dyn_cast<MICall>(inst)) {
-    // args (also caller save)
-    for (u32 i = (u32)ArmReg::r0; i < (u32)ArmReg::r0 + std::min(x->func->params.size(), (size_t)4); ++i) {
-      use.push_back(MachineOperand::R((ArmReg)i));
+#include "liveness.hpp"
+
+// symmetric adjacency matrix, only the lower triangle (u > v) is stored
+// falls back to a hash set when the bit matrix would be too large
+struct AdjMatrix {
+  static constexpr u64 MAX_DENSE_BITS = u64(1) << 28;  // 32MB
+  std::vector<u64> bits;
+  std::unordered_set<u64> sparse;
+  bool dense;
+
+  explicit AdjMatrix(u32 n) : dense((u64)n * (n - 1) / 2 <= MAX_DENSE_BITS) {
+    if (dense) bits.resize(((u64)n * (n - 1) / 2 + 63) / 64);
+  }
+
+  static u64 index(u32 u, u32 v) {
+    if (u < v) std::swap(u, v);
+    return (u64)u * (u - 1) / 2 + v;
+  }
+
+  bool test(u32 u, u32 v) const {
+    u64 i = index(u, v);
+    return dense ? bits[i / 64] >> (i % 64) & 1 : sparse.count(i);
+  }
+
+  void set(u32 u, u32 v) {
+    u64 i = index(u, v);
+    if (dense)
+      bits[i / 64] |= u64(1) << (i % 64);
+    else
+      sparse.insert(i);
+  }
+};
+
+// 可以在任何位置重新计算的定义：立即数的move，全局变量的地址，以及从拆分出的虚拟寄存器(split_vregs)的栈槽读取的load
+// 后者的栈槽只在原来的虚拟寄存器的定义处写入，所以在拆分出的寄存器的生存期内从栈槽读到的值都相同
+// 读取栈上参数的偏移量的move(sp_arg_fixup)要在compute_stack_info中修正，不能重新计算
+static bool rematerializable(MachineFunc *f, MachineInst *inst, const std::unordered_set<i32> &split_vregs) {
+  if (auto x = dyn_cast<MIMove>(inst)) {
+    return x->is_simple() && x->rhs.state == MachineOperand::State::Immediate &&
+           std::find(f->sp_arg_fixup.begin(), f->sp_arg_fixup.end(), x) == f->sp_arg_fixup.end();
+  }
+  if (isa<MIGlobal>(inst)) return true;
+  if (auto x = dyn_cast<MILoad>(inst)) {
+    return split_vregs.count(x->dst.value) && x->mode == MIAccess::Mode::Offset && x->cond == ArmCond::Any &&
+           x->addr == MachineOperand::R(ArmReg::sp) && x->offset.state == MachineOperand::State::Immediate;
+  }
+  return false;
+}
+
+// 两条可以重新计算的指令计算出的值相同
+static bool same_value(MachineInst *a, MachineInst *b) {
+  if (a->tag != b->tag) return false;
+  if (auto x = dyn_cast<MIMove>(a)) return x->rhs == static_cast<MIMove *>(b)->rhs;
+  if (auto x = dyn_cast<MIGlobal>(a)) return x->sym == static_cast<MIGlobal *>(b)->sym;
+  return static_cast<MILoad *>(a)->offset == static_cast<MILoad *>(b)->offset;
+}
+
+// 在before之前重新计算def的值，存入dst
+static void rematerialize(MachineInst *def, MachineInst *before, MachineOperand dst) {
+  if (auto x = dyn_cast<MIMove>(def)) {
+    auto inst = new MIMove(before);
+    inst->dst = dst;
+    inst->rhs = x->rhs;
+  } else if (auto x = dyn_cast<MIGlobal>(def)) {
+    auto inst = new MIGlobal(x->sym, before);
+    inst->dst = dst;
+  } else {
+    auto y = static_cast<MILoad *>(def);
+    auto inst = new MILoad(before);
+    inst->addr = y->addr;
+    inst->offset = y->offset;
+    inst->shift = y->shift;
+    inst->dst = dst;
+  }
+}
+
+// 包含bb的由loop_depth >= depth的bb组成的连通块，也就是bb所在的第depth层循环
+// 相邻的同一层的循环可能连在一起，这不影响在它的入边上读取的正确性
+static std::vector<MachineBB *> loop_region(MachineBB *bb, u32 depth) {
+  std::vector<MachineBB *> region{bb};
+  std::unordered_set<MachineBB *> vis{bb};
+  auto visit = [&](MachineBB *x) {
+    if (x && x->loop_depth >= depth && vis.insert(x).second) region.push_back(x);
+  };
+  for (u32 i = 0; i < region.size(); ++i) {
+    for (MachineBB *x : region[i]->pred) visit(x);
+    for (MachineBB *x : region[i]->succ) visit(x);
+  }
+  return region;
+}
+
+// bb中同时活跃的寄存器数的最大值，不计算这一轮要溢出的结点，它们在溢出后只在很短的范围内活跃
+static u32 max_pressure(MachineFunc *f, MachineBB *bb, const std::set<u32> &spilled_nodes) {
+  auto live = bb->liveout;
+  u32 cur = 0;
+  live.for_each([&](u32 i) { cur += !spilled_nodes.count(i); });
+  // 这一轮中先溢出的结点产生的新虚拟寄存器不在liveness的结果中，但它们在bb中的定义和使用之间同样占用寄存器，也要计算
+  live.words.resize((MachineOperand::NUM_PRECOLORED + f->virtual_max + 63) / 64);
+  auto tracked = [&](const MachineOperand &x) { return x.needs_color(); };
+  u32 ret = cur;
+  for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+    auto [def, use] = get_def_use(inst);
+    for (auto &d : def) {
+      if (tracked(d) && live.test(d.reg_index())) {
+        live.reset(d.reg_index());
+        cur -= !spilled_nodes.count(d.reg_index());
+      }
     }
-    for (u32 i = (u32)ArmReg::r0; i <= (u32)ArmReg::r3; i++) {
-      def.push_back(MachineOperand::R((ArmReg)i));
+    for (auto &u : use) {
+      if (tracked(u) && !live.test(u.reg_index())) {
+        live.set(u.reg_index());
+        cur += !spilled_nodes.count(u.reg_index());
+      }
     }
-    def.push_back(MachineOperand::R(ArmReg::lr));
-    def.push_back(MachineOperand::R(ArmReg::ip));
-  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
-    def = {x->dst};
-  } else if (isa<MIReturn>(inst)) {
-    // ret
-    use.push_back(MachineOperand::R(ArmReg::r0));
+    ret = std::max(ret, cur);
   }
-  return {def, use};
+  return ret;
 }
-std::pair<MachineOperand *, std::vector<MachineOperand *>> get_def_use_ptr(MachineInst *inst) {
-  MachineOperand *def = nullptr;
-  std::vector<MachineOperand *> use;
-
-  if (auto x = dyn_cast<MIBinary>(inst)) {
-    def = &x->dst;
-    use = {&x->lhs, &x->rhs};
-  } else if (auto x = dyn_cast<MILongMul>(inst)) {
-    def = &x->dst;
-    use = {&x->lhs, &x->rhs};
-  } else if (auto x = dyn_cast<MIFma>(inst)) {
-    def = {&x->dst};
-    use = {&x->lhs, &x->rhs, &x->acc};
-  } else if (auto x = dyn_cast<MIMove>(inst)) {
-    def = &x->dst;
-    use = {&x->rhs};
-  } else if (auto x = dyn_cast<MILoad>(inst)) {
-    def = &x->dst;
-    use = {&x->addr, &x->offset};
-  } else if (auto x = dyn_cast<MIStore>(inst)) {
-    use = {&x->data, &x->addr, &x->offset};
-  } else if (auto x = dyn_cast<MICompare>(inst)) {
-    use = {&x->lhs, &x->rhs};
-  } else if (isa<MICall>(inst)) {
-    // intentionally blank
-  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
-    def = {&x->dst};
+
+// 一个溢出的结点的所有定义，定义它的bb，按顺序排列的使用它的bb，以及按顺序排列的每个bb中定义或使用它的指令
+struct SpillSites {
+  std::vector<MachineInst *> defs;
+  std::unordered_set<MachineBB *> def_bbs;
+  std::vector<MachineBB *> use_bbs;
+  std::vector<std::pair<MachineBB *, std::vector<MachineInst *>>> refs;
+};
+
+// 把溢出的结点node改写为在每段使用前从栈上读取(或重新计算)，在定义后写入栈上，loop_cnt只用于调试输出
+// spilled_nodes是这一轮要溢出的所有结点，split_vregs记录拆分出的虚拟寄存器，在各轮之间保持
+static void spill_node(MachineFunc *f, u32 node, const SpillSites &sites, u32 loop_cnt,
+                       const std::set<u32> &spilled_nodes, std::unordered_set<i32> &split_vregs) {
+  auto n = MachineOperand::from_reg_index(node);
+  auto &[defs, def_bbs, use_bbs, refs] = sites;
+  // 所有定义都能重新计算出同一个值时，在使用前重新计算，不需要栈槽，原来的定义被删除
+  MachineInst *remat = nullptr;
+  if (!defs.empty() && std::all_of(defs.begin(), defs.end(), [&](MachineInst *d) {
+        return rematerializable(f, d, split_vregs) && same_value(d, defs[0]);
+      })) {
+    remat = defs[0];
+  }
+  if (remat) {
+    auto remat_vreg = "Rematerializing v" + std::to_string(n.value);
+    dbg(remat_vreg);
+  } else {
+    auto spill = "Spilling v" + std::to_string(n.value) + " with loop count of " + std::to_string(loop_cnt);
+    dbg(spill);
   }
-  return {def, use};
-}
-void liveness_analysis(MachineFunc *f) {
-  // calculate LiveUse and Def sets for each bb
-  // each elements is a virtual register or precolored register
-  for (auto bb = f->bb.head; bb; bb = bb->next) {
-    bb->liveuse.clear();
-    bb->def.clear();
-    for (auto inst = bb->insts.head; inst; inst = inst->next) {
-      auto [def, use] = get_def_use(inst);
 
-      // liveuse
-      for (auto &u : use) {
-        if (u.needs_color() && bb->def.find(u) == bb->def.end()) {
-          bb->liveuse.insert(u);
+  // allocate on stack
+  auto offset = f->stack_size;
+  auto offset_imm = MachineOperand::I(offset);
+  auto generate_access_offset = [&](MIAccess *access_inst) {
+    if (offset < (1u << 12u)) {  // ldr / str has only imm12
+      access_inst->offset = offset_imm;
+    } else {
+      auto mv_inst = new MIMove(access_inst);  // insert before access
+      mv_inst->rhs = offset_imm;
+      mv_inst->dst = MachineOperand::V(f->virtual_max++);
+      access_inst->offset = mv_inst->dst;
+    }
+  };
+
+  // 在只使用不定义n的循环的每条入边上从栈上读取一次，循环中都使用读到的新虚拟寄存器，这样溢出代码不在循环中
+  // 选择满足条件的最内层循环，新的虚拟寄存器只在这个循环中活跃，如果再被溢出，就在使用前重新从栈上读取(见rematerializable)
+  std::unordered_map<MachineBB *, i32> region_vreg;
+  for (MachineBB *bb : use_bbs) {
+    for (u32 depth = bb->loop_depth; !remat && depth >= 1 && !region_vreg.count(bb); --depth) {
+      std::vector<MachineBB *> region = loop_region(bb, depth);
+      if (std::any_of(region.begin(), region.end(),
+                      [&](MachineBB *x) { return def_bbs.count(x) || region_vreg.count(x); })) {
+        continue;
+      }
+      // 新的虚拟寄存器在整个region中都活跃，如果region中更深的循环不使用n，它会在那里占用寄存器，造成更多溢出
+      u32 max_depth = 0, max_use_depth = 0;
+      for (MachineBB *x : region) {
+        max_depth = std::max(max_depth, x->loop_depth);
+        if (std::find(use_bbs.begin(), use_bbs.end(), x) != use_bbs.end()) {
+          max_use_depth = std::max(max_use_depth, x->loop_depth);
         }
       }
-      // def
-      for (auto &d : def) {
-        if (d.needs_color() && bb->liveuse.find(d) == bb->liveuse.end()) {
-          bb->def.insert(d);
+      if (max_use_depth < max_depth) continue;
+      // 循环中的寄存器压力已经满了时，新的虚拟寄存器也会被溢出，拆分只会增加溢出的轮数
+      if (std::any_of(region.begin(), region.end(),
+                      [&](MachineBB *x) { return max_pressure(f, x, spilled_nodes) >= NUM_ALLOCATABLE - 1; })) {
+        continue;
+      }
+      // 入边的起点是region外(循环深度更小)的前驱，在它的跳转指令前读取，这之后不能再定义n
+      std::vector<MachineBB *> entries;
+      for (MachineBB *x : region) {
+        for (MachineBB *pred : x->pred) {
+          if (pred->loop_depth < depth && std::find(entries.begin(), entries.end(), pred) == entries.end()) {
+            entries.push_back(pred);
+          }
         }
       }
+      bool ok = std::all_of(entries.begin(), entries.end(), [&](MachineBB *pred) {
+        for (auto inst = pred->control_transfer_inst; inst; inst = inst->next) {
+          if (auto def = get_def_use_ptr(inst).first; def && *def == n) return false;
+        }
+        return true;
+      });
+      if (!ok) continue;
+      auto split = "Splitting v" + std::to_string(n.value) + " at the " + std::to_string(entries.size()) +
+                   " entries of a loop of depth " + std::to_string(depth);
+      dbg(split);
+      i32 vreg = f->virtual_max++;
+      split_vregs.insert(vreg);
+      for (MachineBB *x : region) region_vreg[x] = vreg;
+      for (MachineBB *pred : entries) {
+        auto load_inst = pred->control_transfer_inst ? new MILoad(pred->control_transfer_inst) : new MILoad(pred);
+        load_inst->addr = MachineOperand::R(ArmReg::sp);
+        load_inst->shift = 0;
+        generate_access_offset(load_inst);
+        load_inst->dst = MachineOperand::V(vreg);
+      }
     }
-    // initial values
-    bb->livein = bb->liveuse;
-    bb->liveout.clear();
   }
 
-  // calculate LiveIn and LiveOut for each bb
-  bool changed = true;
-  while (changed) {
-    changed = false;
-    for (auto bb = f->bb.head; bb; bb = bb->next) {
-      std::set<MachineOperand> new_out;
-      for (auto &succ : bb->succ) {
-        if (succ) {
-          new_out.insert(succ->livein.begin(), succ->livein.end());
+  for (auto &[bb, insts] : refs) {
+    if (auto it = region_vreg.find(bb); it != region_vreg.end()) {
+      for (MachineInst *inst : insts) {
+        for (auto &u : get_def_use_ptr(inst).second) {
+          if (*u == n) u->value = it->second;
         }
       }
+      continue;
+    }
+
+    // generate a MILoad (or recompute the value) before first use, and a MIStore after last def
+    MachineInst *first_use = nullptr;
+    MachineInst *last_def = nullptr;
+    i32 vreg = -1;
+    auto checkpoint = [&]() {
+      if (first_use && remat) {
+        rematerialize(remat, first_use, MachineOperand::V(vreg));
+        first_use = nullptr;
+      } else if (first_use) {
+        auto load_inst = new MILoad(first_use);
+        load_inst->bb = bb;
+        load_inst->addr = MachineOperand::R(ArmReg::sp);
+        load_inst->shift = 0;
+        generate_access_offset(load_inst);
+        load_inst->dst = MachineOperand::V(vreg);
+        first_use = nullptr;
+      }
 
-      if (new_out != bb->liveout) {
-        changed = true;
-        bb->liveout = new_out;
-        std::set<MachineOperand> new_in = bb->liveuse;
-        for (auto &e : bb->liveout) {
-          if (bb->def.find(e) == bb->def.end()) {
-            new_in.insert(e);
+      if (last_def) {
+        auto store_inst = new MIStore();
+        store_inst->bb = bb;
+        store_inst->addr = MachineOperand::R(ArmReg::sp);
+        store_inst->shift = 0;
+        bb->insts.insertAfter(store_inst, last_def);
+        generate_access_offset(store_inst);
+        store_inst->data = MachineOperand::V(vreg);
+        last_def = nullptr;
+      }
+      vreg = -1;
+    };
+
+    auto rewrite = [&](MachineInst *orig_inst) {
+      auto [def, use] = get_def_use_ptr(orig_inst);
+      if (def && *def == n && !remat) {
+        // store
+        if (vreg == -1) {
+          vreg = f->virtual_max++;
+        }
+        def->value = vreg;
+        last_def = orig_inst;
+      }
+
+      for (auto &u : use) {
+        if (*u == n) {
+          // load
+          if (vreg == -1) {
+            vreg = f->virtual_max++;
+          }
+          u->value = vreg;
+          if (!first_use && !last_def) {
+            first_use = orig_inst;
           }
         }
+      }
+    };
+
+    // bb的前32条指令共用一个新的虚拟寄存器，之后每条指令都单独读取和写入(don't span vreg for too long)
+    // 所以前32条指令之后只需要访问insts中的指令，不用遍历整个bb
+    auto ref = insts.begin();
+    auto orig_inst = bb->insts.head;
+    for (u32 i = 0; orig_inst && i < 32; orig_inst = orig_inst->next, ++i) {
+      if (ref != insts.end() && *ref == orig_inst) rewrite(*ref++);
+    }
+    checkpoint();
+    for (; ref != insts.end(); ++ref) {
+      rewrite(*ref);
+      checkpoint();
+    }
+  }
+  if (remat) {
+    for (auto d : defs) d->bb->insts.remove(d);
+  } else {
+    f->stack_size += 4;  // increase stack size
+  }
+}
 
-        bb->livein = new_in;
+// 溢出这一轮的所有结点，只遍历一次函数找到它们的定义和使用
+static void spill_nodes(MachineFunc *f, const std::set<u32> &spilled_nodes, const std::vector<u32> &loop_cnt,
+                        std::unordered_set<i32> &split_vregs) {
+  std::unordered_map<u32, SpillSites> sites;
+  for (u32 node : spilled_nodes) sites[node];
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use_ptr(inst);
+      auto add_ref = [&](SpillSites &s) {
+        if (s.refs.empty() || s.refs.back().first != bb) s.refs.push_back({bb, {}});
+        auto &insts = s.refs.back().second;
+        if (insts.empty() || insts.back() != inst) insts.push_back(inst);
+      };
+      if (def && def->is_virtual()) {
+        if (auto it = sites.find(def->reg_index()); it != sites.end()) {
+          it->second.defs.push_back(inst);
+          it->second.def_bbs.insert(bb);
+          add_ref(it->second);
+        }
+      }
+      for (auto u : use) {
+        if (!u->is_virtual()) continue;
+        if (auto it = sites.find(u->reg_index()); it != sites.end()) {
+          auto &use_bbs = it->second.use_bbs;
+          if (use_bbs.empty() || use_bbs.back() != bb) use_bbs.push_back(bb);
+          add_ref(it->second);
+        }
       }
     }
-  };
+  }
+  for (u32 node : spilled_nodes) spill_node(f, node, sites[node], loop_cnt[node], spilled_nodes, split_vregs);
 }
 
 // iterated register coalescing
-void allocate_register(MachineProgram *p) {
-  for (auto f = p->func.head; f; f = f->next) {
-    auto loop_info = compute_loop_info(f->func);
-    dbg(f->func->func->name);
-    bool done = false;
-    while (!done) {
-      liveness_analysis(f);
-      // interference graph
-      // each node is a MachineOperand
-      // can only Precolored or Virtual
-      // adjacent list
-      std::map<MachineOperand, std::set<MachineOperand>> adj_list;
-      // adjacent set
-      std::set<std::pair<MachineOperand, MachineOperand>> adj_set;
-      // other variables in the paper
-      std::map<MachineOperand, u32> degree;
-      std::map<MachineOperand, MachineOperand> alias;
-      std::map<MachineOperand, std::set<MIMove *, MIMoveCompare>> move_list;
-      std::set<MachineOperand> simplify_worklist;
-      std::set<MachineOperand> freeze_worklist;
-      std::set<MachineOperand> spill_worklist;
-      std::set<MachineOperand> spilled_nodes;
-      std::set<MachineOperand> coalesced_nodes;
-      std::vector<MachineOperand> colored_nodes;
-      std::vector<MachineOperand> select_stack;
-      std::set<MIMove *, MIMoveCompare> coalesced_moves;
-      std::set<MIMove *, MIMoveCompare> constrained_moves;
-      std::set<MIMove *, MIMoveCompare> frozen_moves;
-      std::set<MIMove *, MIMoveCompare> worklist_moves;
-      std::set<MIMove *, MIMoveCompare> active_moves;
-      // for heuristic
-      std::map<MachineOperand, u32> loop_cnt;
-
-      // allocatable registers: r0 to r11, r12(ip), lr
-      constexpr u32 k = (u32)ArmReg::r12 - (u32)ArmReg::r0 + 1 + 1;
-      // init degree for pre colored nodes
-      for (u32 i = (u32)ArmReg::r0; i <= (u32)ArmReg::lr; i++) {
-        auto op = MachineOperand::R((ArmReg)i);
-        // very large
-        degree[op] = 0x40000000;
-      }
-
-      // procedure AddEdge(u, v)
-      auto add_edge = [&](MachineOperand u, MachineOperand v) {
-        if (adj_set.find({u, v}) == adj_set.end() && u != v) {
-          if (debug_mode) {
-            auto interference = std::string(u) + " <-> " + std::string(v);
-            dbg(interference);
-          }
-          adj_set.insert({u, v});
-          adj_set.insert({v, u});
-          if (!u.is_precolored()) {
-            adj_list[u].insert(v);
-            degree[u]++;
-          }
-          if (!v.is_precolored()) {
-            adj_list[v].insert(u);
-            degree[v]++;
-          }
-        }
-      };
+static void color_registers(MachineFunc *f) {
+  dbg(f->func->func->name);
+  // 溢出时拆分出的虚拟寄存器，它们的定义都是从栈槽读取
+  std::unordered_set<i32> split_vregs;
+  bool done = false;
+  while (!done) {
+    liveness_analysis(f);
+    // interference graph
+    // each node is a Precolored or Virtual MachineOperand, indexed by node_of
+    const u32 n = MachineOperand::NUM_PRECOLORED + f->virtual_max;
+    // adjacent list, only for virtual nodes
+    std::vector<std::vector<u32>> adj_list(n);
+    // adjacent set
+    AdjMatrix adj_set(n);
+    // other variables in the paper
+    std::vector<u32> degree(n);
+    std::vector<u32> alias(n);
+    std::vector<std::set<MIMove *, MIMoveCompare>> move_list(n);
+    // worklists are ordered, the smallest node is picked first
+    std::set<u32> simplify_worklist;
+    std::set<u32> freeze_worklist;
+    std::set<u32> spill_worklist;
+    std::set<u32> spilled_nodes;
+    std::vector<u32> coalesced_nodes;
+    std::vector<bool> is_coalesced(n);
+    std::vector<u32> select_stack;
+    std::vector<bool> in_select_stack(n);
+    std::set<MIMove *, MIMoveCompare> coalesced_moves;
+    std::set<MIMove *, MIMoveCompare> constrained_moves;
+    std::set<MIMove *, MIMoveCompare> frozen_moves;
+    std::set<MIMove *, MIMoveCompare> worklist_moves;
+    std::set<MIMove *, MIMoveCompare> active_moves;
+    // for heuristic
+    std::vector<u32> loop_cnt(n);
+
+    constexpr u32 k = NUM_ALLOCATABLE;
+    // init degree for pre colored nodes
+    for (u32 i = (u32)ArmReg::r0; i <= (u32)ArmReg::lr; i++) {
+      // very large
+      degree[i] = 0x40000000;
+    }
+
+    auto is_precolored = [](u32 u) { return u < MachineOperand::NUM_PRECOLORED; };
 
-      // procedure Build()
-      auto build = [&]() {
-        // build interference graph
-        for (auto bb = f->bb.tail; bb; bb = bb->prev) {
-          // calculate live set before each instruction
-          auto live = bb->liveout;
-          for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
-            auto [def, use] = get_def_use(inst);
-            if (auto x = dyn_cast<MIMove>(inst)) {
-              if (x->dst.needs_color() && x->rhs.needs_color() && x->is_simple()) {
-                live.erase(x->rhs);
-                move_list[x->rhs].insert(x);
-                move_list[x->dst].insert(x);
-                worklist_moves.insert(x);
-              }
+    // procedure AddEdge(u, v)
+    auto add_edge = [&](u32 u, u32 v) {
+      if (u != v && !adj_set.test(u, v)) {
+        if (debug_mode) {
+          auto interference =
+              std::string(MachineOperand::from_reg_index(u)) + " <-> " + std::string(MachineOperand::from_reg_index(v));
+          dbg(interference);
+        }
+        adj_set.set(u, v);
+        if (!is_precolored(u)) {
+          adj_list[u].push_back(v);
+          degree[u]++;
+        }
+        if (!is_precolored(v)) {
+          adj_list[v].push_back(u);
+          degree[v]++;
+        }
+      }
+    };
+
+    // procedure Build()
+    auto build = [&]() {
+      // build interference graph
+      for (auto bb = f->bb.tail; bb; bb = bb->prev) {
+        // calculate live set before each instruction
+        auto live = bb->liveout;
+        for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+          auto [def, use] = get_def_use(inst);
+          if (auto x = dyn_cast<MIMove>(inst)) {
+            if (x->dst.needs_color() && x->rhs.needs_color() && x->is_simple()) {
+              live.reset(x->rhs.reg_index());
+              move_list[x->rhs.reg_index()].insert(x);
+              move_list[x->dst.reg_index()].insert(x);
+              worklist_moves.insert(x);
             }
+          }
 
-            for (auto &d : def) {
-              if (d.needs_color()) {
-                live.insert(d);
-              }
+          for (auto &d : def) {
+            if (d.needs_color()) {
+              live.set(d.reg_index());
             }
+          }
 
-            for (auto &d : def) {
-              if (d.needs_color()) {
-                for (auto &l : live) {
-                  add_edge(l, d);
-                }
-              }
+          for (auto &d : def) {
+            if (d.needs_color()) {
+              live.for_each([&](u32 l) { add_edge(l, d.reg_index()); });
             }
+          }
 
-            for (auto &d : def) {
-              if (d.needs_color()) {
-                live.erase(d);
-                loop_cnt[d] += loop_info.depth_of(bb->bb);
-              }
+          for (auto &d : def) {
+            if (d.needs_color()) {
+              live.reset(d.reg_index());
+              loop_cnt[d.reg_index()] += bb->loop_depth;
             }
+          }
 
-            for (auto &u : use) {
-              if (u.needs_color()) {
-                live.insert(u);
-                loop_cnt[u] += loop_info.depth_of(bb->bb);
-              }
+          for (auto &u : use) {
+            if (u.needs_color()) {
+              live.set(u.reg_index());
+              loop_cnt[u.reg_index()] += bb->loop_depth;
             }
           }
         }
-      };
+      }
+    };
 
-      auto adjacent = [&](MachineOperand n) {
-        std::set<MachineOperand> res = adj_list[n];
-        for (auto it = res.begin(); it != res.end();) {
-          if (std::find(select_stack.begin(), select_stack.end(), *it) == select_stack.end() &&
-              std::find(coalesced_nodes.begin(), coalesced_nodes.end(), *it) == coalesced_nodes.end()) {
-            it++;
-          } else {
-            it = res.erase(it);
-          }
+    auto adjacent = [&](u32 n) {
+      std::vector<u32> res;
+      res.reserve(adj_list[n].size());
+      for (u32 a : adj_list[n]) {
+        if (!in_select_stack[a] && !is_coalesced[a]) {
+          res.push_back(a);
         }
-        return res;
-      };
+      }
+      return res;
+    };
+
+    auto node_moves = [&](u32 n) {
+      std::set<MIMove *, MIMoveCompare> res = move_list[n];
+      for (auto it = res.begin(); it != res.end();) {
+        if (active_moves.find(*it) == active_moves.end() && worklist_moves.find(*it) == worklist_moves.end()) {
+          it = res.erase(it);
+        } else {
+          it++;
+        }
+      }
+      return res;
+    };
 
-      auto node_moves = [&](MachineOperand n) {
-        std::set<MIMove *, MIMoveCompare> res = move_list[n];
-        for (auto it = res.begin(); it != res.end();) {
-          if (active_moves.find(*it) == active_moves.end() && worklist_moves.find(*it) == worklist_moves.end()) {
-            it = res.erase(it);
-          } else {
-            it++;
-          }
+    auto move_related = [&](u32 n) {
+      for (auto m : move_list[n]) {
+        if (active_moves.find(m) != active_moves.end() || worklist_moves.find(m) != worklist_moves.end()) {
+          return true;
         }
-        return res;
-      };
+      }
+      return false;
+    };
+
+    auto mk_worklist = [&]() {
+      for (u32 i = MachineOperand::NUM_PRECOLORED; i < n; i++) {
+        // initial
+        if (degree[i] >= k) {
+          spill_worklist.insert(i);
+        } else if (move_related(i)) {
+          freeze_worklist.insert(i);
+        } else {
+          simplify_worklist.insert(i);
+        }
+      }
+    };
 
-      auto move_related = [&](MachineOperand n) { return !node_moves(n).empty(); };
-
-      auto mk_worklist = [&]() {
-        for (u32 i = 0; i < f->virtual_max; i++) {
-          // initial
-          auto vreg = MachineOperand::V(i);
-          if (degree[vreg] >= k) {
-            spill_worklist.insert(vreg);
-          } else if (move_related(vreg)) {
-            freeze_worklist.insert(vreg);
-          } else {
-            simplify_worklist.insert(vreg);
-          }
+    // EnableMoves({m} u Adjacent(m))
+    auto enable_moves = [&](u32 n) {
+      for (auto m : node_moves(n)) {
+        if (active_moves.find(m) != active_moves.end()) {
+          active_moves.erase(m);
+          worklist_moves.insert(m);
         }
-      };
+      }
 
-      // EnableMoves({m} u Adjacent(m))
-      auto enable_moves = [&](MachineOperand n) {
-        for (auto m : node_moves(n)) {
+      for (auto a : adjacent(n)) {
+        for (auto m : node_moves(a)) {
           if (active_moves.find(m) != active_moves.end()) {
             active_moves.erase(m);
             worklist_moves.insert(m);
           }
         }
-
-        for (auto a : adjacent(n)) {
-          for (auto m : node_moves(a)) {
-            if (active_moves.find(m) != active_moves.end()) {
-              active_moves.erase(m);
-              worklist_moves.insert(m);
-            }
-          }
+      }
+    };
+
+    auto decrement_degree = [&](u32 m) {
+      auto d = degree[m];
+      degree[m] = d - 1;
+      if (d == k) {
+        enable_moves(m);
+        spill_worklist.insert(m);
+        if (move_related(m)) {
+          freeze_worklist.insert(m);
+        } else {
+          simplify_worklist.insert(m);
         }
-      };
+      }
+    };
+
+    auto simplify = [&]() {
+      auto it = simplify_worklist.begin();
+      auto n = *it;
+      simplify_worklist.erase(it);
+      select_stack.push_back(n);
+      in_select_stack[n] = true;
+      for (auto &m : adjacent(n)) {
+        decrement_degree(m);
+      }
+    };
 
-      auto decrement_degree = [&](MachineOperand m) {
-        auto d = degree[m];
-        degree[m] = d - 1;
-        if (d == k) {
-          enable_moves(m);
-          spill_worklist.insert(m);
-          if (move_related(m)) {
-            freeze_worklist.insert(m);
-          } else {
-            simplify_worklist.insert(m);
-          }
-        }
-      };
+    // procedure GetAlias(n)
+    auto get_alias = [&](u32 n) -> u32 {
+      while (is_coalesced[n]) {
+        n = alias[n];
+      }
+      return n;
+    };
 
-      auto simplify = [&]() {
-        auto it = simplify_worklist.begin();
-        auto n = *it;
-        simplify_worklist.erase(it);
-        select_stack.push_back(n);
-        for (auto &m : adjacent(n)) {
-          decrement_degree(m);
-        }
-      };
+    // procedure AddWorkList(n)
+    auto add_work_list = [&](u32 u) {
+      if (!is_precolored(u) && !move_related(u) && degree[u] < k) {
+        freeze_worklist.erase(u);
+        simplify_worklist.insert(u);
+      }
+    };
 
-      // procedure GetAlias(n)
-      auto get_alias = [&](MachineOperand n) -> MachineOperand {
-        while (std::find(coalesced_nodes.begin(), coalesced_nodes.end(), n) != coalesced_nodes.end()) {
-          n = alias[n];
-        }
-        return n;
-      };
+    auto ok = [&](u32 t, u32 r) { return degree[t] < k || is_precolored(t) || adj_set.test(t, r); };
 
-      // procedure AddWorkList(n)
-      auto add_work_list = [&](MachineOperand u) {
-        if (!u.is_precolored() && !move_related(u) && degree[u] < k) {
-          freeze_worklist.erase(u);
-          simplify_worklist.insert(u);
+    auto adj_ok = [&](u32 v, u32 u) {
+      for (auto t : adjacent(v)) {
+        if (!ok(t, u)) {
+          return false;
         }
-      };
+      }
+      return true;
+    };
+
+    // procedure Combine(u, v)
+    auto combine = [&](u32 u, u32 v) {
+      auto it = freeze_worklist.find(v);
+      if (it != freeze_worklist.end()) {
+        freeze_worklist.erase(it);
+      } else {
+        spill_worklist.erase(v);
+      }
 
-      auto ok = [&](MachineOperand t, MachineOperand r) {
-        return degree[t] < k || t.is_precolored() || adj_set.find({t, r}) != adj_set.end();
-      };
+      coalesced_nodes.push_back(v);
+      is_coalesced[v] = true;
+      alias[v] = u;
+      // NOTE: nodeMoves should be moveList
+      auto &m = move_list[u];
+      for (auto n : move_list[v]) {
+        m.insert(n);
+      }
+      for (auto t : adjacent(v)) {
+        add_edge(t, u);
+        decrement_degree(t);
+      }
 
-      auto adj_ok = [&](MachineOperand v, MachineOperand u) {
-        for (auto t : adjacent(v)) {
-          if (!ok(t, u)) {
-            return false;
+      if (degree[u] >= k && freeze_worklist.find(u) != freeze_worklist.end()) {
+        freeze_worklist.erase(u);
+        spill_worklist.insert(u);
+      }
+    };
+
+    // the node can appear in both adj_u and adj_v, count it only once
+    std::vector<bool> counted(n);
+    auto conservative = [&](const std::vector<u32> &adj_u, const std::vector<u32> &adj_v) {
+      u32 count = 0;
+      for (auto *adj : {&adj_u, &adj_v}) {
+        for (auto t : *adj) {
+          if (!counted[t]) {
+            counted[t] = true;
+            if (degree[t] >= k) {
+              count++;
+            }
           }
         }
-        return true;
-      };
-
-      // procedure Combine(u, v)
-      auto combine = [&](MachineOperand u, MachineOperand v) {
-        auto it = freeze_worklist.find(v);
-        if (it != freeze_worklist.end()) {
-          freeze_worklist.erase(it);
+      }
+      for (auto t : adj_u) counted[t] = false;
+      for (auto t : adj_v) counted[t] = false;
+
+      return count < k;
+    };
+
+    // procedure Coalesce()
+    auto coalesce = [&]() {
+      auto m = *worklist_moves.begin();
+      auto u = get_alias(m->dst.reg_index());
+      auto v = get_alias(m->rhs.reg_index());
+      // swap when needed
+      if (is_precolored(v)) {
+        std::swap(u, v);
+      }
+      worklist_moves.erase(m);
+
+      if (u == v) {
+        coalesced_moves.insert(m);
+        add_work_list(u);
+      } else if (is_precolored(v) || adj_set.test(u, v)) {
+        constrained_moves.insert(m);
+        add_work_list(u);
+        add_work_list(v);
+      } else if ((is_precolored(u) && adj_ok(v, u)) || (!is_precolored(u) && conservative(adjacent(u), adjacent(v)))) {
+        coalesced_moves.insert(m);
+        combine(u, v);
+        add_work_list(u);
+      } else {
+        active_moves.insert(m);
+      }
+    };
+    // procedure FreezeMoves(u)
+    auto freeze_moves = [&](u32 u) {
+      for (auto m : node_moves(u)) {
+        if (active_moves.find(m) != active_moves.end()) {
+          active_moves.erase(m);
         } else {
-          spill_worklist.erase(v);
+          worklist_moves.erase(m);
         }
+        frozen_moves.insert(m);
 
-        coalesced_nodes.insert(v);
-        alias[v] = u;
-        // NOTE: nodeMoves should be moveList
-        auto &m = move_list[u];
-        for (auto n : move_list[v]) {
-          m.insert(n);
-        }
-        for (auto t : adjacent(v)) {
-          add_edge(t, u);
-          decrement_degree(t);
+        auto v = m->dst.reg_index() == u ? m->rhs.reg_index() : m->dst.reg_index();
+        if (!move_related(v) && degree[v] < k) {
+          freeze_worklist.erase(v);
+          simplify_worklist.insert(v);
         }
-
-        if (degree[u] >= k && freeze_worklist.find(u) != freeze_worklist.end()) {
-          freeze_worklist.erase(u);
-          spill_worklist.insert(u);
+      }
+    };
+
+    // procedure Freeze()
+    auto freeze = [&]() {
+      auto u = *freeze_worklist.begin();
+      freeze_worklist.erase(u);
+      simplify_worklist.insert(u);
+      freeze_moves(u);
+    };
+
+    // procedure SelectSpill()
+    auto select_spill = [&]() {
+      // select node with max degree (heuristic)
+      u32 m = *std::max_element(spill_worklist.begin(), spill_worklist.end(), [&](auto a, auto b) {
+        return float(degree[a]) / pow(2, loop_cnt[a]) < float(degree[b]) / pow(2, loop_cnt[b]);
+      });
+      simplify_worklist.insert(m);
+      freeze_moves(m);
+      spill_worklist.erase(m);
+    };
+
+    // procedure AssignColors()
+    auto assign_colors = [&]() {
+      // mapping from virtual register to its allocated register
+      // state == Immediate means not colored
+      constexpr MachineOperand NOT_COLORED = {MachineOperand::State::Immediate, 0};
+      std::vector<MachineOperand> colored(n, NOT_COLORED);
+      while (!select_stack.empty()) {
+        auto n = select_stack.back();
+        select_stack.pop_back();
+        in_select_stack[n] = false;
+        // bit i set means ri is available
+        u32 ok_colors = ((1u << (k - 1)) - 1) | (1u << (u32)ArmReg::lr);
+
+        for (auto w : adj_list[n]) {
+          auto a = get_alias(w);
+          if (is_precolored(a)) {
+            ok_colors &= ~(1u << a);
+          } else if (colored[a].state != MachineOperand::State::Immediate) {
+            ok_colors &= ~(1u << colored[a].value);
+          }
         }
-      };
 
-      auto conservative = [&](std::set<MachineOperand> adj_u, std::set<MachineOperand> adj_v) {
-        u32 count = 0;
-        // set union
-        for (auto n : adj_v) {
-          adj_u.insert(n);
-        }
-        for (auto n : adj_u) {
-          if (degree[n] >= k) {
-            count++;
-          }
+        if (!ok_colors) {
+          spilled_nodes.insert(n);
+        } else {
+          i32 color = __builtin_ctz(ok_colors);
+          colored[n] = MachineOperand{MachineOperand::State::Allocated, color};
         }
+      }
 
-        return count < k;
-      };
+      // for testing, might not needed
+      if (!spilled_nodes.empty()) {
+        return;
+      }
 
-      // procedure Coalesce()
-      auto coalesce = [&]() {
-        auto m = *worklist_moves.begin();
-        auto u = get_alias(m->dst);
-        auto v = get_alias(m->rhs);
-        // swap when needed
-        if (v.is_precolored()) {
-          auto temp = u;
-          u = v;
-          v = temp;
-        }
-        worklist_moves.erase(m);
-
-        if (u == v) {
-          coalesced_moves.insert(m);
-          add_work_list(u);
-        } else if (v.is_precolored() || adj_set.find({u, v}) != adj_set.end()) {
-          constrained_moves.insert(m);
-          add_work_list(u);
-          add_work_list(v);
-        } else if ((u.is_precolored() && adj_ok(v, u)) ||
-                   (!u.is_precolored() && conservative(adjacent(u), adjacent(v)))) {
-          coalesced_moves.insert(m);
-          combine(u, v);
-          add_work_list(u);
+      for (auto n : coalesced_nodes) {
+        auto a = get_alias(n);
+        if (is_precolored(a)) {
+          colored[n] = MachineOperand::from_reg_index(a);
         } else {
-          active_moves.insert(m);
+          colored[n] = colored[a];
         }
-      };
-      // procedure FreezeMoves(u)
-      auto freeze_moves = [&](MachineOperand u) {
-        for (auto m : node_moves(u)) {
-          if (active_moves.find(m) != active_moves.end()) {
-            active_moves.erase(m);
-          } else {
-            worklist_moves.erase(m);
-          }
-          frozen_moves.insert(m);
+      }
 
-          auto v = m->dst == u ? m->rhs : m->dst;
-          if (!move_related(v) && degree[v] < k) {
-            freeze_worklist.erase(v);
-            simplify_worklist.insert(v);
+      if (debug_mode) {
+        for (u32 i = MachineOperand::NUM_PRECOLORED; i < n; i++) {
+          if (colored[i].state != MachineOperand::State::Immediate) {
+            auto colored_reg = std::string(MachineOperand::from_reg_index(i)) + " => " + std::string(colored[i]);
+            dbg(colored_reg);
           }
         }
-      };
+      }
 
-      // procedure Freeze()
-      auto freeze = [&]() {
-        auto u = *freeze_worklist.begin();
-        freeze_worklist.erase(u);
-        simplify_worklist.insert(u);
-        freeze_moves(u);
+      // replace usage of virtual registers
+      auto replace = [&](MachineOperand *op) {
+        if (op && op->is_virtual() && (u32)op->value < f->virtual_max) {
+          auto &c = colored[op->reg_index()];
+          if (c.state != MachineOperand::State::Immediate) {
+            *op = c;
+          }
+        }
       };
+      for (auto bb = f->bb.head; bb; bb = bb->next) {
+        for (auto inst = bb->insts.head; inst; inst = inst->next) {
+          auto [def, use] = get_def_use_ptr(inst);
+          replace(def);
+          for (auto &u : use) {
+            replace(u);
+          }
+        }
+      }
+    };
 
-      // procedure SelectSpill()
-      auto select_spill = [&]() {
-        MachineOperand m{};
-        // select node with max degree (heuristic)
-        m = *std::max_element(spill_worklist.begin(), spill_worklist.end(), [&](auto a, auto b) {
-          return float(degree[a]) / pow(2, loop_cnt[a]) < float(degree[b]) / pow(2, loop_cnt[b]);
-        });
-        simplify_worklist.insert(m);
-        freeze_moves(m);
-        spill_worklist.erase(m);
-      };
+    build();
+    mk_worklist();
+    do {
+      if (!simplify_worklist.empty()) {
+        simplify();
+      }
+      if (!worklist_moves.empty()) {
+        coalesce();
+      }
+      if (!freeze_worklist.empty()) {
+        freeze();
+      }
+      if (!spill_worklist.empty()) {
+        select_spill();
+      }
+    } while (!simplify_worklist.empty() || !worklist_moves.empty() || !freeze_worklist.empty() ||
+             !spill_worklist.empty());
+    assign_colors();
+    if (spilled_nodes.empty()) {
+      done = true;
+    } else {
+      spill_nodes(f, spilled_nodes, loop_cnt, split_vregs);
+      done = false;
+    }
+  }
+}
 
-      // procedure AssignColors()
-      auto assign_colors = [&]() {
-        // mapping from virtual register to its allocated register
-        std::map<MachineOperand, MachineOperand> colored;
-        while (!select_stack.empty()) {
-          auto n = select_stack.back();
-          select_stack.pop_back();
-          std::set<i32> ok_colors;
-          for (u32 i = 0; i < k - 1; i++) {
-            ok_colors.insert(i);
-          }
-          ok_colors.insert((i32)ArmReg::lr);
-
-          for (auto w : adj_list[n]) {
-            auto a = get_alias(w);
-            if (a.state == MachineOperand::State::Allocated || a.is_precolored()) {
-              ok_colors.erase(a.value);
-            } else if (a.state == MachineOperand::State::Virtual) {
-              auto it = colored.find(a);
-              if (it != colored.end()) {
-                ok_colors.erase(it->second.value);
-              }
-            }
-          }
+// 一个寄存器的生存期，由按起点排序，互不相交的闭区间组成
+using LiveRanges = std::vector<std::pair<u32, u32>>;
+
+// a和b有公共的位置，a不为空
+static bool intersects(const LiveRanges &a, const LiveRanges &b) {
+  auto i = a.begin();
+  auto j = std::lower_bound(b.begin(), b.end(), i->first,
+                            [](const std::pair<u32, u32> &range, u32 x) { return range.second < x; });
+  while (i != a.end() && j != b.end()) {
+    if (i->second < j->first) {
+      ++i;
+    } else if (j->second < i->first) {
+      ++j;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
 
-          if (ok_colors.empty()) {
-            spilled_nodes.insert(n);
-          } else {
-            auto color = *ok_colors.begin();
-            colored[n] = MachineOperand{MachineOperand::State::Allocated, color};
+// linear scan
+// 按bb的顺序给指令编号，第i条指令在2i读取操作数，在2i+1写入结果，每个寄存器的生存期是它活跃的位置组成的若干个区间
+// 生存期中的空洞(例如循环中phi的旧值最后一次使用之后)可以分配给其他虚拟寄存器，所以phi的move两端经常分配到同一个寄存器
+// 按生存期的起点依次分配，没有可用的寄存器时，像select_spill一样溢出长度除以2^loop_cnt最大的一个，溢出的代码和color_registers相同
+static void linear_scan(MachineFunc *f) {
+  dbg(f->func->func->name);
+  std::unordered_set<i32> split_vregs;
+  constexpr u32 ALLOCATABLE = ((1u << (NUM_ALLOCATABLE - 1)) - 1) | (1u << (u32)ArmReg::lr);
+  auto tracked = [](const MachineOperand &x) {
+    return x.is_virtual() || (x.state == MachineOperand::State::PreColored && (ALLOCATABLE >> x.value & 1));
+  };
+  while (true) {
+    liveness_analysis(f);
+    const u32 n = MachineOperand::NUM_PRECOLORED + f->virtual_max;
+    // 下标为reg_index，预着色的寄存器的生存期在这里，它们不能分配给与之相交的虚拟寄存器
+    std::vector<LiveRanges> ranges(n);
+    std::vector<u32> loop_cnt(n);
+    // 通过move相关的寄存器，分配时优先选择它们的寄存器，这样move的两端相同，可以被simplify_asm删除
+    std::vector<std::vector<u32>> hints(n);
+
+    // open[i]为i在当前bb中活跃到的位置，~0u表示不活跃
+    std::vector<u32> open(n, ~0u);
+    std::vector<u32> opened;
+    u32 pos = 0;
+    for (auto bb = f->bb.head; bb; bb = bb->next) {
+      u32 bb_begin = pos;
+      for (auto inst = bb->insts.head; inst; inst = inst->next) pos += 2;
+      if (bb_begin == pos) continue;
+      bb->liveout.for_each([&](u32 i) {
+        if (tracked(MachineOperand::from_reg_index(i))) {
+          open[i] = pos - 1;
+          opened.push_back(i);
+        }
+      });
+      u32 p = pos;
+      for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+        p -= 2;
+        auto [def, use] = get_def_use(inst);
+        for (auto &d : def) {
+          if (!tracked(d)) continue;
+          u32 i = d.reg_index();
+          ranges[i].emplace_back(p + 1, open[i] == ~0u ? p + 1 : open[i]);
+          open[i] = ~0u;
+          loop_cnt[i] += bb->loop_depth;
+        }
+        for (auto &u : use) {
+          if (!tracked(u)) continue;
+          u32 i = u.reg_index();
+          if (open[i] == ~0u) {
+            open[i] = p;
+            opened.push_back(i);
           }
+          loop_cnt[i] += bb->loop_depth;
         }
-
-        // for testing, might not needed
-        if (!spilled_nodes.empty()) {
-          return;
+        if (auto x = dyn_cast<MIMove>(inst); x && x->is_simple() && tracked(x->dst) && tracked(x->rhs)) {
+          hints[x->dst.reg_index()].push_back(x->rhs.reg_index());
+          hints[x->rhs.reg_index()].push_back(x->dst.reg_index());
         }
-
-        for (auto n : coalesced_nodes) {
-          auto a = get_alias(n);
-          if (a.is_precolored()) {
-            colored[n] = a;
-          } else {
-            colored[n] = colored[a];
-          }
+      }
+      for (u32 i : opened) {
+        if (open[i] != ~0u) ranges[i].emplace_back(bb_begin, open[i]);
+        open[i] = ~0u;
+      }
+      opened.clear();
+    }
+    // 排序，合并相邻的区间
+    for (auto &r : ranges) {
+      std::sort(r.begin(), r.end());
+      u32 m = 0;
+      for (auto &range : r) {
+        if (m && r[m - 1].second + 1 >= range.first) {
+          r[m - 1].second = std::max(r[m - 1].second, range.second);
+        } else {
+          r[m++] = range;
         }
+      }
+      r.resize(m);
+    }
 
-        if (debug_mode) {
-          for (auto &[before, after] : colored) {
-            auto colored = std::string(before) + " => " + std::string(after);
-            dbg(colored);
+    std::vector<u32> intervals;
+    for (u32 i = MachineOperand::NUM_PRECOLORED; i < n; ++i) {
+      if (!ranges[i].empty()) intervals.push_back(i);
+    }
+    auto begin = [&](u32 i) { return ranges[i].front().first; };
+    auto end = [&](u32 i) { return ranges[i].back().second; };
+    std::stable_sort(intervals.begin(), intervals.end(), [&](u32 a, u32 b) { return begin(a) < begin(b); });
+
+    auto spill_priority = [&](u32 i) { return float(end(i) - begin(i) + 1) / pow(2, loop_cnt[i]); };
+    std::vector<i32> reg(n, -1);
+    // 分配到每个寄存器的，还没有结束的虚拟寄存器
+    std::vector<u32> assigned[MachineOperand::NUM_PRECOLORED];
+    std::set<u32> spilled_nodes;
+    for (u32 cur : intervals) {
+      u32 ok_regs = 0;
+      // 寄存器r上唯一与cur相交的虚拟寄存器，可以溢出它把r给cur
+      std::vector<i32> single_conflict(MachineOperand::NUM_PRECOLORED, -1);
+      for (u32 r = 0; r < MachineOperand::NUM_PRECOLORED; ++r) {
+        if (!(ALLOCATABLE >> r & 1)) continue;
+        auto &vs = assigned[r];
+        vs.erase(std::remove_if(vs.begin(), vs.end(), [&](u32 a) { return end(a) < begin(cur); }), vs.end());
+        if (intersects(ranges[cur], ranges[r])) continue;
+        u32 conflicts = 0;
+        for (u32 a : vs) {
+          if (intersects(ranges[cur], ranges[a])) {
+            ++conflicts;
+            single_conflict[r] = a;
           }
         }
-
-        // replace usage of virtual registers
-        for (auto bb = f->bb.head; bb; bb = bb->next) {
-          for (auto inst = bb->insts.head; inst; inst = inst->next) {
-            auto [def, use] = get_def_use_ptr(inst);
-            if (def && colored.find(*def) != colored.end()) {
-              *def = colored[*def];
-            }
-
-            for (auto &u : use) {
-              if (u && colored.find(*u) != colored.end()) {
-                *u = colored[*u];
-              }
-            }
+        if (conflicts == 0) ok_regs |= 1u << r;
+        if (conflicts != 1) single_conflict[r] = -1;
+      }
+      if (ok_regs) {
+        i32 r = __builtin_ctz(ok_regs);
+        for (u32 h : hints[cur]) {
+          i32 hint = h < MachineOperand::NUM_PRECOLORED ? (i32)h : reg[h];
+          if (hint != -1 && (ok_regs >> hint & 1)) {
+            r = hint;
+            break;
           }
         }
-      };
+        reg[cur] = r;
+        assigned[r].push_back(cur);
+        continue;
+      }
+      u32 victim = cur;
+      for (u32 r = 0; r < MachineOperand::NUM_PRECOLORED; ++r) {
+        i32 a = single_conflict[r];
+        if (a != -1 && spill_priority(a) > spill_priority(victim)) victim = a;
+      }
+      if (victim != cur) {
+        i32 r = reg[victim];
+        reg[cur] = r;
+        reg[victim] = -1;
+        std::replace(assigned[r].begin(), assigned[r].end(), victim, cur);
+      }
+      spilled_nodes.insert(victim);
+    }
 
-      build();
-      mk_worklist();
-      do {
-        if (!simplify_worklist.empty()) {
-          simplify();
-        }
-        if (!worklist_moves.empty()) {
-          coalesce();
-        }
-        if (!freeze_worklist.empty()) {
-          freeze();
-        }
-        if (!spill_worklist.empty()) {
-          select_spill();
-        }
-      } while (!simplify_worklist.empty() || !worklist_moves.empty() || !freeze_worklist.empty() ||
-               !spill_worklist.empty());
-      assign_colors();
-      if (spilled_nodes.empty()) {
-        done = true;
-      } else {
-        for (auto &n : spilled_nodes) {
-          auto spill = "Spilling v" + std::to_string(n.value) + " with loop count of " + std::to_string(loop_cnt[n]);
-          dbg(spill);
-          // allocate on stack
-          for (auto bb = f->bb.head; bb; bb = bb->next) {
-            auto offset = f->stack_size;
-            auto offset_imm = MachineOperand::I(offset);
-
-            auto generate_access_offset = [&](MIAccess *access_inst) {
-              if (offset < (1u << 12u)) {  // ldr / str has only imm12
-                access_inst->offset = offset_imm;
-              } else {
-                auto mv_inst = new MIMove(access_inst);  // insert before access
-                mv_inst->rhs = offset_imm;
-                mv_inst->dst = MachineOperand::V(f->virtual_max++);
-                access_inst->offset = mv_inst->dst;
-              }
-            };
-
-            // generate a MILoad before first use, and a MIStore after last def
-            MachineInst *first_use = nullptr;
-            MachineInst *last_def = nullptr;
-            i32 vreg = -1;
-            auto checkpoint = [&]() {
-              if (first_use) {
-                auto load_inst = new MILoad(first_use);
-                load_inst->bb = bb;
-                load_inst->addr = MachineOperand::R(ArmReg::sp);
-                load_inst->shift = 0;
-                generate_access_offset(load_inst);
-                load_inst->dst = MachineOperand::V(vreg);
-                first_use = nullptr;
-              }
-
-              if (last_def) {
-                auto store_inst = new MIStore();
-                store_inst->bb = bb;
-                store_inst->addr = MachineOperand::R(ArmReg::sp);
-                store_inst->shift = 0;
-                bb->insts.insertAfter(store_inst, last_def);
-                generate_access_offset(store_inst);
-                store_inst->data = MachineOperand::V(vreg);
-                last_def = nullptr;
-              }
-              vreg = -1;
-            };
-
-            int i = 0;
-            for (auto orig_inst = bb->insts.head; orig_inst; orig_inst = orig_inst->next) {
-              auto [def, use] = get_def_use_ptr(orig_inst);
-              if (def && *def == n) {
-                // store
-                if (vreg == -1) {
-                  vreg = f->virtual_max++;
-                }
-                def->value = vreg;
-                last_def = orig_inst;
-              }
-
-              for (auto &u : use) {
-                if (*u == n) {
-                  // load
-                  if (vreg == -1) {
-                    vreg = f->virtual_max++;
-                  }
-                  u->value = vreg;
-                  if (!first_use && !last_def) {
-                    first_use = orig_inst;
-                  }
-                }
-              }
-
-              if (i++ > 30) {
-                // don't span vreg for too long
-                checkpoint();
-              }
+    if (spilled_nodes.empty()) {
+      for (auto bb = f->bb.head; bb; bb = bb->next) {
+        for (auto inst = bb->insts.head; inst; inst = inst->next) {
+          auto [def, use] = get_def_use_ptr(inst);
+          use.push_back(def);
+          for (auto op : use) {
+            if (op && op->is_virtual() && (u32)op->value < f->virtual_max) {
+              *op = MachineOperand{MachineOperand::State::Allocated, reg[op->reg_index()]};
             }
-
-            checkpoint();
           }
-          f->stack_size += 4;  // increase stack size
         }
-        done = false;
       }
+      return;
     }
+    spill_nodes(f, spilled_nodes, loop_cnt, split_vregs);
   }
 }
+
+void allocate_register(MachineFunc *f) { color_registers(f); }
+
+void allocate_register_linear(MachineFunc *f) { linear_scan(f); }
@@ -4,5 +4,10 @@
 #include "../../structure/ir.hpp"
 #include "../../structure/machine_code.hpp"
 
-void allocate_register(MachineProgram *p);
-std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use(MachineInst *inst);
+// allocatable registers: r0 to r11, r12(ip), lr
+constexpr u32 NUM_ALLOCATABLE = (u32)ArmReg::r12 - (u32)ArmReg::r0 + 1 + 1;
+
+void allocate_register(MachineFunc *f);
+// linear scan allocator with lifetime holes, much cheaper to run than allocate_register on large functions
+// and on par with it in code quality: holes in live ranges and move hints take the place of coalescing
+void allocate_register_linear(MachineFunc *f);
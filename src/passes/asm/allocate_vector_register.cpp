@@ -0,0 +1,109 @@
+// Vector register allocation pass.
+//
+// Assigns q8-q15 to the virtual vector registers of NEON instructions by greedy
+// coloring of their interference graph, preferring the register of a vmov
+// partner or of the accumulator of a vmla so that the vmov can be dropped.
+// These q registers are caller saved, so no prologue or epilogue code is
+// needed, and nothing is ever spilled:
+// vectorize_loop keeps every vector value inside one loop without calls and
+// creates at most NUM_VECTOR_REGS of them per loop, and modulo_schedule only
+// adds copies of them when all the vector registers live in the loop still
+// fit, so a vector register interferes with fewer than NUM_VECTOR_REGS others
+// and a color always exists.
+#include "allocate_vector_register.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+#include "liveness.hpp"
+
+void allocate_vector_register(MachineFunc *f) {
+  const u32 n = f->vector_virtual_max;
+  if (n == 0) return;
+
+  auto live = vector_liveness_analysis(f);
+  std::vector<MachineBB *> bbs;
+  for (auto bb = f->bb.head; bb; bb = bb->next) bbs.push_back(bb);
+
+  // a definition interferes with everything live after it
+  std::vector<RegSet> adj(n, RegSet(n));
+  std::vector<std::vector<i32>> prefer(n);
+  auto add_edge = [&](i32 a, i32 b) {
+    if (a != b) {
+      adj[a].set(b);
+      adj[b].set(a);
+    }
+  };
+  for (MachineBB *bb : bbs) {
+    RegSet now = live[bb].liveout;
+    for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+      auto [def, use] = get_vector_def_use_ptr(inst);
+      if (auto x = dyn_cast<MIVectorMove>(inst)) {
+        prefer[x->dst].push_back(x->src);
+        prefer[x->src].push_back(x->dst);
+      } else if (auto x = dyn_cast<MIVectorFma>(inst)) {
+        prefer[x->dst].push_back(x->acc);
+        prefer[x->acc].push_back(x->dst);
+        // dst is written by the vmov before vmla when it doesn't get the register of acc
+        add_edge(x->dst, x->lhs);
+        add_edge(x->dst, x->rhs);
+      }
+      if (def) {
+        // the source of a vmov holds the same value as its destination, so they may share a register
+        auto move = dyn_cast<MIVectorMove>(inst);
+        now.for_each([&](u32 v) {
+          if (!move || (i32)v != move->src) add_edge(*def, v);
+        });
+        now.reset(*def);
+      }
+      for (i32 *u : use) now.set(*u);
+    }
+  }
+
+  std::vector<i32> color(n, -1);
+  // bit i is set if q(FIRST_VECTOR_REG + i) is taken by a neighbour of v
+  auto used_colors = [&](u32 v) {
+    u32 used = 0;
+    adj[v].for_each([&](u32 w) {
+      if (color[w] >= 0) used |= 1u << (color[w] - FIRST_VECTOR_REG);
+    });
+    return used;
+  };
+  auto lowest_free = [](u32 used) {
+    for (u32 i = 0; i < NUM_VECTOR_REGS; i++) {
+      if (!(used >> i & 1)) return (i32)(FIRST_VECTOR_REG + i);
+    }
+    return -1;
+  };
+  for (u32 v = 0; v < n; v++) {
+    u32 used = used_colors(v);
+    // take the register of a colored partner, or one that an uncolored partner can take later
+    for (i32 w : prefer[v]) {
+      if (color[v] < 0 && color[w] >= 0 && !(used >> (color[w] - FIRST_VECTOR_REG) & 1)) color[v] = color[w];
+    }
+    for (i32 w : prefer[v]) {
+      if (color[v] < 0 && color[w] < 0) color[v] = lowest_free(used | used_colors(w));
+    }
+    if (color[v] < 0) color[v] = lowest_free(used);
+    // vectorize_loop and modulo_schedule guarantee fewer than NUM_VECTOR_REGS neighbours
+    if (color[v] < 0) UNREACHABLE();
+  }
+
+  for (MachineBB *bb : bbs) {
+    for (auto inst = bb->insts.head; inst;) {
+      auto next = inst->next;
+      auto [def, use] = get_vector_def_use_ptr(inst);
+      if (def) *def = color[*def];
+      for (i32 *u : use) *u = color[*u];
+      if (auto x = dyn_cast<MIVectorMove>(inst); x && x->dst == x->src) {
+        bb->insts.remove(x);
+      } else if (auto x = dyn_cast<MIVectorFma>(inst); x && x->dst != x->acc) {
+        auto mv_inst = new MIVectorMove(x);
+        mv_inst->dst = x->dst;
+        mv_inst->src = x->acc;
+        x->acc = x->dst;
+      }
+      inst = next;
+    }
+  }
+}
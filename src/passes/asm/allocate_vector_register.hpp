@@ -0,0 +1,6 @@
+#pragma once
+
+#include "../../structure/machine_code.hpp"
+
+// assign q registers to the virtual vector registers of MIVector instructions
+void allocate_vector_register(MachineFunc *f);
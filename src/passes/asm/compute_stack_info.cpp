@@ -4,7 +4,7 @@
 // argument references.  Example: a call or spilled value that defines r4 marks
 // r4 for push/pop in the final function prologue/epilogue.
 #include "compute_stack_info.hpp"
-#include "allocate_register.hpp"
+#include "liveness.hpp"
 
 void compute_stack_info(MachineFunc *f) {
   for (auto bb = f->bb.head; bb; bb = bb->next) {
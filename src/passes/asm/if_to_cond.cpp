@@ -55,6 +55,22 @@ bool convert_block(MachineBB *bb, MachineInst *end, ArmCond cond, u32 max_count)
   return true;
 }
 
+void clone_move(MIMove *src, MachineInst *insert_before) {
+  // match:
+  // mov r0, r1   (already before insert_before)
+  // mov r1, r0   (src)
+  // r1 already holds the value, the copy is not needed
+  auto last = dyn_cast_nullable<MIMove>(insert_before->prev);
+  if (last && last->is_simple() && src->is_simple() && last->dst.is_equiv(src->rhs) && last->rhs.is_equiv(src->dst)) {
+    dbg("Skipped copying move back to source");
+    return;
+  }
+  auto clone = new MIMove(insert_before);
+  clone->dst = src->dst;
+  clone->rhs = src->rhs;
+  clone->shift = src->shift;
+}
+
 bool rotate_simple_loop(MachineBB *header) {
   MICompare *cmp = nullptr;
   MIBranch *exit_branch = nullptr;
@@ -104,11 +120,7 @@ bool rotate_simple_loop(MachineBB *header) {
   if (!memory_update_loop && !memory_copy_loop && !read_only_compute_loop && !arithmetic_loop) return false;
 
   for (auto inst = header->insts.head; inst != cmp; inst = inst->next) {
-    auto src = static_cast<MIMove *>(inst);
-    auto clone = new MIMove(backedge);
-    clone->dst = src->dst;
-    clone->rhs = src->rhs;
-    clone->shift = src->shift;
+    clone_move(static_cast<MIMove *>(inst), backedge);
   }
 
   auto cmp_clone = new MICompare(body);
@@ -119,11 +131,7 @@ bool rotate_simple_loop(MachineBB *header) {
   cmp_clone->rhs = cmp->rhs;
 
   for (auto inst = cmp->next; inst != exit_branch; inst = inst->next) {
-    auto src = static_cast<MIMove *>(inst);
-    auto clone = new MIMove(backedge);
-    clone->dst = src->dst;
-    clone->rhs = src->rhs;
-    clone->shift = src->shift;
+    clone_move(static_cast<MIMove *>(inst), backedge);
   }
 
   body->insts.remove(backedge);
@@ -139,11 +147,7 @@ bool rotate_simple_loop(MachineBB *header) {
 
 bool clone_header_test(MachineBB *header, MICompare *cmp, MachineInst *insert_before) {
   for (auto inst = header->insts.head; inst != cmp; inst = inst->next) {
-    auto src = static_cast<MIMove *>(inst);
-    auto clone = new MIMove(insert_before);
-    clone->dst = src->dst;
-    clone->rhs = src->rhs;
-    clone->shift = src->shift;
+    clone_move(static_cast<MIMove *>(inst), insert_before);
   }
 
   auto cmp_clone = new MICompare(insert_before->bb);
@@ -0,0 +1,268 @@
+// Machine-level liveness analysis.
+//
+// Register sets are dense bitsets indexed by MachineOperand::reg_index(), so a
+// block's sets cost (16 + virtual_max) / 8 bytes each.  The fixpoint is solved
+// with a worklist seeded in post-order, so successors are usually visited
+// before their predecessors and most blocks are processed only once or twice.
+#include "liveness.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+
+std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use(MachineInst *inst) {
+  std::vector<MachineOperand> def;
+  std::vector<MachineOperand> use;
+
+  if (auto x = dyn_cast<MIBinary>(inst)) {
+    def = {x->dst};
+    use = {x->lhs, x->rhs};
+  } else if (auto x = dyn_cast<MILongMul>(inst)) {
+    def = {x->dst};
+    use = {x->lhs, x->rhs};
+  } else if (auto x = dyn_cast<MIFma>(inst)) {
+    def = {x->dst};
+    use = {x->lhs, x->rhs, x->acc};
+  } else if (auto x = dyn_cast<MIMove>(inst)) {
+    def = {x->dst};
+    use = {x->rhs};
+  } else if (auto x = dyn_cast<MILoad>(inst)) {
+    def = {x->dst};
+    use = {x->addr, x->offset};
+    if (x->mode != MIAccess::Mode::Offset) {
+      def.push_back(x->addr);
+    }
+  } else if (auto x = dyn_cast<MIStore>(inst)) {
+    use = {x->data, x->addr, x->offset};
+    if (x->mode != MIAccess::Mode::Offset) {
+      def.push_back(x->addr);
+    }
+  } else if (auto x = dyn_cast<MICompare>(inst)) {
+    use = {x->lhs, x->rhs};
+  } else if (auto x = dyn_cast<MICall>(inst)) {
+    // args (also caller save)
+    for (u32 i = (u32)ArmReg::r0; i < (u32)ArmReg::r0 + std::min(x->func->params.size(), (size_t)4); ++i) {
+      use.push_back(MachineOperand::R((ArmReg)i));
+    }
+    for (u32 i = (u32)ArmReg::r0; i <= (u32)ArmReg::r3; i++) {
+      def.push_back(MachineOperand::R((ArmReg)i));
+    }
+    def.push_back(MachineOperand::R(ArmReg::lr));
+    def.push_back(MachineOperand::R(ArmReg::ip));
+  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
+    def = {x->dst};
+  } else if (auto x = dyn_cast<MIVectorDup>(inst)) {
+    use = {x->src};
+  } else if (auto x = dyn_cast<MIVectorExtract>(inst)) {
+    def = {x->dst};
+  } else if (auto x = dyn_cast<MIVectorAccess>(inst)) {
+    use = {x->addr};
+  } else if (auto x = dyn_cast<MIReturn>(inst)) {
+    if (x->tail_call) {
+      // args of the tail call
+      for (u32 i = (u32)ArmReg::r0; i < (u32)ArmReg::r0 + x->tail_call->params.size(); ++i) {
+        use.push_back(MachineOperand::R((ArmReg)i));
+      }
+    } else {
+      // ret
+      use.push_back(MachineOperand::R(ArmReg::r0));
+    }
+  }
+  return {def, use};
+}
+
+std::pair<MachineOperand *, std::vector<MachineOperand *>> get_def_use_ptr(MachineInst *inst) {
+  MachineOperand *def = nullptr;
+  std::vector<MachineOperand *> use;
+
+  if (auto x = dyn_cast<MIBinary>(inst)) {
+    def = &x->dst;
+    use = {&x->lhs, &x->rhs};
+  } else if (auto x = dyn_cast<MILongMul>(inst)) {
+    def = &x->dst;
+    use = {&x->lhs, &x->rhs};
+  } else if (auto x = dyn_cast<MIFma>(inst)) {
+    def = {&x->dst};
+    use = {&x->lhs, &x->rhs, &x->acc};
+  } else if (auto x = dyn_cast<MIMove>(inst)) {
+    def = &x->dst;
+    use = {&x->rhs};
+  } else if (auto x = dyn_cast<MILoad>(inst)) {
+    def = &x->dst;
+    use = {&x->addr, &x->offset};
+  } else if (auto x = dyn_cast<MIStore>(inst)) {
+    use = {&x->data, &x->addr, &x->offset};
+  } else if (auto x = dyn_cast<MICompare>(inst)) {
+    use = {&x->lhs, &x->rhs};
+  } else if (isa<MICall>(inst)) {
+    // intentionally blank
+  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
+    def = {&x->dst};
+  } else if (auto x = dyn_cast<MIVectorDup>(inst)) {
+    use = {&x->src};
+  } else if (auto x = dyn_cast<MIVectorExtract>(inst)) {
+    def = &x->dst;
+  } else if (auto x = dyn_cast<MIVectorAccess>(inst)) {
+    use = {&x->addr};
+  }
+  return {def, use};
+}
+
+std::pair<i32 *, std::vector<i32 *>> get_vector_def_use_ptr(MachineInst *inst) {
+  i32 *def = nullptr;
+  std::vector<i32 *> use;
+
+  if (auto x = dyn_cast<MIVectorBinary>(inst)) {
+    def = &x->dst;
+    use = {&x->lhs, &x->rhs};
+  } else if (auto x = dyn_cast<MIVectorFma>(inst)) {
+    def = &x->dst;
+    use = {&x->acc, &x->lhs, &x->rhs};
+  } else if (auto x = dyn_cast<MIVectorMove>(inst)) {
+    def = &x->dst;
+    use = {&x->src};
+  } else if (auto x = dyn_cast<MIVectorDup>(inst)) {
+    def = &x->dst;
+  } else if (auto x = dyn_cast<MIVectorExtract>(inst)) {
+    use = {&x->src};
+  } else if (auto x = dyn_cast<MIVectorLoad>(inst)) {
+    def = &x->dst;
+  } else if (auto x = dyn_cast<MIVectorStore>(inst)) {
+    use = {&x->data};
+  }
+  return {def, use};
+}
+
+void liveness_analysis(MachineFunc *f) {
+  // registers that need color: precolored and virtual
+  const u32 n = MachineOperand::NUM_PRECOLORED + f->virtual_max;
+
+  // calculate LiveUse and Def sets for each bb
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    bb->liveuse = RegSet(n);
+    bb->def = RegSet(n);
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_def_use(inst);
+
+      // liveuse
+      for (auto &u : use) {
+        if (u.needs_color() && !bb->def.test(u.reg_index())) {
+          bb->liveuse.set(u.reg_index());
+        }
+      }
+      // def
+      for (auto &d : def) {
+        if (d.needs_color() && !bb->liveuse.test(d.reg_index())) {
+          bb->def.set(d.reg_index());
+        }
+      }
+    }
+    // initial values
+    bb->livein = bb->liveuse;
+    bb->liveout = RegSet(n);
+  }
+
+  // number bbs, and collect pred from succ (bb->pred is not maintained by every pass)
+  std::unordered_map<MachineBB *, u32> id;
+  std::vector<MachineBB *> bbs;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    id[bb] = bbs.size();
+    bbs.push_back(bb);
+  }
+  std::vector<std::vector<u32>> pred(bbs.size());
+  for (u32 i = 0; i < bbs.size(); i++) {
+    for (auto succ : bbs[i]->succ) {
+      if (succ) pred[id[succ]].push_back(i);
+    }
+  }
+
+  // post order of the cfg, unreachable bbs are appended at the end
+  std::vector<u32> order;
+  {
+    std::vector<bool> vis(bbs.size());
+    std::vector<std::pair<u32, u32>> stack;
+    for (u32 entry = 0; entry < bbs.size(); entry++) {
+      if (vis[entry]) continue;
+      vis[entry] = true;
+      stack.push_back({entry, 0});
+      while (!stack.empty()) {
+        auto &[b, i] = stack.back();
+        if (i < 2) {
+          MachineBB *succ = bbs[b]->succ[i++];
+          if (succ && !vis[id[succ]]) {
+            vis[id[succ]] = true;
+            stack.push_back({id[succ], 0});
+          }
+        } else {
+          order.push_back(b);
+          stack.pop_back();
+        }
+      }
+    }
+  }
+
+  // calculate LiveIn and LiveOut for each bb
+  // the worklist is a stack, push in reverse so that it pops in post order
+  std::vector<u32> worklist(order.rbegin(), order.rend());
+  std::vector<bool> in_worklist(bbs.size(), true);
+  RegSet new_in(n);
+  while (!worklist.empty()) {
+    u32 b = worklist.back();
+    worklist.pop_back();
+    in_worklist[b] = false;
+
+    auto bb = bbs[b];
+    for (auto &succ : bb->succ) {
+      if (succ) {
+        bb->liveout.merge(succ->livein);
+      }
+    }
+    new_in.assign_transfer(bb->liveuse, bb->liveout, bb->def);
+    if (new_in != bb->livein) {
+      std::swap(bb->livein, new_in);
+      for (u32 p : pred[b]) {
+        if (!in_worklist[p]) {
+          in_worklist[p] = true;
+          worklist.push_back(p);
+        }
+      }
+    }
+  }
+}
+
+std::unordered_map<MachineBB *, VectorLiveness> vector_liveness_analysis(MachineFunc *f) {
+  const u32 n = f->vector_virtual_max;
+  // vector registers only live in and around the loops of vectorize_loop, so a plain round-robin fixpoint is enough
+  std::unordered_map<MachineBB *, VectorLiveness> live;
+  std::unordered_map<MachineBB *, std::pair<RegSet, RegSet>> use_def;
+  std::vector<MachineBB *> bbs;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    bbs.push_back(bb);
+    auto &[use, def] = use_def[bb];
+    use = def = RegSet(n);
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      auto [d, u] = get_vector_def_use_ptr(inst);
+      for (i32 *x : u) {
+        if (!def.test(*x)) use.set(*x);
+      }
+      if (d && !use.test(*d)) def.set(*d);
+    }
+    live[bb] = {use, RegSet(n)};
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto it = bbs.rbegin(); it != bbs.rend(); ++it) {
+      auto &l = live[*it];
+      RegSet out(n);
+      for (MachineBB *succ : (*it)->succ) {
+        if (succ) out.merge(live[succ].livein);
+      }
+      if (out != l.liveout) {
+        auto &[use, def] = use_def[*it];
+        l.liveout = out;
+        l.livein.assign_transfer(use, l.liveout, def);
+        changed = true;
+      }
+    }
+  }
+  return live;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "../../structure/machine_code.hpp"
+
+// registers defined and used by an instruction, shared by all asm passes
+std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use(MachineInst *inst);
+// pointers to the register operands of an instruction, used for rewriting them
+std::pair<MachineOperand *, std::vector<MachineOperand *>> get_def_use_ptr(MachineInst *inst);
+// pointers to the vector registers defined and used by an MIVector, not included in the two above
+std::pair<i32 *, std::vector<i32 *>> get_vector_def_use_ptr(MachineInst *inst);
+
+// calculate liveuse, def, livein and liveout of each bb as RegSet
+void liveness_analysis(MachineFunc *f);
+
+// livein and liveout of the vector registers of a bb, indexed by the number of the vector register
+struct VectorLiveness {
+  RegSet livein;
+  RegSet liveout;
+};
+
+// calculate VectorLiveness of each bb, vector registers are not in the RegSets of liveness_analysis
+std::unordered_map<MachineBB *, VectorLiveness> vector_liveness_analysis(MachineFunc *f);
@@ -0,0 +1,512 @@
+// Software pipelining (modulo scheduling) of single-block loops.
+//
+// Runs before register allocation on the bbs that branch back to themselves, such as the loops of
+// vectorize_loop.  The schedule of one iteration is found with iterative modulo scheduling at the
+// smallest initiation interval (II) allowed by the functional units (CortexA72FUKind, each busy until
+// the result is ready as in instruction_schedule) and by the loop-carried dependences, and is cut
+// into stages of II cycles, so a load of the next iteration is issued while the current one waits for
+// its own loads.  Example with two stages:
+//   prologue: stage 0 of iteration 0, exit to a drain if it was the last one
+//   kernel:   stage 1 of iteration i, stage 0 of iteration i + 1, loop if i + 1 isn't the last one
+//   drain:    stage 1 of the last iteration
+// A value that lives longer than II gets a virtual register for each iteration in flight (modulo
+// variable expansion) and the kernel is unrolled so every copy uses fixed registers.  Loops that would
+// need more registers than allocatable keep their original code for instruction_schedule.
+#include "modulo_schedule.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <unordered_map>
+
+#include "allocate_register.hpp"
+#include "liveness.hpp"
+#include "scheduling.hpp"
+
+namespace {
+
+// loops larger than this, or whose schedule needs more stages or kernel copies, are not pipelined
+constexpr u32 MAX_OPS = 48;
+constexpr i32 MAX_STAGES = 4;
+constexpr i32 MAX_COPIES = 4;
+
+struct Op {
+  MachineInst *inst;
+  // cycles until the result is ready, copies of phis are coalesced by the register allocator and take none
+  i32 latency;
+  // cycles the functional unit is busy
+  i32 occupancy;
+  CortexA72FUKind kind;
+  std::vector<MachineOperand> def;
+  std::vector<MachineOperand> use;
+  // cycle in the schedule of one iteration, the stage is time / II
+  i32 time;
+};
+
+struct Edge {
+  u32 from;
+  u32 to;
+  i32 latency;
+  // number of iterations between from and to
+  i32 distance;
+};
+
+// a bb that branches back to itself
+struct SelfLoop {
+  MachineBB *bb;
+  MachineBB *exit;
+  MICompare *cmp;
+  // condition of branching back to bb
+  ArmCond cond;
+  std::vector<Op> ops;
+  std::vector<Edge> edges;
+  // the op defining each register defined in the loop, and the ops defining the operands of cmp
+  std::map<MachineOperand, u32> def_op;
+  std::vector<u32> cmp_deps;
+};
+
+bool is_copy(MachineInst *inst) {
+  if (auto x = dyn_cast<MIMove>(inst)) return x->is_simple() && x->rhs.is_reg();
+  return isa<MIVectorMove>(inst);
+}
+
+bool is_vector(const MachineOperand &x) { return x.is_precolored() && x.value >= vector_reg(0).value; }
+
+// instructions that can be copied to the prologue, the kernel and the drains
+bool can_pipeline(MachineFunc *f, MachineInst *inst) {
+  // the offset of stack arguments is fixed up later in compute_stack_info, for these instructions only
+  if (std::find(f->sp_arg_fixup.begin(), f->sp_arg_fixup.end(), inst) != f->sp_arg_fixup.end()) return false;
+  if (auto x = dyn_cast<MIBinary>(inst)) return x->cond == ArmCond::Any;
+  if (auto x = dyn_cast<MIMove>(inst)) return x->cond == ArmCond::Any;
+  if (auto x = dyn_cast<MIFma>(inst)) return x->cond == ArmCond::Any;
+  if (auto x = dyn_cast<MIAccess>(inst)) return x->cond == ArmCond::Any && x->mode == MIAccess::Mode::Offset;
+  return isa<MILongMul>(inst) || isa<MIGlobal>(inst) || isa<MIVector>(inst);
+}
+
+// bb: ...; cmp; b<cond> bb; b exit (or with the targets swapped), and every register is defined once
+bool analyze_loop(MachineFunc *f, MachineBB *bb, SelfLoop &loop) {
+  if (bb->succ[0] != bb && bb->succ[1] != bb) return false;
+  auto cmp = dyn_cast_nullable<MICompare>(bb->control_transfer_inst);
+  auto branch = cmp ? dyn_cast_nullable<MIBranch>(cmp->next) : nullptr;
+  auto jump = branch ? dyn_cast_nullable<MIJump>(branch->next) : nullptr;
+  if (!jump || jump->next || branch->cond == ArmCond::Any) return false;
+  if (branch->target == bb && jump->target != bb) {
+    loop.cond = branch->cond;
+    loop.exit = jump->target;
+  } else if (jump->target == bb && branch->target != bb) {
+    loop.cond = opposite_cond(branch->cond);
+    loop.exit = branch->target;
+  } else {
+    return false;
+  }
+  loop.bb = bb;
+  loop.cmp = cmp;
+
+  auto &ops = loop.ops;
+  for (auto inst = bb->insts.head; inst != cmp; inst = inst->next) {
+    if (isa<MIComment>(inst)) continue;
+    if (!can_pipeline(f, inst) || ops.size() == MAX_OPS) return false;
+    auto [def, use] = get_def_use_scheduling(inst);
+    auto [latency, kind] = get_info(inst);
+    for (auto &d : def) {
+      // precolored registers are not renamed, q registers are still virtual
+      if (d.is_precolored() && !is_vector(d)) return false;
+      if (!loop.def_op.emplace(d, ops.size()).second) return false;
+    }
+    ops.push_back({inst, is_copy(inst) ? 0 : (i32)latency, (i32)latency, kind, def, use, -1});
+  }
+  if (ops.empty()) return false;
+
+  // read-after-write dependences, from the previous iteration if the register is defined after the use
+  // the others are removed by renaming
+  for (u32 j = 0; j < ops.size(); j++) {
+    for (auto &u : ops[j].use) {
+      auto it = loop.def_op.find(u);
+      if (it != loop.def_op.end()) {
+        loop.edges.push_back({it->second, j, ops[it->second].latency, it->second < j ? 0 : 1});
+      }
+    }
+  }
+  // loads and stores keep their order, with the loads and stores of the next iteration as well
+  auto is_memory = [](MachineInst *x) { return isa<MIAccess>(x) || isa<MIVectorAccess>(x); };
+  auto is_store = [](MachineInst *x) { return isa<MIStore>(x) || isa<MIVectorStore>(x); };
+  for (u32 i = 0; i < ops.size(); i++) {
+    for (u32 j = i + 1; j < ops.size(); j++) {
+      if (is_memory(ops[i].inst) && is_memory(ops[j].inst) && (is_store(ops[i].inst) || is_store(ops[j].inst))) {
+        loop.edges.push_back({i, j, 0, 0});
+        loop.edges.push_back({j, i, 0, 1});
+      }
+    }
+  }
+  for (auto &u : get_def_use_scheduling(cmp).second) {
+    auto it = loop.def_op.find(u);
+    if (it != loop.def_op.end()) loop.cmp_deps.push_back(it->second);
+  }
+  return true;
+}
+
+u32 num_units(CortexA72FUKind kind) {
+  return std::count(std::begin(CORTEX_A72_UNITS), std::end(CORTEX_A72_UNITS), kind);
+}
+
+// resource-constrained lower bound of II: cycles each kind of functional unit is busy in an iteration
+i32 resource_mii(const SelfLoop &loop) {
+  std::map<CortexA72FUKind, i32> busy;
+  i32 mii = 1;
+  for (auto &op : loop.ops) {
+    busy[op.kind] += op.occupancy;
+    // an instruction occupies one unit for consecutive cycles
+    mii = std::max(mii, op.occupancy);
+  }
+  for (auto [kind, cycles] : busy) {
+    i32 units = num_units(kind);
+    mii = std::max(mii, (cycles + units - 1) / units);
+  }
+  return mii;
+}
+
+// whether a dependence cycle takes more than ii cycles per iteration, by the longest paths with edge weights
+// latency - distance * ii (Floyd-Warshall)
+bool has_positive_cycle(const SelfLoop &loop, i32 ii) {
+  constexpr i32 NONE = INT_MIN / 4;
+  u32 n = loop.ops.size();
+  std::vector<std::vector<i32>> dist(n, std::vector<i32>(n, NONE));
+  for (auto &e : loop.edges) {
+    dist[e.from][e.to] = std::max(dist[e.from][e.to], e.latency - e.distance * ii);
+  }
+  for (u32 k = 0; k < n; k++) {
+    for (u32 i = 0; i < n; i++) {
+      if (dist[i][k] == NONE) continue;
+      for (u32 j = 0; j < n; j++) {
+        if (dist[k][j] != NONE) dist[i][j] = std::max(dist[i][j], dist[i][k] + dist[k][j]);
+      }
+    }
+    // stop at the first one, the paths would grow without bound
+    for (u32 i = 0; i < n; i++) {
+      if (dist[i][i] > 0) return true;
+    }
+  }
+  return false;
+}
+
+// recurrence-constrained lower bound of II, every cycle contains an edge to the next iteration
+i32 recurrence_mii(const SelfLoop &loop) {
+  i32 ii = 1;
+  while (has_positive_cycle(loop, ii)) ii++;
+  return ii;
+}
+
+// modulo scheduling without backtracking: each op, in the original order, is put at the first cycle from the
+// earliest one allowed by its scheduled predecessors at which a unit of its kind is free for its occupancy in the
+// modulo reservation table. fails if no cycle is free or a dependence on an op scheduled before is violated
+bool schedule_at(SelfLoop &loop, i32 ii) {
+  auto &ops = loop.ops;
+  // reserved[unit][cycle % ii]
+  std::vector<std::vector<bool>> reserved(std::size(CORTEX_A72_UNITS), std::vector<bool>(ii));
+  for (auto &op : ops) op.time = -1;
+  for (u32 j = 0; j < ops.size(); j++) {
+    auto &op = ops[j];
+    i32 earliest = 0;
+    for (auto &e : loop.edges) {
+      if (e.to == j && ops[e.from].time >= 0) {
+        earliest = std::max(earliest, ops[e.from].time + e.latency - e.distance * ii);
+      }
+    }
+    for (i32 t = earliest; t < earliest + ii && op.time < 0; t++) {
+      for (u32 u = 0; u < std::size(CORTEX_A72_UNITS) && op.time < 0; u++) {
+        if (CORTEX_A72_UNITS[u] != op.kind) continue;
+        bool free = true;
+        for (i32 c = 0; c < op.occupancy; c++) free &= !reserved[u][(t + c) % ii];
+        if (free) {
+          for (i32 c = 0; c < op.occupancy; c++) reserved[u][(t + c) % ii] = true;
+          op.time = t;
+        }
+      }
+    }
+    if (op.time < 0) return false;
+    for (auto &e : loop.edges) {
+      if (e.from == j && ops[e.to].time >= 0 && op.time + e.latency - e.distance * ii > ops[e.to].time) return false;
+    }
+  }
+  // the compare at the end of each pass tests the iteration in stage 0
+  for (u32 i : loop.cmp_deps) {
+    if (ops[i].time >= ii) return false;
+  }
+  return true;
+}
+
+void pipeline_loop(MachineFunc *f, SelfLoop &loop, std::unordered_map<MachineBB *, VectorLiveness> &vector_live) {
+  auto &ops = loop.ops;
+  const u32 n = ops.size();
+  auto bb = loop.bb;
+  i32 ii = std::max(resource_mii(loop), recurrence_mii(loop));
+  // at this II all the ops would fit in one stage anyway
+  i32 sequential = 0;
+  for (auto &op : ops) sequential += std::max(op.occupancy, op.latency);
+  while (ii < sequential && !schedule_at(loop, ii)) ii++;
+  if (ii >= sequential) return;
+  i32 stages = 0;
+  for (auto &op : ops) stages = std::max(stages, op.time / ii + 1);
+  // one iteration takes less than II cycles, nothing to overlap
+  if (stages == 1 || stages > MAX_STAGES) return;
+
+  // lifetime of each value, from its definition to the last use counted in the schedule of the defining iteration
+  // a value defined by iteration i is overwritten by iteration i + copies[v]
+  std::map<MachineOperand, i32> lifetime, copies;
+  for (auto &[v, d] : loop.def_op) {
+    i32 end = ops[d].time;
+    for (u32 j = 0; j < n; j++) {
+      if (std::find(ops[j].use.begin(), ops[j].use.end(), v) != ops[j].use.end()) {
+        end = std::max(end, ops[j].time + (d < j ? 0 : ii));
+      }
+    }
+    lifetime[v] = end - ops[d].time;
+    copies[v] = std::max(1, (lifetime[v] + ii - 1) / ii);
+  }
+  i32 kernel_copies = 1;
+  for (auto &[v, k] : copies) kernel_copies = std::max(kernel_copies, k);
+  if (kernel_copies > MAX_COPIES) return;
+
+  // values used after the loop: core registers live into exit, vector registers referenced by any other bb
+  std::set<MachineOperand> live_out;
+  for (auto &[v, d] : loop.def_op) {
+    if (!is_vector(v) && loop.exit->livein.test(v.reg_index())) live_out.insert(v);
+  }
+  // vector registers that interfere with those of the loop: referenced around the loop or live through it, including
+  // values of other code that live across the loop. allocate_vector_register can't spill, so all of them need a register
+  std::set<i32> vectors;
+  auto &vl = vector_live[bb];
+  vl.livein.for_each([&](u32 q) { vectors.insert(q); });
+  vl.liveout.for_each([&](u32 q) { vectors.insert(q); });
+  for (auto x = f->bb.head; x; x = x->next) {
+    bool around = x == bb || x == loop.exit || std::find(bb->pred.begin(), bb->pred.end(), x) != bb->pred.end();
+    for (auto inst = x->insts.head; inst; inst = inst->next) {
+      auto [def, use] = get_vector_def_use_ptr(inst);
+      if (def) use.push_back(def);
+      for (i32 *q : use) {
+        if (around) vectors.insert(*q);
+        if (x != bb && loop.def_op.count(vector_reg(*q))) live_out.insert(vector_reg(*q));
+      }
+    }
+  }
+
+  // register pressure: core registers live through the loop, and the instances of the values of the loop live in
+  // each cycle of the kernel. Each renamed vector value adds kernel_copies registers to vectors
+  u32 through = 0;
+  RegSet live = bb->livein;
+  live.merge(bb->liveout);
+  live.for_each([&](u32 i) {
+    auto x = MachineOperand::from_reg_index(i);
+    if (x.is_virtual() && !loop.def_op.count(x)) through++;
+  });
+  std::vector<u32> pressure(ii);
+  u32 renamed_vectors = 0;
+  for (auto &[v, d] : loop.def_op) {
+    if (is_vector(v)) {
+      if (copies[v] > 1) renamed_vectors++;
+    } else if (copies[v] > 1 && live_out.count(v)) {
+      // every copy is read after the loop
+      for (auto &p : pressure) p += kernel_copies;
+    } else {
+      for (i32 t = ops[d].time; t < ops[d].time + std::max(lifetime[v], 1); t++) pressure[t % ii]++;
+    }
+  }
+  u32 max_pressure = *std::max_element(pressure.begin(), pressure.end());
+  if (through + max_pressure > NUM_ALLOCATABLE || vectors.size() + renamed_vectors * kernel_copies > NUM_VECTOR_REGS) {
+    dbg("Register pressure too high for software pipelining");
+    return;
+  }
+
+  // a new register for each copy of the values that live longer than II
+  std::map<MachineOperand, std::vector<MachineOperand>> names;
+  for (auto &[v, k] : copies) {
+    if (k == 1) continue;
+    for (i32 i = 0; i < kernel_copies; i++) {
+      names[v].push_back(is_vector(v) ? vector_reg(f->vector_virtual_max++) : MachineOperand::V(f->virtual_max++));
+    }
+  }
+  // register of value v defined by iteration iter
+  auto name = [&](const MachineOperand &v, i32 iter) {
+    auto it = names.find(v);
+    return it == names.end() ? v : it->second[(iter % kernel_copies + kernel_copies) % kernel_copies];
+  };
+  auto rename = [&](MachineOperand &x, i32 iter) {
+    if (x.is_reg()) x = name(x, iter);
+  };
+  auto rename_vector = [&](i32 &q, i32 iter) { q = name(vector_reg(q), iter).value - vector_reg(0).value; };
+
+  // ops of pass p, stage s runs iteration p - s if it is in [lo, hi]
+  // in a cycle, the ops of older iterations go first, so they read their operands before the next iteration
+  // overwrites them (copies[v] is rounded up)
+  auto instances = [&](i32 p, i32 lo, i32 hi) {
+    std::vector<std::pair<u32, i32>> ret;
+    for (i32 row = 0; row < ii; row++) {
+      for (i32 s = stages - 1; s >= 0; s--) {
+        if (p - s < lo || p - s > hi) continue;
+        for (u32 i = 0; i < n; i++) {
+          if (ops[i].time == s * ii + row) ret.emplace_back(i, p - s);
+        }
+      }
+    }
+    return ret;
+  };
+  auto emit = [&](MachineBB *mbb, u32 i, i32 iter) {
+    auto inst = clone_inst(ops[i].inst);
+    inst->bb = mbb;
+    mbb->insts.insertAtEnd(inst);
+    auto [def, use] = get_def_use_ptr(inst);
+    auto [vector_def, vector_use] = get_vector_def_use_ptr(inst);
+    // a register defined after the use (or by the same op) is from the previous iteration
+    for (auto u : use) {
+      if (auto it = loop.def_op.find(*u); it != loop.def_op.end()) rename(*u, it->second < i ? iter : iter - 1);
+    }
+    for (auto q : vector_use) rename_vector(*q, loop.def_op[vector_reg(*q)] < i ? iter : iter - 1);
+    if (def) rename(*def, iter);
+    if (vector_def) rename_vector(*vector_def, iter);
+  };
+
+  // bb becomes the first pass of the prologue, the other blocks are placed after it
+  u32 outer_depth = bb->loop_depth ? bb->loop_depth - 1 : 0;
+  MachineBB *last = bb;
+  auto new_bb = [&](u32 depth) {
+    auto mbb = new MachineBB;
+    mbb->bb = nullptr;
+    mbb->loop_depth = depth;
+    mbb->succ = {nullptr, nullptr};
+    f->bb.insertAfter(mbb, last);
+    last = mbb;
+    return mbb;
+  };
+  auto jump = [&](MachineBB *from, MachineBB *to) {
+    auto inst = new MIJump(to, from);
+    if (!from->control_transfer_inst) from->control_transfer_inst = inst;
+    (from->succ[0] ? from->succ[1] : from->succ[0]) = to;
+  };
+  auto branch = [&](MachineBB *from, ArmCond cond, MachineBB *to) {
+    auto inst = new MIBranch(from);
+    inst->cond = cond;
+    inst->target = to;
+    (from->succ[0] ? from->succ[1] : from->succ[0]) = to;
+  };
+  // compare of the iteration in stage 0 at the end of pass p
+  auto test = [&](MachineBB *mbb, i32 p) {
+    auto inst = new MICompare(mbb);
+    inst->lhs = loop.cmp->lhs;
+    inst->rhs = loop.cmp->rhs;
+    rename(inst->lhs, p);
+    rename(inst->rhs, p);
+    mbb->control_transfer_inst = inst;
+  };
+
+  for (auto inst = bb->insts.head; inst; inst = inst->next) inst->bb = nullptr;
+  bb->insts.head = bb->insts.tail = nullptr;
+  bb->control_transfer_inst = nullptr;
+  bb->succ = {nullptr, nullptr};
+  bb->loop_depth = outer_depth;
+  std::vector<MachineBB *> prologue{bb}, kernel;
+  for (i32 p = 1; p < stages - 1; p++) prologue.push_back(new_bb(outer_depth));
+  for (i32 k = 0; k < kernel_copies; k++) kernel.push_back(new_bb(bb->loop_depth + 1));
+
+  // drain after pass p: the rest of the stages of the iterations up to p, then the values used after the loop are
+  // copied to their original registers. the drains with the same code are shared
+  std::map<std::pair<std::vector<std::pair<u32, i32>>, i32>, MachineBB *> drains;
+  auto drain = [&](i32 p) {
+    std::vector<std::pair<u32, i32>> code;
+    for (i32 q = p + 1; q < p + stages; q++) {
+      for (auto [i, iter] : instances(q, 0, p)) code.emplace_back(i, iter);
+    }
+    std::vector<std::pair<u32, i32>> key;
+    for (auto [i, iter] : code) key.emplace_back(i, iter % kernel_copies);
+    auto &mbb = drains[{key, p % kernel_copies}];
+    if (!mbb) {
+      mbb = new_bb(outer_depth);
+      for (auto [i, iter] : code) emit(mbb, i, iter);
+      jump(mbb, loop.exit);
+      for (auto &v : live_out) {
+        if (!names.count(v)) continue;
+        if (is_vector(v)) {
+          auto mv = new MIVectorMove(mbb->control_transfer_inst);
+          mv->dst = v.value - vector_reg(0).value;
+          mv->src = name(v, p).value - vector_reg(0).value;
+        } else {
+          auto mv = new MIMove(mbb->control_transfer_inst);
+          mv->dst = v;
+          mv->rhs = name(v, p);
+        }
+      }
+    }
+    return mbb;
+  };
+  // the drain of the last copy of the kernel follows it
+  drain(stages - 2 + kernel_copies);
+
+  // the uses in iteration 0 of a value from the previous iteration read the value from before the loop
+  for (auto &[v, d] : loop.def_op) {
+    bool used_before_def = false;
+    for (u32 j = 0; j <= d; j++) {
+      used_before_def |= std::find(ops[j].use.begin(), ops[j].use.end(), v) != ops[j].use.end();
+    }
+    if (!names.count(v) || !used_before_def) continue;
+    if (is_vector(v)) {
+      auto mv = new MIVectorMove(bb);
+      mv->dst = name(v, -1).value - vector_reg(0).value;
+      mv->src = v.value - vector_reg(0).value;
+    } else {
+      auto mv = new MIMove(bb);
+      mv->dst = name(v, -1);
+      mv->rhs = v;
+    }
+  }
+
+  for (i32 p = 0; p < stages - 1; p++) {
+    auto mbb = prologue[p];
+    for (auto [i, iter] : instances(p, 0, p)) emit(mbb, i, iter);
+    test(mbb, p);
+    branch(mbb, opposite_cond(loop.cond), drain(p));
+    jump(mbb, p + 1 < stages - 1 ? prologue[p + 1] : kernel[0]);
+  }
+  for (i32 k = 0; k < kernel_copies; k++) {
+    i32 p = stages - 1 + k;
+    auto mbb = kernel[k];
+    for (auto [i, iter] : instances(p, 0, p)) emit(mbb, i, iter);
+    test(mbb, p);
+    if (k + 1 < kernel_copies) {
+      branch(mbb, opposite_cond(loop.cond), drain(p));
+      jump(mbb, kernel[k + 1]);
+    } else {
+      branch(mbb, loop.cond, kernel[0]);
+      jump(mbb, drain(p));
+    }
+  }
+
+  // bb keeps its predecessors from outside the loop
+  std::vector<MachineBB *> blocks = prologue;
+  blocks.insert(blocks.end(), kernel.begin(), kernel.end());
+  for (auto &[key, mbb] : drains) blocks.push_back(mbb);
+  bb->pred.erase(std::remove(bb->pred.begin(), bb->pred.end(), bb), bb->pred.end());
+  loop.exit->pred.erase(std::remove(loop.exit->pred.begin(), loop.exit->pred.end(), bb), loop.exit->pred.end());
+  for (auto x : blocks) {
+    for (auto succ : x->succ) {
+      if (succ) succ->pred.push_back(x);
+    }
+  }
+  auto pipelined = "Software pipelined a loop with II " + std::to_string(ii) + ", " + std::to_string(stages) +
+                   " stages and " + std::to_string(kernel_copies) + " copies of the kernel";
+  dbg(pipelined);
+}
+
+}  // namespace
+
+void modulo_schedule(MachineFunc *f) {
+  std::vector<SelfLoop> loops;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    SelfLoop loop;
+    if (analyze_loop(f, bb, loop)) loops.push_back(std::move(loop));
+  }
+  if (loops.empty()) return;
+  // only the live-in sets of the exits and the vector liveness of the loops are needed, pipelining a loop doesn't
+  // change those of the other loops
+  liveness_analysis(f);
+  auto vector_live = vector_liveness_analysis(f);
+  for (auto &loop : loops) pipeline_loop(f, loop, vector_live);
+}
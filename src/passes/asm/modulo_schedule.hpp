@@ -0,0 +1,6 @@
+#pragma once
+
+#include "../../structure/machine_code.hpp"
+
+// software pipelining of the loops of a single bb, before register allocation
+void modulo_schedule(MachineFunc* f);
\ No newline at end of file
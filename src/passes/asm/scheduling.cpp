@@ -1,81 +1,61 @@
-// Local machine instruction scheduling pass.
+// Machine instruction scheduling pass.
 //
-// Builds a dependence graph inside each basic block and reorders independent
+// Builds a dependence graph inside each superblock (a chain of fall-through basic
+// blocks whose later blocks have a single predecessor) and reorders independent
 // instructions with a simple Cortex-A72 latency model.  Example: move a load
 // earlier when it does not cross stores/calls and its address operands are ready.
+// Instructions may be hoisted above a side exit when they are safe to execute
+// speculatively, or sunk below it, in which case a copy is placed at the exit target.
+//
+// The same list scheduler also runs on single bbs before register allocation, when
+// virtual registers carry no false dependences. There it tracks the number of live
+// virtual registers and, like LLVM's hybrid scheduler, switches from the latency
+// priority to the register pressure one when more would be live than can be allocated.
 #include "scheduling.hpp"
 
 #include <queue>
+#include <unordered_set>
+
+#include "allocate_register.hpp"
+#include "liveness.hpp"
 
 // virtual operand that represents condition register
 const MachineOperand COND = MachineOperand{MachineOperand::State::PreColored, 0x40000000};
 
+// virtual operands that represent q registers, both before and after allocate_vector_register
+MachineOperand vector_reg(i32 q) { return MachineOperand{MachineOperand::State::PreColored, 0x20000000 + q}; }
+
 std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use_scheduling(MachineInst *inst) {
-  std::vector<MachineOperand> def;
-  std::vector<MachineOperand> use;
+  auto [def, use] = get_def_use(inst);
+  auto [vector_def, vector_use] = get_vector_def_use_ptr(inst);
+  if (vector_def) def.push_back(vector_reg(*vector_def));
+  for (i32 *u : vector_use) use.push_back(vector_reg(*u));
 
   if (auto x = dyn_cast<MIBinary>(inst)) {
-    def = {x->dst};
-    use = {x->lhs, x->rhs};
     if (x->cond != ArmCond::Any) {
       use.push_back(COND);
     }
-  } else if (auto x = dyn_cast<MILongMul>(inst)) {
-    def = {x->dst};
-    use = {x->lhs, x->rhs};
   } else if (auto x = dyn_cast<MIFma>(inst)) {
-    def = {x->dst};
-    use = {x->lhs, x->rhs, x->acc};
     if (x->cond != ArmCond::Any) {
       use.push_back(COND);
     }
   } else if (auto x = dyn_cast<MIMove>(inst)) {
-    def = {x->dst};
-    use = {x->rhs};
     if (x->cond != ArmCond::Any) {
       use.push_back(COND);
     }
-  } else if (auto x = dyn_cast<MILoad>(inst)) {
-    def = {x->dst};
-    use = {x->addr, x->offset};
-    if (x->mode != MIAccess::Mode::Offset) {
-      def.push_back(x->addr);
-    }
-  } else if (auto x = dyn_cast<MIStore>(inst)) {
-    use = {x->data, x->addr, x->offset};
-    if (x->mode != MIAccess::Mode::Offset) {
-      def.push_back(x->addr);
-    }
-  } else if (auto x = dyn_cast<MICompare>(inst)) {
-    def = {COND};
-    use = {x->lhs, x->rhs};
+  } else if (isa<MICompare>(inst)) {
+    def.push_back(COND);
   } else if (auto x = dyn_cast<MIBranch>(inst)) {
     if (x->cond != ArmCond::Any) {
-      use = {COND};
-    }
-  } else if (auto x = dyn_cast<MICall>(inst)) {
-    // args (also caller save)
-    for (u32 i = (u32)ArmReg::r0; i < (u32)ArmReg::r0 + std::min(x->func->params.size(), (size_t)4); ++i) {
-      use.push_back(MachineOperand::R((ArmReg)i));
+      use.push_back(COND);
     }
+  } else if (isa<MICall>(inst)) {
     use.push_back(MachineOperand::R(ArmReg::sp));
-    for (u32 i = (u32)ArmReg::r0; i <= (u32)ArmReg::r3; i++) {
-      def.push_back(MachineOperand::R((ArmReg)i));
-    }
-    def.push_back(MachineOperand::R(ArmReg::lr));
-    def.push_back(MachineOperand::R(ArmReg::ip));
     def.push_back(COND);
-  } else if (auto x = dyn_cast<MIGlobal>(inst)) {
-    def = {x->dst};
-  } else if (isa<MIReturn>(inst)) {
-    // ret
-    use.push_back(MachineOperand::R(ArmReg::r0));
   }
   return {def, use};
 }
 
-enum class CortexA72FUKind { Branch, Integer, IntegerMultiple, Load, Store };
-
 // reference: Cortex-A72 software optimization guide
 std::pair<u32, CortexA72FUKind> get_info(MachineInst *inst) {
   // TODO: check inst->tag
@@ -120,26 +100,58 @@ std::pair<u32, CortexA72FUKind> get_info(MachineInst *inst) {
     return {1, CortexA72FUKind::Branch};
   } else if (isa<MIJump>(inst)) {
     return {1, CortexA72FUKind::Branch};
+  } else if (isa<MIVectorLoad>(inst)) {
+    return {5, CortexA72FUKind::Load};
+  } else if (isa<MIVectorStore>(inst)) {
+    return {3, CortexA72FUKind::Store};
+  } else if (auto x = dyn_cast<MIVectorBinary>(inst)) {
+    return {x->op == MachineInst::Tag::Mul ? 4u : 3u, CortexA72FUKind::Neon};
+  } else if (isa<MIVectorFma>(inst)) {
+    return {4, CortexA72FUKind::Neon};
+  } else if (isa<MIVectorMove>(inst)) {
+    return {3, CortexA72FUKind::Neon};
+  } else if (isa<MIVectorDup>(inst)) {
+    return {8, CortexA72FUKind::Neon};
+  } else if (isa<MIVectorExtract>(inst)) {
+    return {5, CortexA72FUKind::Neon};
   }
   UNREACHABLE();
 }
 
+struct Node;
+
+// 按指令在bb中原来的顺序排序，而不是按指针排序，保证每次编译的结果相同
+struct NodeIndexCompare {
+  bool operator()(const Node *lhs, const Node *rhs) const;
+};
+
 struct Node {
   MachineInst *inst;
+  u32 index;
   u32 priority;
   u32 latency;
   CortexA72FUKind kind;
   u32 temp;
-  std::set<Node *> out_edges;
-  std::set<Node *> in_edges;
+  // index of the bb in the superblock, and whether it is a side exit
+  u32 block = 0;
+  bool exit = false;
+  std::set<Node *, NodeIndexCompare> out_edges;
+  std::set<Node *, NodeIndexCompare> in_edges;
+  // values of the core virtual registers defined and used (see RegPressure), before allocate_register only
+  std::vector<u32> vreg_def;
+  std::vector<u32> vreg_use;
+  // change of the number of live virtual registers if scheduled now, updated before each pick
+  i32 pressure_delta = 0;
 
-  Node(MachineInst *inst) : inst(inst), priority(0) {
+  Node(MachineInst *inst, u32 index) : inst(inst), index(index), priority(0) {
     auto [l, k] = get_info(inst);
     latency = l;
     kind = k;
   }
 };
 
+bool NodeIndexCompare::operator()(const Node *lhs, const Node *rhs) const { return lhs->index < rhs->index; }
+
 struct CortexA72FU {
   CortexA72FUKind kind;
   Node *inflight = nullptr;
@@ -150,42 +162,259 @@ struct NodeCompare {
   bool operator()(Node *const &lhs, const Node *const &rhs) const {
     if (lhs->priority != rhs->priority) return lhs->priority > rhs->priority;
     if (lhs->latency != rhs->latency) return lhs->latency > rhs->latency;
-    return false;
+    return lhs->index < rhs->index;
   }
 };
 
-void instruction_schedule(MachineFunc *f) {
+// live core virtual registers while scheduling a bb before allocate_register
+// a register defined more than once in the bb has a value for each def, the readers of one value are ordered before
+// the next def, so each value is live from its def to its last reader, and the last one also to the end of the bb
+struct RegPressure {
+  u32 live_cnt = 0;
+  RegSet liveout;
+  // value of each register after the nodes added so far
+  std::unordered_map<u32, u32> current;
+  // of each value: its register, the uses by the nodes not scheduled yet, whether it is live now and out of the bb
+  std::vector<u32> reg;
+  std::vector<u32> pending;
+  std::vector<bool> live;
+  std::vector<bool> out;
+
+  explicit RegPressure(MachineBB *bb) : liveout(bb->liveout) {
+    bb->livein.for_each([&](u32 r) {
+      if (r >= MachineOperand::NUM_PRECOLORED) {
+        live[current[r] = new_value(r)] = true;
+        live_cnt++;
+      }
+    });
+  }
+
+  u32 new_value(u32 r) {
+    reg.push_back(r);
+    pending.push_back(0);
+    live.push_back(false);
+    out.push_back(false);
+    return reg.size() - 1;
+  }
+
+  void add_node(Node *n) {
+    auto [def, use] = get_def_use(n->inst);
+    for (auto &u : use) {
+      if (!u.is_virtual()) continue;
+      auto it = current.find(u.reg_index());
+      n->vreg_use.push_back(it != current.end() ? it->second : current[u.reg_index()] = new_value(u.reg_index()));
+    }
+    std::sort(n->vreg_use.begin(), n->vreg_use.end());
+    n->vreg_use.erase(std::unique(n->vreg_use.begin(), n->vreg_use.end()), n->vreg_use.end());
+    for (u32 v : n->vreg_use) pending[v]++;
+    for (auto &d : def) {
+      if (d.is_virtual()) n->vreg_def.push_back(current[d.reg_index()] = new_value(d.reg_index()));
+    }
+  }
+
+  // after all the nodes are added: the last value of a live-out register is live out
+  void finish() {
+    for (auto [r, v] : current) out[v] = liveout.test(r);
+  }
+
+  // a value is needed after n if other nodes still read it, or it is live out
+  bool needed_after(Node *n, u32 v) const {
+    u32 remain = pending[v];
+    if (std::binary_search(n->vreg_use.begin(), n->vreg_use.end(), v)) remain--;
+    return remain > 0 || out[v];
+  }
+
+  i32 delta(Node *n) const {
+    i32 ret = 0;
+    for (u32 u : n->vreg_use) {
+      if (live[u] && !needed_after(n, u)) ret--;
+    }
+    for (u32 d : n->vreg_def) {
+      if (needed_after(n, d)) ret++;
+    }
+    return ret;
+  }
+
+  void schedule(Node *n) {
+    live_cnt += delta(n);
+    for (u32 u : n->vreg_use) {
+      if (!needed_after(n, u)) live[u] = false;
+    }
+    for (u32 d : n->vreg_def) live[d] = needed_after(n, d);
+    for (u32 u : n->vreg_use) pending[u]--;
+  }
+
+  bool exceeds(Node *n) const { return (i32)live_cnt + n->pressure_delta > (i32)NUM_ALLOCATABLE; }
+};
+
+// hybrid priority: the one that keeps the live registers within NUM_ALLOCATABLE first, then the one with less
+// pressure if both exceed it, otherwise by latency
+struct HybridCompare {
+  const RegPressure &pressure;
+
+  bool operator()(Node *const &lhs, Node *const &rhs) const {
+    bool lhs_exceeds = pressure.exceeds(lhs), rhs_exceeds = pressure.exceeds(rhs);
+    if (lhs_exceeds != rhs_exceeds) return rhs_exceeds;
+    if (lhs_exceeds && lhs->pressure_delta != rhs->pressure_delta) return lhs->pressure_delta < rhs->pressure_delta;
+    return NodeCompare{}(lhs, rhs);
+  }
+};
+
+// key of a register in the dependence graph, virtual registers only exist before allocate_register
+u32 reg_key(const MachineOperand &x) { return x.is_virtual() ? x.reg_index() : (u32)x.value; }
+
+// bit of a core register or the condition flags in a mask of physical registers, 0 for q registers
+u32 physical_reg_bit(const MachineOperand &x) {
+  if (x == COND) return 1u << 16;
+  if (x.is_reg() && !x.is_virtual() && 0 <= x.value && x.value < 16) return 1u << x.value;
+  return 0;
+}
+
+bool is_conditional(MachineInst *inst) {
+  if (auto x = dyn_cast<MIBinary>(inst)) return x->cond != ArmCond::Any;
+  if (auto x = dyn_cast<MIFma>(inst)) return x->cond != ArmCond::Any;
+  if (auto x = dyn_cast<MIMove>(inst)) return x->cond != ArmCond::Any;
+  if (auto x = dyn_cast<MIAccess>(inst)) return x->cond != ArmCond::Any;
+  return false;
+}
+
+// live-in physical registers and flags of each bb
+// this pass runs after allocate_register, liveness_analysis only tracks virtual and precolored registers
+std::unordered_map<MachineBB *, u32> physical_livein(MachineFunc *f) {
+  std::unordered_map<MachineBB *, std::pair<u32, u32>> gen_kill;
+  std::unordered_map<MachineBB *, u32> livein;
   for (auto bb = f->bb.head; bb; bb = bb->next) {
-    // create data dependence graph of instructions
-    // instructions that read this register
-    std::map<u32, std::vector<Node *>> read_insts;
-    // instruction that writes this register
-    std::map<u32, Node *> write_insts;
-    // loads can be reordered, but not across store and call
-    // instruction that might have side effect (store, call)
-    Node *side_effect = nullptr;
-    Node *call_barrier = nullptr;
-    std::vector<Node *> load_insts;
-    std::vector<Node *> nodes;
-
-    // calculate data dependence graph
-    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+    u32 gen = 0, kill = 0;
+    for (auto inst = bb->insts.tail; inst; inst = inst->prev) {
+      auto [def, use] = get_def_use_scheduling(inst);
+      for (auto &d : def) {
+        // a conditional instruction may keep the old value
+        if (!is_conditional(inst)) gen &= ~physical_reg_bit(d);
+        kill |= physical_reg_bit(d);
+      }
+      for (auto &u : use) gen |= physical_reg_bit(u);
+    }
+    gen_kill[bb] = {gen, kill};
+    livein[bb] = gen;
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto bb = f->bb.tail; bb; bb = bb->prev) {
+      u32 out = 0;
+      for (auto succ : bb->succ) {
+        if (succ) out |= livein[succ];
+      }
+      auto [gen, kill] = gen_kill[bb];
+      u32 in = gen | (out & ~kill);
+      if (in != livein[bb]) {
+        livein[bb] = in;
+        changed = true;
+      }
+    }
+  }
+  return livein;
+}
+
+// instructions that can be moved across a side exit of a superblock: no side effect, and no flags involved
+// hoisting executes them on the exit path as well, so they must not fault either: only loads from the stack frame
+bool can_cross_branch(MachineInst *inst, bool hoist) {
+  if (is_conditional(inst)) return false;
+  if (isa<MIBinary>(inst) || isa<MIMove>(inst) || isa<MIFma>(inst) || isa<MILongMul>(inst) || isa<MIGlobal>(inst)) {
+    return true;
+  }
+  if (auto x = dyn_cast<MILoad>(inst)) {
+    return x->mode == MIAccess::Mode::Offset &&
+           (!hoist || (x->addr == MachineOperand::R(ArmReg::sp) && x->offset.is_imm()));
+  }
+  return false;
+}
+
+MachineInst *clone_inst(MachineInst *inst) {
+  if (auto x = dyn_cast<MIBinary>(inst)) return new MIBinary(*x);
+  if (auto x = dyn_cast<MIMove>(inst)) return new MIMove(*x);
+  if (auto x = dyn_cast<MIFma>(inst)) return new MIFma(*x);
+  if (auto x = dyn_cast<MILongMul>(inst)) return new MILongMul(*x);
+  if (auto x = dyn_cast<MIGlobal>(inst)) return new MIGlobal(*x);
+  if (auto x = dyn_cast<MILoad>(inst)) return new MILoad(*x);
+  if (auto x = dyn_cast<MIStore>(inst)) return new MIStore(*x);
+  if (auto x = dyn_cast<MIVectorBinary>(inst)) return new MIVectorBinary(*x);
+  if (auto x = dyn_cast<MIVectorFma>(inst)) return new MIVectorFma(*x);
+  if (auto x = dyn_cast<MIVectorMove>(inst)) return new MIVectorMove(*x);
+  if (auto x = dyn_cast<MIVectorDup>(inst)) return new MIVectorDup(*x);
+  if (auto x = dyn_cast<MIVectorExtract>(inst)) return new MIVectorExtract(*x);
+  if (auto x = dyn_cast<MIVectorLoad>(inst)) return new MIVectorLoad(*x);
+  if (auto x = dyn_cast<MIVectorStore>(inst)) return new MIVectorStore(*x);
+  UNREACHABLE();
+}
+
+// superblock: bbs in layout order, each one is entered only from the previous one, which falls through (or jumps) to it
+// the conditional branches of the previous one are side exits
+// static heuristic for the hot path: the next bb is hotter than the exits, unless an exit stays in a deeper loop
+bool extends_superblock(MachineBB *bb, MachineBB *next, std::unordered_map<MachineBB *, u32> &pred_cnt) {
+  if (!next || (bb->succ[0] != next && bb->succ[1] != next) || pred_cnt[next] != 1) return false;
+  if (auto jump = dyn_cast_nullable<MIJump>(bb->insts.tail); jump && jump->target != next) return false;
+  bool has_exit = false;
+  for (auto inst = bb->insts.head; inst; inst = inst->next) {
+    if (auto x = dyn_cast<MIBranch>(inst)) {
+      if (x->target == next || x->target->loop_depth > next->loop_depth) return false;
+      has_exit = true;
+    } else if (isa<MIReturn>(inst)) {
+      return false;
+    }
+  }
+  return has_exit;
+}
+
+// list scheduling of a superblock, instructions can move across side exits (see can_cross_branch)
+// an instruction hoisted above an exit must not define a register live at its target
+// an instruction sunk below an exit is copied to the start of its target, which must have no other predecessors
+// pressure is only given before allocate_register, for a single bb
+void schedule_superblock(const std::vector<MachineBB *> &blocks, std::unordered_map<MachineBB *, u32> &livein,
+                         std::unordered_map<MachineBB *, u32> &pred_cnt, RegPressure *pressure = nullptr) {
+  // create data dependence graph of instructions
+  // instructions that read this register
+  std::map<u32, std::vector<Node *>> read_insts;
+  // instruction that writes this register
+  std::map<u32, Node *> write_insts;
+  // loads can be reordered, but not across store and call
+  // instruction that might have side effect (store, call)
+  Node *side_effect = nullptr;
+  Node *call_barrier = nullptr;
+  std::vector<Node *> load_insts;
+  std::vector<Node *> nodes;
+  // side exits, and the last one of each bb but the last bb
+  std::vector<Node *> exits;
+  std::vector<Node *> last_exit(blocks.size() - 1);
+  // the jumps to the next bb (if not removed by simplify_asm) are added back after scheduling
+  std::vector<MachineInst *> jumps(blocks.size() - 1);
+
+  // calculate data dependence graph
+  for (u32 k = 0; k < blocks.size(); k++) {
+    for (auto inst = blocks[k]->insts.head; inst; inst = inst->next) {
       if (isa<MIComment>(inst)) {
         continue;
       }
+      if (k + 1 < blocks.size() && isa<MIJump>(inst)) {
+        jumps[k] = inst;
+        continue;
+      }
       auto [def, use] = get_def_use_scheduling(inst);
-      auto node = new Node(inst);
+      auto node = new Node(inst, nodes.size());
+      node->block = k;
       nodes.push_back(node);
+      if (pressure) pressure->add_node(node);
+      auto add_edge = [&](Node *from) {
+        from->out_edges.insert(node);
+        node->in_edges.insert(from);
+      };
       if (call_barrier) {
-        call_barrier->out_edges.insert(node);
-        node->in_edges.insert(call_barrier);
+        add_edge(call_barrier);
       }
       for (auto &u : use) {
         if (u.is_reg()) {
           // add edges for read-after-write
-          if (auto &w = write_insts[u.value]) {
-            w->out_edges.insert(node);
-            node->in_edges.insert(w);
+          if (auto &w = write_insts[reg_key(u)]) {
+            add_edge(w);
           }
         }
       }
@@ -193,14 +422,12 @@ void instruction_schedule(MachineFunc *f) {
       for (auto &d : def) {
         if (d.is_reg()) {
           // add edges for write-after-read
-          for (auto &r : read_insts[d.value]) {
-            r->out_edges.insert(node);
-            node->in_edges.insert(r);
+          for (auto &r : read_insts[reg_key(d)]) {
+            add_edge(r);
           }
           // add edges for write-after-write
-          if (auto &w = write_insts[d.value]) {
-            w->out_edges.insert(node);
-            node->in_edges.insert(w);
+          if (auto &w = write_insts[reg_key(d)]) {
+            add_edge(w);
           }
         }
       }
@@ -208,144 +435,298 @@ void instruction_schedule(MachineFunc *f) {
       for (auto &u : use) {
         if (u.is_reg()) {
           // update read_insts
-          read_insts[u.value].push_back(node);
+          read_insts[reg_key(u)].push_back(node);
         }
       }
 
       for (auto &d : def) {
         if (d.is_reg()) {
           // update read_insts and write_insts
-          read_insts[d.value].clear();
-          write_insts[d.value] = node;
+          read_insts[reg_key(d)].clear();
+          write_insts[reg_key(d)] = node;
         }
       }
 
       // don't schedule instructions with side effect
-      if (isa<MIStore>(inst) || isa<MICall>(inst)) {
+      bool is_store = isa<MIStore>(inst) || isa<MIVectorStore>(inst);
+      if (is_store || isa<MICall>(inst)) {
         if (side_effect) {
-          side_effect->out_edges.insert(node);
-          node->in_edges.insert(side_effect);
+          add_edge(side_effect);
         }
         for (auto &n : load_insts) {
-          n->out_edges.insert(node);
-          node->in_edges.insert(n);
+          add_edge(n);
         }
         load_insts.clear();
-      } else if (isa<MILoad>(inst)) {
+      } else if (isa<MILoad>(inst) || isa<MIVectorLoad>(inst)) {
         if (side_effect) {
-          side_effect->out_edges.insert(node);
-          node->in_edges.insert(side_effect);
+          add_edge(side_effect);
         }
         load_insts.push_back(node);
       }
 
-      if (isa<MIStore>(inst) || isa<MICall>(inst)) {
+      if (is_store || isa<MICall>(inst)) {
         side_effect = node;
       }
       if (isa<MICall>(inst)) {
         for (auto &n : nodes) {
           if (n != node) {
-            n->out_edges.insert(node);
-            node->in_edges.insert(n);
+            add_edge(n);
           }
         }
         call_barrier = node;
       }
-      // should be put at the end of bb
-      if (isa<MIBranch>(inst) || isa<MIJump>(inst) || isa<MIReturn>(inst)) {
+
+      if (auto x = dyn_cast<MIBranch>(inst); x && k + 1 < blocks.size()) {
+        // side exit
+        bool can_sink = pred_cnt[x->target] == 1;
+        for (auto &n : nodes) {
+          if (n != node && !(can_sink && can_cross_branch(n->inst, false))) {
+            add_edge(n);
+          }
+        }
+        node->exit = true;
+        exits.push_back(node);
+        last_exit[k] = node;
+      } else if (isa<MIBranch>(inst) || isa<MIJump>(inst) || isa<MIReturn>(inst)) {
+        // should be put at the end of bb
         for (auto &n : nodes) {
           if (n != node) {
-            n->out_edges.insert(node);
-            node->in_edges.insert(n);
+            add_edge(n);
+          }
+        }
+      } else {
+        // the latest exit it can't be hoisted above, the earlier ones are ordered before that one
+        u32 def_mask = 0;
+        for (auto &d : def) def_mask |= physical_reg_bit(d);
+        bool can_hoist = can_cross_branch(inst, true);
+        for (auto it = exits.rbegin(); it != exits.rend(); ++it) {
+          if (!can_hoist || (def_mask & livein[static_cast<MIBranch *>((*it)->inst)->target])) {
+            add_edge(*it);
+            break;
           }
         }
       }
     }
+  }
 
-    // calculate priority
-    // temp is out_degree in this part
-    std::vector<Node *> vis;
-    for (auto &n : nodes) {
-      n->temp = n->out_edges.size();
-      if (n->out_edges.empty()) {
-        vis.push_back(n);
-        n->priority = n->latency;
+  if (pressure) {
+    pressure->finish();
+    // a move whose result is not used later in the bb (a phi move) stays below the instructions before it
+    // moved up, it would interfere with the registers it is coalesced with and leave a copy in the loop
+    std::unordered_set<u32> used_after;
+    for (u32 i = nodes.size(); i-- > 0;) {
+      auto node = nodes[i];
+      auto x = dyn_cast<MIMove>(node->inst);
+      if (x && x->dst.is_virtual() && !used_after.count(x->dst.reg_index())) {
+        for (u32 j = 0; j < i; j++) {
+          nodes[j]->out_edges.insert(node);
+          node->in_edges.insert(nodes[j]);
+        }
       }
+      for (u32 u : node->vreg_use) used_after.insert(pressure->reg[u]);
     }
-    while (!vis.empty()) {
-      Node *n = vis.back();
-      vis.pop_back();
-      for (auto &t : n->in_edges) {
-        t->priority = std::max(t->priority, t->latency + n->priority);
-        t->temp--;
-        if (t->temp == 0) {
-          vis.push_back(t);
-        }
+  }
+
+  // calculate priority
+  // temp is out_degree in this part
+  std::vector<Node *> vis;
+  for (auto &n : nodes) {
+    n->temp = n->out_edges.size();
+    if (n->out_edges.empty()) {
+      vis.push_back(n);
+      n->priority = n->latency;
+    }
+  }
+  while (!vis.empty()) {
+    Node *n = vis.back();
+    vis.pop_back();
+    for (auto &t : n->in_edges) {
+      t->priority = std::max(t->priority, t->latency + n->priority);
+      t->temp--;
+      if (t->temp == 0) {
+        vis.push_back(t);
       }
     }
+  }
 
-    // functional units
-    // see cortex a72 software optimisation
-    CortexA72FU units[] = {
-        {CortexA72FUKind::Branch},          {CortexA72FUKind::Integer}, {CortexA72FUKind::Integer},
-        {CortexA72FUKind::IntegerMultiple}, {CortexA72FUKind::Load},    {CortexA72FUKind::Store},
-    };
-    u32 num_inflight = 0;
+  // functional units
+  // see cortex a72 software optimisation
+  std::vector<CortexA72FU> units;
+  for (auto kind : CORTEX_A72_UNITS) units.push_back({kind});
+  u32 num_inflight = 0;
 
-    // schedule
-    // removes instructions
+  // schedule
+  // removes instructions
+  for (auto bb : blocks) {
     bb->control_transfer_inst = nullptr;
     bb->insts.head = bb->insts.tail = nullptr;
-    // ready list
-    std::vector<Node *> ready;
-    // temp is in_degree in this part
-    for (auto &n : nodes) {
-      n->temp = n->in_edges.size();
-      if (n->in_edges.empty()) {
-        ready.push_back(n);
+  }
+  // instructions are appended to blocks[k], until the last exit of it is scheduled
+  u32 k = 0;
+  // position of each node in the schedule, temp is used below
+  std::vector<u32> pos(nodes.size());
+  u32 num_scheduled = 0;
+  // ready list
+  std::vector<Node *> ready;
+  // temp is in_degree in this part
+  for (auto &n : nodes) {
+    n->temp = n->in_edges.size();
+    if (n->in_edges.empty()) {
+      ready.push_back(n);
+    }
+  }
+
+  auto try_fire = [&](u32 i, u32 cycle) {
+    auto inst = ready[i];
+    auto kind = inst->kind;
+    for (auto &f : units) {
+      if (f.kind == kind && f.inflight == nullptr) {
+        // fire!
+        blocks[k]->insts.insertAtEnd(inst->inst);
+        inst->inst->bb = blocks[k];
+        pos[inst->index] = num_scheduled++;
+        if (pressure) pressure->schedule(inst);
+        if (k + 1 < blocks.size() && inst == last_exit[k]) {
+          if (jumps[k]) blocks[k]->insts.insertAtEnd(jumps[k]);
+          k++;
+        }
+        num_inflight++;
+        f.inflight = inst;
+        f.complete_cycle = cycle + inst->latency;
+        ready.erase(ready.begin() + i);
+        return true;
       }
     }
+    return false;
+  };
 
-    u32 cycle = 0;
-    while (!ready.empty() || num_inflight > 0) {
+  // instructions only move across side exits to fill cycles that would be idle:
+  // an exit is scheduled when the rest of the current bb is waiting for its operands, and the rest is sunk below it
+  // an instruction of a later bb is hoisted only when nothing else can be issued in this cycle
+  u32 cycle = 0;
+  while (!ready.empty() || num_inflight > 0) {
+    bool fired_any = false;
+    if (pressure) {
+      // the ready list of a bb before allocate_register can be long, so the best one that can be issued is searched
+      // instead of sorting it, and the pressure changes after each one
+      // an instruction that would exceed the registers waits for the running ones, unless nothing else can be issued
+      auto has_free_unit = [&](CortexA72FUKind kind) {
+        return std::any_of(units.begin(), units.end(), [&](CortexA72FU &f) { return f.kind == kind && !f.inflight; });
+      };
+      for (;;) {
+        HybridCompare better{*pressure};
+        Node *best = nullptr;
+        u32 best_i = 0;
+        for (u32 i = 0; i < ready.size(); i++) {
+          auto n = ready[i];
+          n->pressure_delta = pressure->delta(n);
+          if (!has_free_unit(n->kind) || ((fired_any || num_inflight > 0) && pressure->exceeds(n))) continue;
+          if (!best || better(n, best)) best = n, best_i = i;
+        }
+        if (!best) break;
+        try_fire(best_i, cycle);
+        fired_any = true;
+      }
+    } else {
       std::sort(ready.begin(), ready.end(), NodeCompare{});
       for (u32 i = 0; i < ready.size();) {
-        auto inst = ready[i];
-        auto kind = inst->kind;
-        bool fired = false;
-        for (auto &f : units) {
-          if (f.kind == kind && f.inflight == nullptr) {
-            // fire!
-            bb->insts.insertAtEnd(inst->inst);
-            num_inflight++;
-            f.inflight = inst;
-            f.complete_cycle = cycle + inst->latency;
-            ready.erase(ready.begin() + i);
-            fired = true;
-            break;
-          }
-        }
-
-        if (!fired) {
+        if (ready[i]->block <= k && !ready[i]->exit && try_fire(i, cycle)) {
+          fired_any = true;
+        } else {
           i++;
         }
       }
+    }
+    auto current = [&](Node *n) { return n->block <= k && !n->exit; };
+    if (std::none_of(ready.begin(), ready.end(), current)) {
+      for (u32 i = 0; i < ready.size(); i++) {
+        if (ready[i]->exit) {
+          fired_any |= try_fire(i, cycle);
+          break;
+        }
+      }
+    }
+    if (!fired_any) {
+      for (u32 i = 0; i < ready.size(); i++) {
+        if (ready[i]->block > k && try_fire(i, cycle)) {
+          dbg("Hoisted instruction above a side exit");
+          break;
+        }
+      }
+    }
 
-      cycle++;
-      for (auto &unit : units) {
-        if (unit.complete_cycle == cycle && unit.inflight) {
-          // finish
-          // put nodes to ready
-          for (auto &t : unit.inflight->out_edges) {
-            t->temp--;
-            if (t->temp == 0) {
-              ready.push_back(t);
-            }
+    cycle++;
+    for (auto &unit : units) {
+      if (unit.complete_cycle == cycle && unit.inflight) {
+        // finish
+        // put nodes to ready
+        for (auto &t : unit.inflight->out_edges) {
+          t->temp--;
+          if (t->temp == 0) {
+            ready.push_back(t);
           }
-          unit.inflight = nullptr;
-          num_inflight--;
         }
+        unit.inflight = nullptr;
+        num_inflight--;
       }
     }
   }
+
+  // compensation code: copy the instructions sunk below an exit to its target, in the scheduled order
+  for (auto exit : exits) {
+    std::vector<Node *> sunk;
+    for (u32 i = 0; i < exit->index; i++) {
+      if (pos[i] > pos[exit->index]) sunk.push_back(nodes[i]);
+    }
+    std::sort(sunk.begin(), sunk.end(), [&](Node *a, Node *b) { return pos[a->index] < pos[b->index]; });
+    auto target = static_cast<MIBranch *>(exit->inst)->target;
+    auto head = target->insts.head;
+    for (auto n : sunk) {
+      auto copy = clone_inst(n->inst);
+      copy->bb = target;
+      if (head) {
+        target->insts.insertBefore(copy, head);
+      } else {
+        target->insts.insertAtEnd(copy);
+      }
+    }
+    if (!sunk.empty()) {
+      auto copied = "Copied " + std::to_string(sunk.size()) + " instructions sunk below a side exit to its target";
+      dbg(copied);
+    }
+  }
+
+  for (auto &n : nodes) delete n;
+}
+
+void instruction_schedule(MachineFunc *f) {
+  auto livein = physical_livein(f);
+  std::unordered_map<MachineBB *, u32> pred_cnt;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    for (auto succ : bb->succ) {
+      if (succ) pred_cnt[succ]++;
+    }
+  }
+  // the entry is also entered by the call
+  pred_cnt[f->bb.head]++;
+  for (auto bb = f->bb.head; bb;) {
+    std::vector<MachineBB *> blocks{bb};
+    while (extends_superblock(blocks.back(), blocks.back()->next, pred_cnt)) blocks.push_back(blocks.back()->next);
+    if (blocks.size() > 1) {
+      auto superblock = "Scheduling a superblock of " + std::to_string(blocks.size()) + " bbs";
+      dbg(superblock);
+    }
+    schedule_superblock(blocks, livein, pred_cnt);
+    bb = blocks.back()->next;
+  }
+}
+
+void pre_ra_schedule(MachineFunc *f) {
+  liveness_analysis(f);
+  // side exits need the live registers of their targets, so each bb is scheduled alone
+  std::unordered_map<MachineBB *, u32> livein, pred_cnt;
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    RegPressure pressure(bb);
+    schedule_superblock({bb}, livein, pred_cnt, &pressure);
+  }
 }
@@ -3,4 +3,25 @@
 #include "../../structure/machine_code.hpp"
 
 // schedule instructions to utilize cpu pipeline
-void instruction_schedule(MachineFunc* f);
\ No newline at end of file
+void instruction_schedule(MachineFunc* f);
+// the same before register allocation, without exceeding the allocatable registers if possible
+void pre_ra_schedule(MachineFunc* f);
+
+// shared with modulo_schedule
+enum class CortexA72FUKind { Branch, Integer, IntegerMultiple, Load, Store, Neon };
+
+// functional units of each kind, one occupies a unit until its result is ready
+constexpr CortexA72FUKind CORTEX_A72_UNITS[] = {
+    CortexA72FUKind::Branch,          CortexA72FUKind::Integer, CortexA72FUKind::Integer,
+    CortexA72FUKind::IntegerMultiple, CortexA72FUKind::Load,    CortexA72FUKind::Store,
+    CortexA72FUKind::Neon,            CortexA72FUKind::Neon,
+};
+
+// latency and functional unit of an instruction
+std::pair<u32, CortexA72FUKind> get_info(MachineInst* inst);
+// operand that stands for q register q in get_def_use_scheduling
+MachineOperand vector_reg(i32 q);
+// same as get_def_use, plus the condition flags, the sp read by calls and the q registers
+std::pair<std::vector<MachineOperand>, std::vector<MachineOperand>> get_def_use_scheduling(MachineInst* inst);
+// copy of an instruction that is not in any bb, for the instructions without control flow or side effect on calls
+MachineInst* clone_inst(MachineInst* inst);
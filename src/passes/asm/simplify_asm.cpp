@@ -5,7 +5,7 @@
 // load/store forms when the writeback offset is encodable.
 #include "simplify_asm.hpp"
 
-#include "allocate_register.hpp"
+#include "liveness.hpp"
 
 namespace {
 
@@ -108,6 +108,13 @@ void simplify_asm(MachineFunc* f) {
           if (y->dst.is_equiv(x->dst) && !y->rhs.is_equiv(x->dst) && y->is_simple()) {
             dbg("Removed useless move");
             bb->insts.remove(inst);
+          } else if (x->is_simple() && y->is_simple() && y->dst.is_equiv(x->rhs) && y->rhs.is_equiv(x->dst)) {
+            // match:
+            // mov r0, r1
+            // mov r1, r0
+            // r1 already holds the value, the second move can be removed
+            dbg("Removed move back to source");
+            bb->insts.remove(y);
           }
         }
       } else if (auto x = dyn_cast<MIBinary>(inst)) {
@@ -6,6 +6,8 @@
 // and phis are repaired.
 #include "bbopt.hpp"
 
+#include <vector>
+
 static void dfs(BasicBlock *bb) {
   if (!bb->vis) {
     bb->vis = true;
@@ -15,10 +17,50 @@ static void dfs(BasicBlock *bb) {
   }
 }
 
+bool remove_unreachable_bb(IrFunc *f) {
+  f->clear_all_vis();
+  dfs(f->bb.head);
+  // 不可达的bb仍然可能有指向可达的bb的边，需要删掉目标bb中的pred和phi中的这一项
+  std::vector<BasicBlock *> unreachable;
+  for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+    if (!bb->vis) {
+      unreachable.push_back(bb);
+      for (BasicBlock *s : bb->succ()) {
+        if (s && s->vis) {
+          u32 idx = std::find(s->pred.begin(), s->pred.end(), bb) - s->pred.begin();
+          s->pred.erase(s->pred.begin() + idx);
+          for (Inst *i = s->insts.head;; i = i->next) {
+            if (auto x = dyn_cast<PhiInst>(i))x->incoming_values.erase(x->incoming_values.begin() + idx);
+            else break;
+          }
+        }
+      }
+    }
+  }
+  // 不可达的bb中的指令之间可能互相使用，先断开所有use关系再删除，否则它们会一直留在可达的值的uses中
+  for (BasicBlock *bb : unreachable) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      for (auto [it, end] = i->operands(); it < end; ++it) it->set(nullptr);
+    }
+  }
+  for (BasicBlock *bb : unreachable) {
+    for (Inst *i = bb->insts.head; i;) {
+      Inst *next = i->next;
+      i->replaceAllUseWith(nullptr);
+      i->deleteValue();
+      i = next;
+    }
+    f->bb.remove(bb);
+    delete bb;
+  }
+  return !unreachable.empty();
+}
+
 // 如果发生了将入度为1的bb的phi直接替换成这个值的优化，则返回true，gvn_gcm需要这个信息，因为这可能产生新的优化机会
 // 如果不这样做，最终交给后端的ir可能包含常量间的二元运算，这是后端不允许的
 bool bbopt(IrFunc *f) {
   bool changed;
+  bool cfg_changed = false;
   do {
     changed = false;
     // 这个循环本来只是为了消除if (常数)，没有必要放在do while里的，但是在这里消除if (x) br a else br a也比较方便
@@ -35,6 +77,7 @@ bool bbopt(IrFunc *f) {
           changed = true; // 可能引入新的以jump结尾的空基本块
         }
         if (deleted) {
+          cfg_changed = true;
           bb->insts.remove(x);
           delete x;
           u32 idx = std::find(deleted->pred.begin(), deleted->pred.end(), bb) - deleted->pred.begin();
@@ -82,38 +125,14 @@ bool bbopt(IrFunc *f) {
         }
         f->bb.remove(bb);
         delete bb;
-        changed = true;
+        changed = cfg_changed = true;
       }
       end:;
       bb = next;
     }
   } while (changed);
 
-  f->clear_all_vis();
-  dfs(f->bb.head);
-  // 不可达的bb仍然可能有指向可达的bb的边，需要删掉目标bb中的pred和phi中的这一项
-  for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
-    if (!bb->vis) {
-      for (BasicBlock *s : bb->succ()) {
-        if (s && s->vis) {
-          u32 idx = std::find(s->pred.begin(), s->pred.end(), bb) - s->pred.begin();
-          s->pred.erase(s->pred.begin() + idx);
-          for (Inst *i = s->insts.head;; i = i->next) {
-            if (auto x = dyn_cast<PhiInst>(i))x->incoming_values.erase(x->incoming_values.begin() + idx);
-            else break;
-          }
-        }
-      }
-    }
-  }
-  for (BasicBlock *bb = f->bb.head; bb;) {
-    BasicBlock *next = bb->next;
-    if (!bb->vis) {
-      f->bb.remove(bb);
-      delete bb;
-    }
-    bb = next;
-  }
+  cfg_changed |= remove_unreachable_bb(f);
 
   bool inst_changed = false;
 
@@ -154,10 +173,12 @@ bool bbopt(IrFunc *f) {
         }
         f->bb.remove(target);
         delete target;
+        cfg_changed = true;
         goto again;
       }
     }
   }
 
+  if (cfg_changed) f->invalidate_analyses();
   return inst_changed;
 }
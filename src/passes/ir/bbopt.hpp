@@ -1,3 +1,6 @@
 #include "../../structure/ir.hpp"
 
-bool bbopt(IrFunc *f);
\ No newline at end of file
+bool bbopt(IrFunc *f);
+
+// 删除从entry不可达的bb和其中的指令，并从可达的bb的pred和phi中删掉来自它们的边，返回是否删除了bb
+bool remove_unreachable_bb(IrFunc *f);
@@ -53,4 +53,5 @@ void compute_callgraph(IrProgram *p) {
                        + "side effect, is " + (f->pure() ? "pure" : "impure");
     dbg(func_purity);
   }
+  p->valid_analyses |= AnalysisCallGraph;
 }
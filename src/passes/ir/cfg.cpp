@@ -2,7 +2,9 @@
 //
 // Computes dominator trees, dominance frontiers, and natural loop structure used
 // by SSA and loop passes.  Example: an edge from a block back to one of its
-// dominators forms a loop whose header is that dominator.
+// dominators forms a loop whose header is that dominator.  Results are cached
+// in IrFunc and only recomputed after the pass manager or a pass that changed
+// the CFG has invalidated them.
 #include "cfg.hpp"
 #include <cassert>
 
@@ -15,6 +17,8 @@ static void dfs(BasicBlock *bb, u32 dom_level) {
 }
 
 void compute_dom_info(IrFunc *f) {
+  if (f->valid_analyses & AnalysisDom) return;
+  f->valid_analyses |= AnalysisDom;
   BasicBlock *entry = f->bb.head;
   // 计算dom_by
   entry->dom_by = {entry};
@@ -119,9 +123,12 @@ static void populate(LoopInfo &info, BasicBlock *bb) {
     sub->bbs.push_back(bb);
 }
 
-LoopInfo compute_loop_info(IrFunc *f) {
+LoopInfo &compute_loop_info(IrFunc *f) {
+  LoopInfo &info = f->loop_info;
+  if (f->valid_analyses & AnalysisLoop) return info;
+  f->valid_analyses |= AnalysisLoop;
   compute_dom_info(f);
-  LoopInfo info;
+  info.clear();
   std::vector<BasicBlock *> worklist;
   collect_loops(info, worklist, f->bb.head);
   f->clear_all_vis();
@@ -139,16 +146,23 @@ static void dfs(std::vector<BasicBlock *> &po, BasicBlock *bb) {
   }
 }
 
-std::vector<BasicBlock *> compute_rpo(IrFunc *f) {
-  std::vector<BasicBlock *> ret;
+std::vector<BasicBlock *> &compute_rpo(IrFunc *f) {
+  std::vector<BasicBlock *> &ret = f->rpo;
+  if (f->valid_analyses & AnalysisRpo) return ret;
+  f->valid_analyses |= AnalysisRpo;
+  ret.clear();
   f->clear_all_vis();
   dfs(ret, f->bb.head);
   std::reverse(ret.begin(), ret.end());
   return ret;
 }
 
-std::unordered_map<BasicBlock *, std::unordered_set<BasicBlock *>> compute_df(IrFunc *f) {
-  std::unordered_map<BasicBlock *, std::unordered_set<BasicBlock *>> df;
+std::unordered_map<BasicBlock *, std::unordered_set<BasicBlock *>> &compute_df(IrFunc *f) {
+  auto &df = f->df;
+  if (f->valid_analyses & AnalysisDf) return df;
+  f->valid_analyses |= AnalysisDf;
+  compute_dom_info(f);
+  df.clear();
   for (BasicBlock *from = f->bb.head; from; from = from->next) {
     for (BasicBlock *to : from->succ()) {
       if (to) { // 枚举所有边(from, to)
@@ -4,54 +4,17 @@
 
 #include "../../structure/ir.hpp"
 
-struct Loop {
-  Loop *parent;
-  std::vector<Loop *> sub_loops;
-  // bbs[0]是loop header
-  std::vector<BasicBlock *> bbs;
-
-  explicit Loop(BasicBlock *header) : parent(nullptr), bbs{header} {}
-
-  BasicBlock *header() { return bbs[0]; }
-
-  // 对于顶层的循环返回1
-  u32 depth() {
-    u32 ret = 0;
-    for (Loop *x = this; x; x = x->parent) ++ret;
-    return ret;
-  }
-
-  void get_deepest_loops(std::vector<Loop *> &deepest) {
-    if (sub_loops.empty()) deepest.push_back(this);
-    else for (Loop *x : sub_loops) x->get_deepest_loops(deepest);
-  }
-};
-
-struct LoopInfo {
-  // 返回bb所处的最深的循环
-  std::unordered_map<BasicBlock *, Loop *> loop_of_bb;
-  std::vector<Loop *> top_level;
-
-  // 若bb不在任何循环中，返回0
-  u32 depth_of(BasicBlock *bb) {
-    auto it = loop_of_bb.find(bb);
-    return it == loop_of_bb.end() ? 0 : it->second->depth();
-  }
-
-  std::vector<Loop *> deepest_loops() {
-    std::vector<Loop *> deepest;
-    for (Loop *l : top_level) l->get_deepest_loops(deepest);
-    return deepest;
-  }
-};
+// 以下分析的结果缓存在IrFunc中，只有在失效后(见IrFunc::valid_analyses)才会重新计算
+// 所以在pass中修改了cfg后，如果还要使用它们，需要先调用f->invalidate_analyses()
 
+// 计算BasicBlock中的idom, dom_by, doms, dom_level
 void compute_dom_info(IrFunc *f);
 
-// 这里假定dom树已经造好了
-LoopInfo compute_loop_info(IrFunc *f);
+// 会先计算dom树。返回的引用在分析失效并重新计算后不再有效
+LoopInfo &compute_loop_info(IrFunc *f);
 
 // 计算bb的rpo序
-std::vector<BasicBlock *> compute_rpo(IrFunc *f);
+std::vector<BasicBlock *> &compute_rpo(IrFunc *f);
 
 // 计算支配边界DF，这里用一个map来存每个bb的df，其实是很随意的选择，把它放在BasicBlock里面也不是不行
-std::unordered_map<BasicBlock *, std::unordered_set<BasicBlock *>> compute_df(IrFunc *f);
\ No newline at end of file
+std::unordered_map<BasicBlock *, std::unordered_set<BasicBlock *>> &compute_df(IrFunc *f);
@@ -23,7 +23,7 @@ static bool same_value_store(StoreInst *store) {
   for (Inst *i = load->next; i && i != store; i = i->next) {
     if (auto x = dyn_cast<StoreInst>(i)) {
       if (!store_preserves_loaded_value(x, load)) return false;
-    } else if (auto x = dyn_cast<CallInst>(i); x && x->func->has_side_effect && is_arr_call_alias(load->lhs_sym, x)) {
+    } else if (auto x = dyn_cast<CallInst>(i); x && is_arr_call_write(load->lhs_sym, x)) {
       return false;
     }
   }
@@ -44,7 +44,8 @@ void dead_store_elim(IrFunc *f) {
         Decl *arr = x->lhs_sym;
         for (Inst *j = next; j; j = j->next) {
           if (auto y = dyn_cast<LoadInst>(j); y && alias(arr, y->lhs_sym)) break;
-          else if (auto y = dyn_cast<CallInst>(j); y && y->func->has_side_effect && is_arr_call_alias(arr, y)) break;
+          // 没有副作用的函数也可能读取作为参数传入的数组或者全局数组，所以不管有没有副作用都不能越过
+          else if (auto y = dyn_cast<CallInst>(j); y && is_arr_call_alias(arr, y)) break;
           else if (auto y = dyn_cast<StoreInst>(j); y && y->lhs_sym == arr && y->arr.value == x->arr.value && y->index.value == x->index.value) {
             bb->insts.remove(x);
             delete x;
@@ -5,14 +5,51 @@
 // their latest safe use.  Example: repeated `a + b` reuses the first value.
 #include "gvn_gcm.hpp"
 
+#include <unordered_map>
+
 #include "../../structure/ast.hpp"
 #include "../../structure/op.hpp"
 #include "cfg.hpp"
 #include "dce.hpp"
 #include "memdep.hpp"
 #include "bbopt.hpp"
+#include "value_range.hpp"
+
+// 值编号表
+// map记录每个已编号的值的vn，以及它所在的表达式桶(只有BinaryInst, GetElementPtrInst, LoadInst, StoreInst和纯函数调用有)
+// exprs把表达式映射到所有具有这个表达式的值，按加入的顺序排列，查找等价值只需要看对应的桶，不需要遍历整个表
+// 表达式由(tag, 操作数的vn, mem_token, callee)组成，可交换运算和互为相反的比较运算在这里规范化
+struct VNExpr {
+  Value::Tag tag;
+  Value *mem_token;  // LoadInst的mem_token；StoreInst以Load的身份加入表中，mem_token是它自己
+  IrFunc *callee;
+  std::vector<Value *> ops;
+
+  bool operator==(const VNExpr &rhs) const {
+    return tag == rhs.tag && mem_token == rhs.mem_token && callee == rhs.callee && ops == rhs.ops;
+  }
+};
 
-using VN = std::vector<std::pair<Value *, Value *>>;
+struct VNExprHash {
+  size_t operator()(const VNExpr &e) const {
+    size_t h = std::hash<u32>{}((u32) e.tag);
+    auto combine = [&h](const void *p) { h ^= std::hash<const void *>{}(p) + 0x9e3779b9 + (h << 6) + (h >> 2); };
+    combine(e.mem_token);
+    combine(e.callee);
+    for (Value *op : e.ops) combine(op);
+    return h;
+  }
+};
+
+struct VN {
+  struct Entry {
+    Value *vn;
+    std::vector<Value *> *bucket;
+  };
+  // unordered_map在rehash时不会使元素的引用失效，所以Entry::bucket和递归调用vn_of期间持有的Entry &都是安全的
+  std::unordered_map<Value *, Entry> map;
+  std::unordered_map<VNExpr, std::vector<Value *>, VNExprHash> exprs;
+};
 
 static Value *vn_of(VN &vn, Value *x);
 
@@ -34,101 +71,105 @@ static BinaryInst *try_canonicalize_pow2_mod(BinaryInst *x) {
   return new BinaryInst(Value::Tag::Mod, x->lhs.value, factor, x);
 }
 
-static Value *find_eq(VN &vn, BinaryInst *x) {
+static bool is_pure_call(Inst *i) {
+  auto x = dyn_cast<CallInst>(i);
+  return x && x->func->pure()
+         && std::none_of(x->args.begin(), x->args.end(), [](Use &arg) { return isa<GetElementPtrInst>(arg.value); });
+}
+
+// 参数中有GetElementPtrInst的纯函数调用也要加入表中，因为GetElementPtrInst的vn可能是数组参数本身，这样它仍然可能与别的调用等价
+static bool has_expr(Value *x) {
+  if (auto y = dyn_cast<CallInst>(x)) return y->func->pure();
+  return isa<BinaryInst>(x) || isa<GetElementPtrInst>(x) || isa<LoadInst>(x) || isa<StoreInst>(x);
+}
+
+static VNExpr expr_of(VN &vn, Value *x) {
   using namespace op;
-  Op t1 = (Op) x->tag;
-  Value *l1 = vn_of(vn, x->lhs.value), *r1 = vn_of(vn, x->rhs.value);
-  // 不能用迭代器，因为vn_of会往vn中push元素
-  for (u32 i = 0; i < vn.size(); ++i) {
-    auto[k, v] = vn[i];
-    // 这时的vn已经插入了{x, x}，所以如果遍历的时候遇到x要跳过
-    if (auto y = dyn_cast<BinaryInst>(k); y && y != x) {
-      Op t2 = (Op) y->tag;
-      Value *l2 = vn_of(vn, y->lhs.value), *r2 = vn_of(vn, y->rhs.value);
-      bool same = (t1 == t2 &&
-                   ((l1 == l2 && r1 == r2) ||
-                    (l1 == r2 && r1 == l2 && (t1 == Add || t1 == Mul || t1 == Eq || t1 == Ne || t1 == And || t1 == Or)))) ||
-                  (l1 == r2 && r1 == l2 && isrev(t1, t2));
-      if (same) return v;
+  if (auto y = dyn_cast<BinaryInst>(x)) {
+    Op t = (Op) y->tag;
+    Value *l = vn_of(vn, y->lhs.value), *r = vn_of(vn, y->rhs.value);
+    if (t == Gt || t == Ge) {
+      // l > r 等价于 r < l
+      t = t == Gt ? Lt : Le;
+      std::swap(l, r);
+    } else if ((t == Add || t == Mul || t == Eq || t == Ne || t == And || t == Or) && std::less<Value *>{}(r, l)) {
+      std::swap(l, r);
     }
+    return {(Value::Tag) t, nullptr, nullptr, {l, r}};
+  } else if (auto y = dyn_cast<GetElementPtrInst>(x)) {
+    return {Value::Tag::GetElementPtr, nullptr, nullptr, {vn_of(vn, y->arr.value), vn_of(vn, y->index.value)}};
+  } else if (auto y = dyn_cast<LoadInst>(x)) {
+    return {Value::Tag::Load, y->mem_token.value, nullptr, {vn_of(vn, y->arr.value), vn_of(vn, y->index.value)}};
+  } else if (auto y = dyn_cast<StoreInst>(x)) {
+    // a[0] = 1; b = a[0]可以变成b = 1，load的mem_token是这个store意味着这个store dominates了这个load
+    return {Value::Tag::Load, y, nullptr, {vn_of(vn, y->arr.value), vn_of(vn, y->index.value)}};
+  } else {
+    auto z = static_cast<CallInst *>(x);
+    VNExpr e{Value::Tag::Call, nullptr, z->func, {}};
+    e.ops.reserve(z->args.size());
+    for (Use &arg : z->args) e.ops.push_back(vn_of(vn, arg.value));
+    return e;
   }
-  return x;
 }
 
-// GetElementPtrInst和LoadInst的find_eq中，对x->arr.value的递归搜索最终会终止于AllocaInst, ParamRef, GlobalRef，它们直接用指针比较
-static Value *find_eq(VN &vn, GetElementPtrInst *x) {
-  if (auto index = dyn_cast<ConstValue>(vn_of(vn, x->index.value)); index && index->imm == 0) {
-    Value *arr = vn_of(vn, x->arr.value);
-    if (auto param = dyn_cast<ParamRef>(arr); param && param->decl->is_param_array()) return arr;
-    if (isa<GetElementPtrInst>(arr)) return arr;
+// 把x加入它当前的表达式对应的桶的末尾，x必须已经在map中
+static std::vector<Value *> &add_expr(VN &vn, Value *x) {
+  VNExpr e = expr_of(vn, x);
+  auto &bucket = vn.exprs[std::move(e)];
+  bucket.push_back(x);
+  vn.map.find(x)->second.bucket = &bucket;
+  return bucket;
+}
+
+static void remove_expr(VN::Entry &e, Value *x) {
+  if (e.bucket) {
+    e.bucket->erase(std::find(e.bucket->begin(), e.bucket->end(), x));
+    e.bucket = nullptr;
   }
+}
 
-  for (u32 i = 0; i < vn.size(); ++i) {
-    auto[k, v] = vn[i];
-    if (auto y = dyn_cast<GetElementPtrInst>(k); y && y != x) {
-      bool same = vn_of(vn, x->arr.value) == vn_of(vn, y->arr.value) &&
-                  vn_of(vn, x->index.value) == vn_of(vn, y->index.value);
-      if (same) return v;
-    }
+// x的操作数或者tag被修改了，需要把它移到新的表达式对应的桶中
+static void update_expr(VN &vn, Value *x) {
+  if (auto it = vn.map.find(x); it != vn.map.end() && it->second.bucket) {
+    remove_expr(it->second, x);
+    add_expr(vn, x);
   }
-  return x;
 }
 
-static Value *find_eq(VN &vn, LoadInst *x) {
-  for (u32 i = 0; i < vn.size(); ++i) {
-    auto[k, v] = vn[i];
-    if (auto y = dyn_cast<LoadInst>(k); y && y != x) {
-      bool same = vn_of(vn, x->arr.value) == vn_of(vn, y->arr.value) &&
-                  vn_of(vn, x->index.value) == vn_of(vn, y->index.value) &&
-                  x->mem_token.value == y->mem_token.value;
-      if (same) return v;
-    } else if (auto y = dyn_cast<StoreInst>(k)) {
-      // a[0] = 1; b = a[0]可以变成b = 1
-      bool same = vn_of(vn, x->arr.value) == vn_of(vn, y->arr.value) &&
-                  vn_of(vn, x->index.value) == vn_of(vn, y->index.value) &&
-                  x->mem_token.value == y; // 这意味着这个store dominates了这个load
-      if (same) return y->data.value;
+// 桶中最早加入的，不是x本身的那个值就是与x等价的值
+static Value *find_eq(VN &vn, std::vector<Value *> &bucket, Value *x) {
+  for (Value *k : bucket) {
+    if (k != x) {
+      if (auto y = dyn_cast<StoreInst>(k)) return y->data.value;
+      return vn.map.find(k)->second.vn;
     }
   }
   return x;
 }
 
-static bool is_pure_call(Inst *i) {
-  auto x = dyn_cast<CallInst>(i);
-  return x && x->func->pure()
-         && std::none_of(x->args.begin(), x->args.end(), [](Use &arg) { return isa<GetElementPtrInst>(arg.value); });
-}
-
-static Value *find_eq(VN &vn, CallInst *x) {
-  if (!is_pure_call(x)) return x;
-  for (u32 i = 0; i < vn.size(); ++i) {
-    auto[k, v] = vn[i];
-    if (auto y = dyn_cast<CallInst>(k); y && y->func == x->func) {
-      assert(x->args.size() == y->args.size());
-      for (u32 j = 0; j < x->args.size(); ++j) {
-        if (vn_of(vn, x->args[j].value) != vn_of(vn, y->args[j].value)) goto fail;
-      }
-      return v;
-      fail:;
-    }
+// GetElementPtrInst和LoadInst的expr_of中，对x->arr.value的递归搜索最终会终止于AllocaInst, ParamRef, GlobalRef，它们直接用指针比较
+static Value *find_eq(VN &vn, GetElementPtrInst *x, std::vector<Value *> &bucket) {
+  if (auto index = dyn_cast<ConstValue>(vn_of(vn, x->index.value)); index && index->imm == 0) {
+    Value *arr = vn_of(vn, x->arr.value);
+    if (auto param = dyn_cast<ParamRef>(arr); param && param->decl->is_param_array()) return arr;
+    if (isa<GetElementPtrInst>(arr)) return arr;
   }
-  return x;
+  return find_eq(vn, bucket, x);
 }
 
 static Value *vn_of(VN &vn, Value *x) {
-  auto it = std::find_if(vn.begin(), vn.end(), [x](std::pair<Value *, Value *> kv) { return kv.first == x; });
-  if (it != vn.end()) return it->second;
+  auto [it, inserted] = vn.map.insert({x, {x, nullptr}});
+  if (!inserted) return it->second.vn;
   // 此时没有指针相等的，但是仍然要找是否存在实际相等的，如果没有的话它的vn就是x
-  u32 idx = vn.size();
-  vn.emplace_back(x, x);
-  if (auto y = dyn_cast<BinaryInst>(x)) vn[idx].second = find_eq(vn, y);
-  else if (auto y = dyn_cast<GetElementPtrInst>(x)) vn[idx].second = find_eq(vn, y);
-  else if (auto y = dyn_cast<LoadInst>(x)) vn[idx].second = find_eq(vn, y);
-  else if (auto y = dyn_cast<CallInst>(x)) vn[idx].second = find_eq(vn, y);
+  VN::Entry &e = it->second;
+  if (has_expr(x)) {
+    auto &bucket = add_expr(vn, x);
+    if (auto y = dyn_cast<GetElementPtrInst>(x)) e.vn = find_eq(vn, y, bucket);
+    else if (!isa<CallInst>(x) || is_pure_call(static_cast<CallInst *>(x))) e.vn = find_eq(vn, bucket, x);
+  }
   // 其余情况一定要求指针相等
-  return vn[idx].second;
+  return e.vn;
 }
-
 // 把形如b = a + 1; c = b + 1的c转化成a + 2
 // 乘法：b = a * C1, c = b * C2 => a * (C1 * C2)
 // 加减总共9种情况，b和c都可以是Add, Sub, Rsb，首先把Sub都变成Add负值，剩下四种情况
@@ -262,23 +303,31 @@ static void schedule_late(std::unordered_set<Inst *> &vis, LoopInfo &info, Inst
 
 // 现在的依赖关系有点复杂，gvn_gcm的第一阶段需要memdep，第二阶段需要memdep和dce, 而dce会清除memdep的结果
 // 不是很方便在pass manager里表示这种关系，所以只能在第一阶段前手动调用memdep，第二阶段前手动依次调用dce和memdep
-void gvn_gcm(IrFunc *f) {
+// use_range时还用compute_value_range的结果折叠比较，见gvn_gcm.hpp
+static void gvn_gcm(IrFunc *f, bool use_range) {
   bbopt(f);
   again:
   BasicBlock *entry = f->bb.head;
   // 阶段1，gvn
   compute_memdep(f);
-  std::vector<BasicBlock *> rpo = compute_rpo(f);
+  std::vector<BasicBlock *> &rpo = compute_rpo(f);
+  // 替换只会把值换成与它相等的值，所以这里计算的范围在整个阶段1中都有效
+  // 不use_range时ranges为空，其中所有指令的范围都是FULL_RANGE，不会折叠任何比较
+  ValueRange ranges = use_range ? compute_value_range(f) : ValueRange{};
   VN vn;
-  auto replace = [&vn](Inst *o, Value *n) {
+  std::vector<Inst *> users;
+  auto replace = [&vn, &users](Inst *o, Value *n) {
     if (o != n) {
+      users.clear();
+      for (Use *u = o->uses.head; u; u = u->next) users.push_back(u->user);
       o->replaceAllUseWith(n);
       o->bb->insts.remove(o);
-      auto it = std::find_if(vn.begin(), vn.end(), [o](std::pair<Value *, Value *> kv) { return kv.first == o; });
-      if (it != vn.end()) {
-        std::swap(*it, vn.back());
-        vn.pop_back();
+      if (auto it = vn.map.find(o); it != vn.map.end()) {
+        remove_expr(it->second, o);
+        vn.map.erase(it);
       }
+      // 用到o的指令的操作数变了，它们的表达式也跟着变了
+      for (Inst *u : users) update_expr(vn, u);
       o->deleteValue();
     }
   };
@@ -293,14 +342,22 @@ void gvn_gcm(IrFunc *f) {
         }
         if (isa<ConstValue>(x->lhs.value) && x->swapOperand()) {
           dbg("IMM operand moved from lhs to rhs");
+          update_expr(vn, x);
         }
         auto l = dyn_cast<ConstValue>(x->lhs.value), r = dyn_cast<ConstValue>(x->rhs.value);
         // for most instructions reach here, rhs is IMM
         if (l && r) {
           // both constant, evaluate and eliminate
           replace(x, ConstValue::get(op::eval((op::Op) x->tag, l->imm, r->imm)));
+        } else if (Range res = ranges.get(x); Value::Tag::Lt <= x->tag && x->tag <= Value::Tag::Ne && res.single()) {
+          // 由操作数的范围就能确定结果的比较，例如循环`i < n`中的`i >= 0`
+          replace(x, ConstValue::get(res.lo));
         } else {
+          Value *old_lhs = x->lhs.value;
           try_fold_lhs(x);
+          // x可能已经作为别的指令的操作数加入了vn，try_fold_lhs修改了x，也可能修改了它的lhs
+          update_expr(vn, x);
+          update_expr(vn, old_lhs);
           if (auto value = x->optimizedValue()) {
             // can be (arithmetically) replaced with one single value (constant or one side of operands)
             replace(x, value);
@@ -339,7 +396,8 @@ void gvn_gcm(IrFunc *f) {
       } else if (isa<StoreInst>(i)) {
         // 这里没有必要做替换，把StoreInst放进vn的目的是让LoadInst可以用store的右手项
         // vn中一定不含这个i，因为没有人用到StoreInst(唯一用到StoreInst的地方是mem_token，但是没有加入vn)
-        vn.emplace_back(i, i);
+        vn.map.insert({i, {i, nullptr}});
+        add_expr(vn, i);
       }
       // 没有必要主动把其他指令加入vn，如果它们被用到的话自然会被加入的
       i = next;
@@ -347,7 +405,7 @@ void gvn_gcm(IrFunc *f) {
   }
   clear_memdep(f), dce(f), compute_memdep(f);
   // 阶段2，gcm
-  LoopInfo info = compute_loop_info(f);
+  LoopInfo &info = compute_loop_info(f);
   std::vector<Inst *> insts;
   for (BasicBlock *bb = entry; bb; bb = bb->next) {
     for (Inst *i = bb->insts.head; i; i = i->next) insts.push_back(i);
@@ -371,3 +429,7 @@ void gvn_gcm(IrFunc *f) {
   clear_memdep(f);
   if (bbopt(f)) goto again;
 }
+
+void gvn_gcm(IrFunc *f) { gvn_gcm(f, false); }
+
+void gvn_gcm_with_range(IrFunc *f) { gvn_gcm(f, true); }
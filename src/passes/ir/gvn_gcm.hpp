@@ -4,3 +4,7 @@
 
 // 这里假定dom树已经造好了
 void gvn_gcm(IrFunc *f);
+
+// 和gvn_gcm相同，此外还把由操作数的范围就能确定结果的比较换成常数，如循环`i < n`中的`i >= 0`
+// 每次都要对整个函数做一次区间分析，所以pass manager只在可能产生这样的比较的地方使用它
+void gvn_gcm_with_range(IrFunc *f);
@@ -33,6 +33,8 @@ void inline_func(IrProgram *p) {
 
   for (IrFunc *f = p->func.head; f; f = f->next) {
     if (f->builtin) continue;
+    // 复制出来的Inst属于f，从f的arena分配
+    ArenaScope scope(&f->arena);
     calls.clear();
     for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
       for (Inst *i = bb->insts.head; i; i = i->next) {
@@ -46,7 +48,7 @@ void inline_func(IrProgram *p) {
         dbg(inline_func);
       }
       bb_map.clear(), val_map.clear(), sym_map.clear(), ret_map.clear();
-      std::vector<Use> &args = x->args;
+      UseVector &args = x->args;
       std::vector<Decl> &params = x->func->func->params;
       for (u32 j = 0, sz = params.size(); j < sz; ++j) {
         if (params[j].is_param_array()) {
@@ -154,6 +156,8 @@ void inline_func(IrProgram *p) {
       }
       bb->insts.remove(x);
       delete x;
+      // f之后可能被内联到别的函数中，那时需要重新计算它的rpo
+      f->invalidate_analyses();
     }
   }
 }
@@ -40,7 +40,7 @@ void mem2reg(IrFunc *f) {
       }
     }
   }
-  auto df = compute_df(f);
+  auto &df = compute_df(f);
   // mem2reg算法阶段1：放置phi节点
   // worklist定义在循环外面，只是为了减少申请内存的次数
   std::vector<BasicBlock *> worklist;       // 用stack还是queue在这里没有本质区别
@@ -57,6 +57,20 @@ bool is_arr_call_alias(Decl *arr, CallInst *y) {
   });
 }
 
+// 库函数中只有getarray和memset写内存，它们只修改第一个参数指向的数组，所以输入输出函数不会修改任何数组
+// 其他有side effect的函数按is_arr_call_alias保守地判断
+bool is_arr_call_write(Decl *arr, CallInst *y) {
+  if (!y->func->has_side_effect) return false;
+  if (!y->func->builtin) return is_arr_call_alias(arr, y);
+  if (y->func->func != &Func::BUILTIN[2] && y->func->func != &Func::BUILTIN[8]) return false;
+  Value *a = y->args[0].value;
+  if (auto x = dyn_cast<GetElementPtrInst>(a)) return alias(arr, x->lhs_sym);
+  if (auto x = dyn_cast<AllocaInst>(a)) return arr == x->sym;
+  if (auto x = dyn_cast<ParamRef>(a)) return alias(arr, x->decl);
+  if (auto x = dyn_cast<GlobalRef>(a)) return alias(arr, x->decl);
+  return true;
+}
+
 struct LoadInfo {
   u32 id;
   std::vector<LoadInst *> loads;
@@ -119,8 +133,8 @@ void compute_memdep(IrFunc *f) {
             bool is_alias = false;
             if (auto x = dyn_cast<StoreInst>(i1); x && alias(arr, x->lhs_sym))
               is_alias = true;
-              // todo: 这里可以更仔细地考虑到底是否修改了参数，现在是粗略的判断，如果没有side effect一定没有修改参数/全局变量
-            else if (auto x = dyn_cast<CallInst>(i1); x && x->func->has_side_effect && is_arr_call_alias(arr, x))
+              // todo: 对于非库函数，这里可以更仔细地考虑到底是否修改了参数，现在是粗略的判断
+            else if (auto x = dyn_cast<CallInst>(i1); x && is_arr_call_write(arr, x))
               is_alias = true;
             if (is_alias) info.stores.insert(i1);
           }
@@ -128,7 +142,7 @@ void compute_memdep(IrFunc *f) {
       }
     }
   }
-  auto df = compute_df(f);
+  auto &df = compute_df(f);
   // 第一趟，构造load对store的依赖关系
   {
     std::vector<BasicBlock *> worklist;
@@ -6,6 +6,9 @@ bool alias(Decl *arr1, Decl *arr2);
 
 bool is_arr_call_alias(Decl *arr, CallInst *y);
 
+// 调用y是否可能修改arr，比is_arr_call_alias更精确，只用来判断写，不能用来判断读
+bool is_arr_call_write(Decl *arr, CallInst *y);
+
 // 删除所有MemPhi和MemOp，并且保证Load.mem_token.value为空
 void clear_memdep(IrFunc *f);
 
@@ -0,0 +1,114 @@
+// Memoization pass for pure recursive functions, only run at -O3.
+//
+// A pure function (it reads no global and writes no memory) that calls itself
+// at two or more places, like `fib(n - 1) + fib(n - 2)`, usually evaluates the
+// same calls exponentially often. Such a function gets a zero-initialized
+// global cache. A new entry block looks the arguments up and returns the cached
+// value on a hit, and every return first stores the arguments and the value.
+// One argument selects the entry by its low bits, so small domains map directly
+// without collisions; several arguments are hashed first. Each entry keeps the
+// full arguments, so a collision only costs a miss.
+#include "memoize_pure_function.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../../structure/ast.hpp"
+
+namespace {
+
+// 缓存的项数是2 * CACHE_SIZE - 1，下标是hash % CACHE_SIZE + CACHE_SIZE - 1，负数的hash也不需要修正
+constexpr i32 CACHE_SIZE = 1024;
+// 最多这么多个参数的函数才做记忆化
+constexpr u32 MAX_PARAMS = 3;
+// 多个参数时hash = (a0 * HASH_MUL + a1) * HASH_MUL + ...
+constexpr i32 HASH_MUL = 1031;
+
+// 纯的，直接递归调用自身至少两次的函数，它的参数都是int
+bool profitable(IrFunc *f) {
+  if (f->builtin || !f->func->is_int || !f->pure() || !f->callee_func.count(f)) return false;
+  std::vector<Decl> &params = f->func->params;
+  if (params.empty() || params.size() > MAX_PARAMS) return false;
+  for (Decl &d : params) {
+    // 读取数组参数不算读全局变量，但结果依赖数组的内容，不能记忆化
+    if (d.is_param_array()) return false;
+  }
+  u32 self_calls = 0;
+  for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      if (auto x = dyn_cast<CallInst>(i); x && x->func == f) ++self_calls;
+    }
+  }
+  return self_calls >= 2;
+}
+
+// 每项依次是valid(为1时有效)，所有参数，返回值
+void memoize(IrProgram *p, IrFunc *f) {
+  ArenaScope scope(&f->arena);
+  std::vector<Decl> &params = f->func->params;
+  i32 stride = params.size() + 2, entries = 2 * CACHE_SIZE - 1;
+  // Decl::name只是string_view，缓存的名字需要一直保留到编译结束
+  // 名字中的.不能出现在SysY的标识符中，所以不会和源程序中的全局变量重名，同specialize_const_arg生成的函数名
+  static std::vector<std::unique_ptr<std::string>> names;
+  auto &name = names.emplace_back(std::make_unique<std::string>(std::string(f->func->name) + ".memo"));
+  auto size = new IntConst{Expr::Tag::IntConst, stride * entries};
+  auto cache = new Decl{false, true, false, {name->c_str(), name->length()}, {size}, {nullptr}, {}};
+  cache->flatten_init.assign(stride * entries, &IntConst::ZERO);
+  cache->value = new GlobalRef(cache);
+  p->glob_decl.push_back(cache);
+  {
+    auto memoize_func = "Memoizing " + std::string(f->func->name) + " in " + *name;
+    dbg(memoize_func);
+  }
+
+  std::vector<Value *> args;
+  for (Decl &d : params) args.push_back(new ParamRef(&d));
+  auto load = [&](Value *index, BasicBlock *bb) { return new LoadInst(cache, cache->value, index, bb); };
+  auto add = [](Value *lhs, i32 rhs, BasicBlock *bb) -> Value * {
+    return rhs ? new BinaryInst(Value::Tag::Add, lhs, ConstValue::get(rhs), bb) : lhs;
+  };
+
+  // 新的entry查找缓存，命中时直接返回，否则执行原来的函数体
+  BasicBlock *body = f->bb.head, *entry = new BasicBlock, *hit = new BasicBlock;
+  f->bb.insertAtBegin(entry);
+  f->bb.insertAfter(hit, entry);
+  Value *hash = args[0];
+  for (u32 k = 1; k < args.size(); ++k) {
+    hash = new BinaryInst(Value::Tag::Add, new BinaryInst(Value::Tag::Mul, hash, ConstValue::get(HASH_MUL), entry),
+                          args[k], entry);
+  }
+  auto mod = new BinaryInst(Value::Tag::Mod, hash, ConstValue::get(CACHE_SIZE), entry);
+  auto base = new BinaryInst(Value::Tag::Mul, add(mod, CACHE_SIZE - 1, entry), ConstValue::get(stride), entry);
+  Value *cond = new BinaryInst(Value::Tag::Eq, load(base, entry), ConstValue::get(1), entry);
+  for (u32 k = 0; k < args.size(); ++k) {
+    auto eq = new BinaryInst(Value::Tag::Eq, load(add(base, k + 1, entry), entry), args[k], entry);
+    cond = new BinaryInst(Value::Tag::And, cond, eq, entry);
+  }
+  new BranchInst(cond, hit, body, entry);
+  hit->pred.push_back(entry);
+  body->pred.push_back(entry);
+  new ReturnInst(load(add(base, stride - 1, hit), hit), hit);
+
+  // 原来的每个return之前把参数和返回值存入缓存，先把return取出来，存完再放回bb的末尾
+  for (BasicBlock *bb = body; bb; bb = bb->next) {
+    auto ret = dyn_cast<ReturnInst>(bb->insts.tail);
+    if (!ret) continue;
+    bb->insts.remove(ret);
+    auto store = [&](Value *data, i32 offset) { new StoreInst(cache, cache->value, data, add(base, offset, bb), bb); };
+    for (u32 k = 0; k < args.size(); ++k) store(args[k], k + 1);
+    store(ret->ret.value, stride - 1);
+    store(ConstValue::get(1), 0);
+    bb->insts.insertAtEnd(ret);
+  }
+}
+
+}  // namespace
+
+void memoize_pure_function(IrProgram *p) {
+  std::vector<IrFunc *> funcs;
+  for (IrFunc *f = p->func.head; f; f = f->next) {
+    if (profitable(f)) funcs.push_back(f);
+  }
+  for (IrFunc *f : funcs) memoize(p, f);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "../../structure/ir.hpp"
+
+void memoize_pure_function(IrProgram *p);
@@ -0,0 +1,409 @@
+// Loop nest optimization pass.
+//
+// Looks at perfectly nested two-level loops over arrays and makes the inner loop
+// walk memory contiguously.  The stride of every access with respect to each loop
+// variable is computed from its GetElementPtr chain, whose multipliers come from
+// the array's dims.  Example: `while (i < n) { while (j < n) { s[j][i] = 0; ... } }`
+// is interchanged into a nest where `i` is the inner loop variable.  When no order
+// is contiguous for all accesses, e.g. `B[i][j] = A[j][i]`, and the rows touched
+// by one run of the inner loop don't fit in the data cache, the inner loop is
+// tiled so that a block of rows is reused by consecutive outer iterations.
+#include "optimize_loop_nest.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "../../structure/ast.hpp"
+#include "cfg.hpp"
+#include "memdep.hpp"
+
+// L1数据缓存的大小和cache line的大小，按Cortex-A72
+static constexpr u32 CACHE_SIZE = 32 * 1024, CACHE_LINE = 64;
+// 一次访问的地址变化超过一个cache line就认为每次都要访问新的cache line，更大的stride并不会更差
+static constexpr int64_t LINE_INTS = CACHE_LINE / sizeof(i32);
+static constexpr u32 MAX_TILE = 64, MIN_TILE = 8;
+
+namespace {
+
+// 外层循环是header(bb_outer) + latch(bb_inc)，中间是内层循环header(bb_inner) + body:
+// bb_outer: i = phi [i0, bb_pre] [i1, bb_inc]; Binary/GEP/Load; if (i < n) br bb_inner else br bb_exit
+// bb_inner: j = phi [j0, bb_outer] [j1, bb_body]; if (j < m) br bb_body else br bb_inc
+// bb_body: 只有Load/Store/Binary/GEP; j1 = j + 1; jump bb_inner
+// bb_inc: i1 = i + 1; jump bb_outer
+struct Nest {
+  BasicBlock *pre, *outer, *inner, *body, *inc, *exit;
+  PhiInst *iv_o, *iv_i;
+  BinaryInst *cond_o, *cond_i, *inc_o, *inc_i;
+  Use *init_o, *init_i, *bound_o, *bound_i;
+
+  bool contains(BasicBlock *bb) const { return bb == outer || bb == inner || bb == body || bb == inc; }
+
+  bool defined_outside(Value *v) const {
+    auto i = dyn_cast<Inst>(v);
+    return !i || !contains(i->bb);
+  }
+};
+
+struct Subscript {
+  Value *index;
+  int multiplier;
+  bool affine;
+  int64_t coef_o, coef_i;  // index关于外层/内层循环变量的系数
+};
+
+struct Access {
+  AccessInst *inst;  // Load或Store
+  Value *root;       // GEP链最开始的数组地址
+  std::vector<Subscript> subscripts;
+  bool affine;
+  int64_t stride_o, stride_i;  // 外层/内层循环变量加1时地址变化多少个元素
+  bool in_header;              // 在bb_outer或bb_inner中，对所有的内层迭代只执行一次
+};
+
+}  // namespace
+
+static int pred_index(BasicBlock *bb, BasicBlock *pred) {
+  auto it = std::find(bb->pred.begin(), bb->pred.end(), pred);
+  return it == bb->pred.end() ? -1 : int(it - bb->pred.begin());
+}
+
+// cond形如iv < bound或bound > iv，返回bound对应的Use
+static Use *match_cond(Value *v, PhiInst *iv, BasicBlock *bb) {
+  auto cond = dyn_cast<BinaryInst>(v);
+  if (!cond || cond->bb != bb || cond->uses.head != cond->uses.tail) return nullptr;
+  if (cond->tag == Value::Tag::Lt && cond->lhs.value == iv) return &cond->rhs;
+  if (cond->tag == Value::Tag::Gt && cond->rhs.value == iv) return &cond->lhs;
+  return nullptr;
+}
+
+static BinaryInst *match_inc(Value *v, PhiInst *iv, BasicBlock *bb) {
+  auto inc = dyn_cast<BinaryInst>(v);
+  if (!inc || inc->bb != bb || inc->tag != Value::Tag::Add) return nullptr;
+  auto one = dyn_cast<ConstValue>((&inc->lhs)[inc->lhs.value == iv].value);
+  if ((inc->lhs.value != iv && inc->rhs.value != iv) || !one || one->imm != 1) return nullptr;
+  return inc;
+}
+
+static bool match_nest(Loop *l, Nest &s) {
+  if (l->bbs.size() != 4 || l->sub_loops.size() != 1) return false;
+  Loop *sub = l->sub_loops[0];
+  if (sub->bbs.size() != 2 || !sub->sub_loops.empty()) return false;
+  s.outer = l->header();
+  s.inner = sub->header();
+  if (s.outer->pred.size() != 2 || s.inner->pred.size() != 2) return false;
+
+  auto br_o = dyn_cast<BranchInst>(s.outer->insts.tail);
+  auto br_i = dyn_cast<BranchInst>(s.inner->insts.tail);
+  if (!br_o || !br_i || br_o->left != s.inner) return false;
+  s.exit = br_o->right;
+  s.body = br_i->left;
+  s.inc = br_i->right;
+  if (s.contains(s.exit) || std::find(l->bbs.begin(), l->bbs.end(), s.inc) == l->bbs.end() ||
+      std::find(sub->bbs.begin(), sub->bbs.end(), s.body) == sub->bbs.end() || s.inc == s.outer ||
+      s.body == s.inner) {
+    return false;
+  }
+  auto jump_b = dyn_cast<JumpInst>(s.body->insts.tail);
+  auto jump_o = dyn_cast<JumpInst>(s.inc->insts.tail);
+  if (!jump_b || jump_b->next != s.inner || !jump_o || jump_o->next != s.outer) return false;
+  int idx_inc = pred_index(s.outer, s.inc), idx_body = pred_index(s.inner, s.body);
+  if (idx_inc < 0 || idx_body < 0 || s.body->pred.size() != 1 || s.inc->pred.size() != 1) return false;
+  s.pre = s.outer->pred[!idx_inc];
+
+  // 两个header中都只有循环变量一个phi
+  s.iv_o = dyn_cast<PhiInst>(s.outer->insts.head);
+  s.iv_i = dyn_cast<PhiInst>(s.inner->insts.head);
+  if (!s.iv_o || !s.iv_i || isa<PhiInst>(s.iv_o->next) || isa<PhiInst>(s.iv_i->next)) return false;
+  s.bound_o = match_cond(br_o->cond.value, s.iv_o, s.outer);
+  s.bound_i = match_cond(br_i->cond.value, s.iv_i, s.inner);
+  if (!s.bound_o || !s.bound_i) return false;
+  s.cond_o = static_cast<BinaryInst *>(br_o->cond.value);
+  s.cond_i = static_cast<BinaryInst *>(br_i->cond.value);
+  // bb_inner中只有phi, cond, br
+  if (s.cond_o->next != br_o || s.iv_i->next != s.cond_i || s.cond_i->next != br_i) return false;
+  s.inc_o = match_inc(s.iv_o->incoming_values[idx_inc].value, s.iv_o, s.inc);
+  s.inc_i = match_inc(s.iv_i->incoming_values[idx_body].value, s.iv_i, s.body);
+  if (!s.inc_o || !s.inc_i || s.inc->insts.head != s.inc_o || s.inc_o->next != jump_o) return false;
+  s.init_o = &s.iv_o->incoming_values[!idx_inc];
+  s.init_i = &s.iv_i->incoming_values[!idx_body];
+  // 循环次数与另一个循环变量无关
+  if (!s.defined_outside(s.bound_o->value) || !s.defined_outside(s.bound_i->value) ||
+      !s.defined_outside(s.init_i->value)) {
+    return false;
+  }
+
+  for (BasicBlock *bb : {s.outer, s.body}) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      if (i == s.iv_o || i == s.cond_o || i == bb->insts.tail) continue;
+      if (isa<StoreInst>(i) && bb == s.body) continue;
+      if (!isa<BinaryInst>(i) && !isa<GetElementPtrInst>(i) && !isa<LoadInst>(i)) return false;
+    }
+  }
+  // 交换后循环变量的终值和bb_outer中的值都会改变，不能在循环外使用
+  for (BasicBlock *bb : {s.outer, s.inner, s.body, s.inc}) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      for (Use *u = i->uses.head; u; u = u->next) {
+        if (!s.contains(u->user->bb)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+// 把v表示成coef_o * iv_o + coef_i * iv_i + 循环不变量，不能表示时返回false
+static bool affine(const Nest &s, Value *v, int64_t &coef_o, int64_t &coef_i, u32 depth = 0) {
+  static constexpr int64_t LIMIT = INT32_MAX;
+  coef_o = coef_i = 0;
+  if (v == s.iv_o) return coef_o = 1, true;
+  if (v == s.iv_i) return coef_i = 1, true;
+  if (s.defined_outside(v)) return true;
+  auto x = dyn_cast<BinaryInst>(v);
+  if (!x || depth > 8) return false;
+  int64_t lo, li, ro, ri;
+  if (!affine(s, x->lhs.value, lo, li, depth + 1) || !affine(s, x->rhs.value, ro, ri, depth + 1)) return false;
+  if (x->tag == Value::Tag::Add) {
+    coef_o = lo + ro, coef_i = li + ri;
+  } else if (x->tag == Value::Tag::Sub) {
+    coef_o = lo - ro, coef_i = li - ri;
+  } else if (x->tag == Value::Tag::Mul) {
+    auto lc = dyn_cast<ConstValue>(x->lhs.value), rc = dyn_cast<ConstValue>(x->rhs.value);
+    if (rc) coef_o = lo * rc->imm, coef_i = li * rc->imm;
+    else if (lc) coef_o = ro * lc->imm, coef_i = ri * lc->imm;
+    else return (lo | li | ro | ri) == 0;
+  } else {
+    return (lo | li | ro | ri) == 0;
+  }
+  return std::abs(coef_o) <= LIMIT && std::abs(coef_i) <= LIMIT;
+}
+
+static Access analyze_access(const Nest &s, AccessInst *x) {
+  Access a{x, nullptr, {}, true, 0, 0, x->bb != s.body};
+  a.subscripts.push_back({x->index.value, 1});
+  Value *arr = x->arr.value;
+  while (auto gep = dyn_cast<GetElementPtrInst>(arr)) {
+    // 内联的参数数组是乘数为0的GEP，不影响地址
+    if (gep->multiplier != 0) a.subscripts.push_back({gep->index.value, gep->multiplier});
+    arr = gep->arr.value;
+  }
+  std::reverse(a.subscripts.begin(), a.subscripts.end());
+  a.root = arr;
+  for (Subscript &sub : a.subscripts) {
+    sub.affine = affine(s, sub.index, sub.coef_o, sub.coef_i);
+    a.affine &= sub.affine;
+    a.stride_o += sub.coef_o * sub.multiplier;
+    a.stride_i += sub.coef_i * sub.multiplier;
+  }
+  return a;
+}
+
+static Decl *root_decl(Value *root) {
+  if (auto x = dyn_cast<GlobalRef>(root)) return x->decl;
+  if (auto x = dyn_cast<ParamRef>(root)) return x->decl;
+  if (auto x = dyn_cast<AllocaInst>(root)) return x->sym;
+  return nullptr;
+}
+
+// 两个访问是否可能访问同一个元素，且这样的两次迭代(i, j)和(i', j')满足i < i'和j > j'
+// 这时交换两层循环会改变它们的先后顺序；反之所有的依赖在交换后都保持原来的顺序
+static bool conflict(const Access &a, const Access &b) {
+  if (a.root != b.root) {
+    bool distinct_objects = (isa<GlobalRef>(a.root) || isa<AllocaInst>(a.root)) &&
+                            (isa<GlobalRef>(b.root) || isa<AllocaInst>(b.root));
+    return !distinct_objects && alias(a.inst->lhs_sym, b.inst->lhs_sym);
+  }
+  // 外提到header中的load与body中的store的先后关系在交换后会改变
+  if (a.in_header || b.in_header) return true;
+  if (a.subscripts.size() != b.subscripts.size()) return true;
+  bool separable = false;
+  for (u32 k = 0; k < a.subscripts.size(); ++k) {
+    const Subscript &x = a.subscripts[k], &y = b.subscripts[k];
+    if (x.index != y.index || x.multiplier != y.multiplier) return true;
+    // 下标相同，且某一维只与一个循环变量有关，则访问同一个元素时这个循环变量相等，依赖方向不会是(<, >)
+    if (x.affine && (x.coef_o == 0) != (x.coef_i == 0)) separable = true;
+  }
+  return !separable;
+}
+
+static bool legal(const std::vector<Access> &accesses) {
+  for (const Access &a : accesses) {
+    if (!isa<StoreInst>(a.inst)) continue;
+    for (const Access &b : accesses) {
+      if (conflict(a, b)) return false;
+    }
+  }
+  return true;
+}
+
+static int64_t cost(const std::vector<Access> &accesses, bool interchanged) {
+  int64_t ret = 0;
+  for (const Access &a : accesses) {
+    if (a.affine) ret += std::min(std::abs(interchanged ? a.stride_o : a.stride_i), LINE_INTS);
+  }
+  return ret;
+}
+
+static std::vector<Access> analyze(const Nest &s) {
+  std::vector<Access> accesses;
+  for (BasicBlock *bb : {s.outer, s.inner, s.body}) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      if (isa<LoadInst>(i) || isa<StoreInst>(i)) accesses.push_back(analyze_access(s, static_cast<AccessInst *>(i)));
+    }
+  }
+  return accesses;
+}
+
+// 交换两个循环变量的范围，再交换它们在循环中的其他使用，最后把bb_outer中依赖新的内层循环变量的指令移到bb_inner
+static void interchange(Nest &s) {
+  dbg("Interchanging loop nest");
+  // j + 1还有其他使用时，新建一个给它们用，inc_i只用于j的phi
+  if (s.inc_i->uses.head != s.inc_i->uses.tail) {
+    auto other = new BinaryInst(Value::Tag::Add, s.iv_i, ConstValue::get(1), s.body);
+    s.body->insts.remove(other);
+    s.body->insts.insertBefore(other, s.inc_i);
+    for (Use *u = s.inc_i->uses.head; u;) {
+      Use *next = u->next;
+      if (u->user != s.iv_i) u->set(other);
+      u = next;
+    }
+  }
+  Value *init_o = s.init_o->value, *bound_o = s.bound_o->value;
+  s.init_o->set(s.init_i->value);
+  s.bound_o->set(s.bound_i->value);
+  s.init_i->set(init_o);
+  s.bound_i->set(bound_o);
+  std::vector<Use *> uses_o, uses_i;
+  for (Use *u = s.iv_o->uses.head; u; u = u->next) {
+    if (u->user != s.cond_o && u->user != s.inc_o) uses_o.push_back(u);
+  }
+  for (Use *u = s.iv_i->uses.head; u; u = u->next) {
+    if (u->user != s.cond_i && u->user != s.inc_i) uses_i.push_back(u);
+  }
+  for (Use *u : uses_o) u->set(s.iv_i);
+  for (Use *u : uses_i) u->set(s.iv_o);
+
+  std::unordered_set<Value *> variant{s.iv_i};
+  for (Inst *i = s.iv_o->next; i != s.cond_o;) {
+    Inst *next = i->next;
+    bool moved = false;
+    for (auto [it, end] = i->operands(); it < end; ++it) moved |= variant.count(it->value) != 0;
+    if (moved) {
+      variant.insert(i);
+      s.outer->insts.remove(i);
+      s.inner->insts.insertBefore(i, s.cond_i);
+      i->bb = s.inner;
+    }
+    i = next;
+  }
+}
+
+// 内层循环次数的估计值，不知道时返回INT64_MAX
+static int64_t inner_trip_count(const Nest &s, const std::vector<Access> &accesses) {
+  auto init = dyn_cast<ConstValue>(s.init_i->value), bound = dyn_cast<ConstValue>(s.bound_i->value);
+  if (init && bound) return std::max<int64_t>(0, int64_t(bound->imm) - init->imm);
+  // 内层循环变量是数组某一维的下标时，循环次数不超过这一维的长度
+  int64_t ret = INT64_MAX;
+  for (const Access &a : accesses) {
+    Decl *d = root_decl(a.root);
+    if (!a.affine || !d) continue;
+    for (const Subscript &sub : a.subscripts) {
+      if (sub.coef_i == 0 || sub.coef_o != 0) continue;
+      for (u32 k = 0; k < d->dims.size(); ++k) {
+        i32 stride = k + 1 < d->dims.size() ? d->dims[k + 1]->result : 1;
+        if (d->dims[k] && stride == sub.multiplier) {
+          ret = std::min(ret, d->dims[k]->result / stride / std::abs(sub.coef_i));
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+// 把内层循环分成长度为size的若干段，每段对所有的外层迭代执行一遍:
+// bb_tile: jj = phi [j0, bb_pre] [jend, bb_tile_inc]; if (jj < m) br bb_clamp else br bb_exit
+// bb_clamp: if (m - jj > size) br bb_full else br bb_tile_end
+// bb_full: jend0 = jj + size; jump bb_tile_end
+// bb_tile_end: jend = phi [m, bb_clamp] [jend0, bb_full]; jump bb_outer
+// 原来的循环中j从jj开始，j < jend时执行，bb_outer跳出时跳到bb_tile_inc: jump bb_tile
+// j0 >= 0，所以0 <= jj < m时m - jj不会溢出，jj + size也不会溢出
+static void tile(IrFunc *f, Nest &s, i32 size) {
+  dbg("Tiling loop nest");
+  Value *j0 = s.init_i->value, *m = s.bound_i->value;
+  auto bb_tile = new BasicBlock, bb_clamp = new BasicBlock, bb_full = new BasicBlock, bb_tile_end = new BasicBlock,
+       bb_tile_inc = new BasicBlock;
+  BasicBlock *after = s.outer->prev;
+  for (BasicBlock *bb : {bb_tile, bb_clamp, bb_full, bb_tile_end}) {
+    f->bb.insertAfter(bb, after);
+    after = bb;
+  }
+  after = s.outer;
+  while (s.contains(after->next)) after = after->next;
+  f->bb.insertAfter(bb_tile_inc, after);
+
+  bb_tile->pred = {s.pre, bb_tile_inc};
+  bb_clamp->pred = {bb_tile};
+  bb_full->pred = {bb_clamp};
+  bb_tile_end->pred = {bb_clamp, bb_full};
+  bb_tile_inc->pred = {s.outer};
+
+  auto jj = new PhiInst(bb_tile);
+  new BranchInst(new BinaryInst(Value::Tag::Lt, jj, m, bb_tile), bb_clamp, s.exit, bb_tile);
+  auto rest = new BinaryInst(Value::Tag::Sub, m, jj, bb_clamp);
+  new BranchInst(new BinaryInst(Value::Tag::Gt, rest, ConstValue::get(size), bb_clamp), bb_full, bb_tile_end, bb_clamp);
+  auto jend0 = new BinaryInst(Value::Tag::Add, jj, ConstValue::get(size), bb_full);
+  new JumpInst(bb_tile_end, bb_full);
+  auto jend = new PhiInst(bb_tile_end);
+  jend->incoming_values[0].set(m);
+  jend->incoming_values[1].set(jend0);
+  new JumpInst(s.outer, bb_tile_end);
+  new JumpInst(bb_tile, bb_tile_inc);
+  jj->incoming_values[0].set(j0);
+  jj->incoming_values[1].set(jend);
+
+  for (BasicBlock **succ : s.pre->succ_ref()) {
+    if (succ && *succ == s.outer) *succ = bb_tile;
+  }
+  s.outer->pred[pred_index(s.outer, s.pre)] = bb_tile_end;
+  static_cast<BranchInst *>(s.outer->insts.tail)->right = bb_tile_inc;
+  s.exit->pred[pred_index(s.exit, s.outer)] = bb_tile;
+  s.init_i->set(jj);
+  s.bound_i->set(jend);
+}
+
+static void optimize(IrFunc *f, Loop *l) {
+  Nest s;
+  if (!match_nest(l, s)) return;
+  std::vector<Access> accesses = analyze(s);
+  if (accesses.empty() || !legal(accesses)) return;
+  if (cost(accesses, true) < cost(accesses, false)) {
+    interchange(s);
+    accesses = analyze(s);
+  }
+
+  // 内层循环每次迭代访问一个新的cache line，外层循环的下一次迭代又访问同一批cache line
+  // 只有内层循环一趟访问的cache line都留在缓存中时才能重用，否则分块执行
+  u32 count = 0;
+  for (const Access &a : accesses) {
+    count += a.affine && std::abs(a.stride_i) >= LINE_INTS && std::abs(a.stride_o) < LINE_INTS;
+  }
+  auto init = dyn_cast<ConstValue>(s.init_i->value);
+  if (count == 0 || !init || init->imm < 0) return;
+  int64_t trips = inner_trip_count(s, accesses);
+  if (trips <= int64_t(CACHE_SIZE / CACHE_LINE / count)) return;
+  i32 t = MAX_TILE;
+  while (t >= i32(MIN_TILE) && u64(t) * CACHE_LINE * count > CACHE_SIZE / 2) t /= 2;
+  if (t >= i32(MIN_TILE) && trips > t) tile(f, s, t);
+}
+
+void optimize_loop_nest(IrFunc *f) {
+  LoopInfo &info = compute_loop_info(f);
+  // 处理的循环嵌套互不相交，修改一个不影响其他的循环信息
+  std::vector<Loop *> outers;
+  for (Loop *l : info.deepest_loops()) {
+    if (l->parent) outers.push_back(l->parent);
+  }
+  for (Loop *l : outers) optimize(f, l);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "../../structure/ir.hpp"
+
+void optimize_loop_nest(IrFunc *f);
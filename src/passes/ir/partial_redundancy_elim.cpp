@@ -0,0 +1,189 @@
+// Partial redundancy elimination pass for loads.
+//
+// gvn_gcm gives equal arithmetic one value number no matter where it is
+// computed and then places it where it dominates all uses, so partially
+// redundant arithmetic is already removed there. Loads are only equal when they
+// see the same memory token, so a load after a join where the array is stored on
+// one path, or in a loop that stores the array, is repeated. This pass looks at
+// the memory phi such a load depends on: when the value at the address is known
+// at the end of some predecessors (from an equal load or a store to the same
+// address), the load becomes a phi, and new loads are only inserted in the other
+// predecessors, which must lead straight to the phi's block and lie outside any
+// loop it heads. A new load must not touch an address the program would not
+// read, since it may be out of bounds: the address has to be loaded every time
+// the phi's block is entered from that predecessor, or be a constant inside the
+// array. Example: `while (i < 3) { s = s + a[k]; a[k] = s; ... }` with i = 0
+// before the loop loads `a[k]` once before the loop and reuses the stored value
+// in later iterations; with `while (i < n)` the loop may not run, so `a[k]` is
+// left alone.
+#include "partial_redundancy_elim.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "../../structure/ast.hpp"
+#include "../../structure/op.hpp"
+#include "cfg.hpp"
+#include "memdep.hpp"
+
+namespace {
+
+// (内存状态, 数组, 地址的两个操作数)
+using Key = std::tuple<Value *, Decl *, Value *, Value *>;
+
+Key key_of(Value *token, AccessInst *x) { return {token, x->lhs_sym, x->arr.value, x->index.value}; }
+
+bool same_addr(AccessInst *lhs, AccessInst *rhs) {
+  return lhs->lhs_sym == rhs->lhs_sym && lhs->arr.value == rhs->arr.value && lhs->index.value == rhs->index.value;
+}
+
+bool dominates(BasicBlock *a, BasicBlock *b) { return b->dom_by.count(a); }
+
+// v在bb的开头已经可用，即它不在bb和bb支配的bb中定义
+bool available_at(Value *v, BasicBlock *bb) {
+  auto x = dyn_cast<Inst>(v);
+  return !x || (x->bb != bb && dominates(x->bb, bb));
+}
+
+struct Pre {
+  LoopInfo &info;
+  // 每个键对应的在这个内存状态下读这个地址得到的值，包括load和这个pass生成的phi
+  std::map<Key, std::vector<Value *>> known;
+
+  // 内存状态为token时，在pred的末尾已知的addr处的值，不知道时返回nullptr
+  Value *find(Value *token, LoadInst *addr, BasicBlock *pred) {
+    if (auto x = dyn_cast<StoreInst>(token); x && same_addr(x, addr)) return x->data.value;
+    if (auto it = known.find(key_of(token, addr)); it != known.end()) {
+      for (Value *v : it->second) {
+        if (dominates(static_cast<Inst *>(v)->bb, pred)) return v;
+      }
+    }
+    return nullptr;
+  }
+
+  // 可以插入load的前驱：唯一的后继是h，不在h为头的循环中，循环深度不超过h，这样插入的load不会比原来执行更多次
+  bool can_insert(BasicBlock *pred, BasicBlock *h) {
+    return isa<JumpInst>(pred->insts.tail) && !dominates(h, pred) && info.depth_of(pred) <= info.depth_of(h);
+  }
+
+  // 从h的第k个前驱进入h后一定会读loads的地址，所以在这个前驱的末尾插入的load不会访问原来不访问的地址
+  // 即某个load在h中，或者h是循环头，从这个前驱进入时循环条件成立，某个load在循环体的第一个bb中
+  bool anticipated(const std::vector<Value *> &loads, BasicBlock *h, u32 k) {
+    auto in = [&loads](BasicBlock *bb) {
+      return std::any_of(loads.begin(), loads.end(), [bb](Value *v) { return static_cast<Inst *>(v)->bb == bb; });
+    };
+    if (in(h)) return true;
+    auto br = dyn_cast<BranchInst>(h->insts.tail);
+    auto cond = br ? dyn_cast<BinaryInst>(br->cond.value) : nullptr;
+    if (!cond || cond->bb != h || !dominates(h, br->left)) return false;
+    // 条件的操作数是h中的phi时取第k个前驱传入的值
+    auto at_entry = [h, k](Value *v) {
+      if (auto phi = dyn_cast<PhiInst>(v); phi && phi->bb == h) v = phi->incoming_values[k].value;
+      return dyn_cast_nullable<ConstValue>(v);
+    };
+    auto l = at_entry(cond->lhs.value), r = at_entry(cond->rhs.value);
+    return l && r && op::eval((op::Op)cond->tag, l->imm, r->imm) && in(br->left);
+  }
+
+  // x的地址是常数，并且在局部或全局数组的范围内，在任何地方读它都不会出错
+  static bool in_bounds(LoadInst *x) {
+    Decl *d = x->lhs_sym;
+    auto index = dyn_cast<ConstValue>(x->index.value);
+    if (!index || d->dims.empty() || !d->dims[0]) return false;
+    i64 offset = index->imm;
+    Value *arr = x->arr.value;
+    for (; auto y = dyn_cast<GetElementPtrInst>(arr); arr = y->arr.value) {
+      auto c = dyn_cast<ConstValue>(y->index.value);
+      if (!c) return false;
+      offset += (i64)c->imm * y->multiplier;
+    }
+    return arr == d->value && 0 <= offset && offset < d->dims[0]->result;
+  }
+
+  // 把所有内存状态为memory phi m，地址相同的load换成m所在的bb中的phi
+  void run(const Key &key) {
+    auto m = static_cast<MemPhiInst *>(std::get<0>(key));
+    BasicBlock *h = m->bb;
+    std::vector<Value *> &loads = known[key];
+    auto first = static_cast<LoadInst *>(loads[0]);
+    if (!available_at(first->arr.value, h) || !available_at(first->index.value, h)) return;
+    // 至少一个load在h或者h的每条回边的起点都被它支配，即每次迭代都会执行，这时在循环外插入的load不会比原来执行更多次
+    // 循环可能一次都不执行，所以这不能保证插入的load是安全的，见anticipated
+    std::vector<BasicBlock *> back_edges;
+    std::copy_if(h->pred.begin(), h->pred.end(), std::back_inserter(back_edges),
+                 [h](BasicBlock *p) { return dominates(h, p); });
+    bool executed = std::any_of(loads.begin(), loads.end(), [&](Value *v) {
+      BasicBlock *bb = static_cast<Inst *>(v)->bb;
+      return bb == h || (!back_edges.empty() && std::all_of(back_edges.begin(), back_edges.end(), [bb](BasicBlock *p) {
+        return dominates(bb, p);
+      }));
+    });
+    if (!executed) return;
+
+    // values[k]为nullptr表示需要在第k个前驱中插入load，为m表示这条边上内存没有变化，值就是这里生成的phi
+    std::vector<Value *> values;
+    bool redundant = false;
+    for (u32 k = 0; k < h->pred.size(); ++k) {
+      Value *token = m->incoming_values[k].value;
+      if (!token) return;
+      Value *v = token == m ? m : find(token, first, h->pred[k]);
+      if (!v && !(can_insert(h->pred[k], h) && (in_bounds(first) || anticipated(loads, h, k)))) return;
+      redundant |= v && v != m;
+      values.push_back(v);
+    }
+    if (!redundant) return;
+    dbg("Replacing partially redundant load with phi");
+
+    auto phi = new PhiInst(h);
+    for (u32 k = 0; k < h->pred.size(); ++k) {
+      Value *v = values[k];
+      if (v == m) {
+        v = phi;
+      } else if (!v) {
+        BasicBlock *pred = h->pred[k];
+        auto load = new LoadInst(first->lhs_sym, first->arr.value, first->index.value, pred);
+        pred->insts.remove(load);
+        pred->insts.insertBefore(load, pred->insts.tail);
+        known[key_of(m->incoming_values[k].value, load)].push_back(load);
+        v = load;
+      }
+      phi->incoming_values[k].set(v);
+    }
+    std::vector<Value *> kept{phi};
+    for (Value *v : loads) {
+      auto x = static_cast<LoadInst *>(v);
+      if (!dominates(h, x->bb)) {
+        kept.push_back(x);
+        continue;
+      }
+      x->replaceAllUseWith(phi);
+      x->bb->insts.remove(x);
+      x->deleteValue();
+    }
+    loads = std::move(kept);
+  }
+};
+
+}  // namespace
+
+void partial_redundancy_elim(IrFunc *f) {
+  compute_memdep(f);
+  Pre pre{compute_loop_info(f), {}};
+  // 按rpo处理，这样前驱中的load先被处理，它们生成的phi也可以作为已知的值
+  std::vector<Key> keys;
+  for (BasicBlock *bb : compute_rpo(f)) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      if (auto x = dyn_cast<LoadInst>(i)) {
+        Key key = key_of(x->mem_token.value, x);
+        std::vector<Value *> &loads = pre.known[key];
+        if (loads.empty() && isa<MemPhiInst>(x->mem_token.value)) keys.push_back(key);
+        loads.push_back(x);
+      }
+    }
+  }
+  for (const Key &key : keys) pre.run(key);
+  clear_memdep(f);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "../../structure/ir.hpp"
+
+void partial_redundancy_elim(IrFunc *f);
@@ -397,6 +397,7 @@ void promote_const_local_array(IrProgram *p) {
   size_t id = 0;
   for (IrFunc *f = p->func.head; f; f = f->next) {
     if (f->builtin) continue;
+    ArenaScope scope(&f->arena);
     std::vector<AllocaInst *> allocas;
     for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
       for (Inst *inst = bb->insts.head; inst; inst = inst->next) {
@@ -0,0 +1,169 @@
+// Interprocedural constant and range propagation pass.
+//
+// Computes an integer range for every scalar parameter (the union over all call
+// sites) and every return value, iterating over the call graph until nothing
+// changes. A constant is a range with one element. Callee bodies are then folded
+// in place without cloning: constant parameters are replaced by the constant,
+// values whose range has one element (such as comparisons decided by the
+// ranges) are replaced by it, and so are calls to functions that always return
+// the same value. The ranges inside a function come from compute_value_range.
+// Example: `int f(int n, int m) { ... f(n - 1, m) ... }` only called as
+// `f(x, 1000007)` gets `m` replaced by 1000007, so `% m` can use the constant
+// division sequence, and `if (g(x) > 1)` folds when `g` only returns 0 or 1.
+#include "propagate_interprocedural_range.hpp"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../../structure/ast.hpp"
+#include "cfg.hpp"
+#include "value_range.hpp"
+
+namespace {
+
+// 一个参数或返回值的范围被扩大这么多次之后就直接扩大到i32的边界，保证递归调用时迭代会终止
+constexpr int WIDEN_LIMIT = 4;
+
+struct Summary {
+  std::vector<Range> params;
+  std::vector<int> param_widen;
+  Range ret = EMPTY_RANGE;
+  int ret_widen = 0;
+};
+
+// 把v合并进slot，变化次数超过WIDEN_LIMIT后直接把变化的一侧扩大到边界，返回slot是否变化
+bool merge(Range &slot, int &widen, Range v) {
+  Range res = join(slot, v);
+  if (res == slot) return false;
+  if (!slot.empty() && ++widen > WIDEN_LIMIT) {
+    if (res.lo < slot.lo) res.lo = INT32_MIN;
+    if (res.hi > slot.hi) res.hi = INT32_MAX;
+  }
+  slot = res;
+  return true;
+}
+
+struct Solver {
+  std::unordered_map<IrFunc *, Summary> summaries;
+
+  // main和库函数的参数来自程序外部，它们的参数和返回值不参与分析
+  bool analyzable(IrFunc *f) { return !f->builtin && f->func->name != "main"; }
+
+  // 参数和调用结果的范围来自summaries，函数内部的值由compute_value_range计算
+  ValueRange analyze(IrFunc *f) {
+    return compute_value_range(f, [this, f](Value *v) {
+      if (auto x = dyn_cast<ParamRef>(v); x && analyzable(f) && !x->decl->is_param_array()) {
+        return summaries[f].params[x->decl - f->func->params.data()];
+      }
+      if (auto x = dyn_cast<CallInst>(v); x && analyzable(x->func)) return summaries[x->func].ret;
+      return FULL_RANGE;
+    });
+  }
+
+  // 重新计算f，把需要重新计算的函数加入work_list：参数范围变化的被调用者，返回值范围变化时的调用者
+  void update(IrFunc *f, std::vector<IrFunc *> &work_list) {
+    ValueRange vr = analyze(f);
+    Range ret = EMPTY_RANGE;
+    for (BasicBlock *bb : compute_rpo(f)) {
+      for (Inst *i = bb->insts.head; i; i = i->next) {
+        if (auto x = dyn_cast<ReturnInst>(i); x && x->ret.value) {
+          ret = join(ret, vr.get(x->ret.value, bb));
+        } else if (auto x = dyn_cast<CallInst>(i); x && analyzable(x->func)) {
+          Summary &s = summaries[x->func];
+          assert(s.params.size() == x->args.size());
+          bool changed = false;
+          for (u32 k = 0; k < x->args.size(); ++k) {
+            if (x->func->func->params[k].is_param_array()) continue;
+            changed |= merge(s.params[k], s.param_widen[k], vr.get(x->args[k].value, bb));
+          }
+          if (changed) work_list.push_back(x->func);
+        }
+      }
+    }
+    if (analyzable(f)) {
+      Summary &s = summaries[f];
+      if (merge(s.ret, s.ret_widen, ret)) {
+        for (IrFunc *caller : f->caller_func) work_list.push_back(caller);
+      }
+    }
+  }
+};
+
+// 把f中所有对params[idx]的使用替换成imm
+void replace_param(IrFunc *f, u32 idx, i32 imm) {
+  std::unordered_set<ParamRef *> refs;
+  for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      auto [begin, end] = i->operands();
+      for (Use *u = begin; u < end; ++u) {
+        auto x = u->value ? dyn_cast<ParamRef>(u->value) : nullptr;
+        if (x && x->decl == &f->func->params[idx]) refs.insert(x);
+      }
+    }
+  }
+  for (ParamRef *x : refs) x->replaceAllUseWith(ConstValue::get(imm));
+}
+
+// 由范围得到的常数一般来自循环的第一次迭代，例如只执行一次的循环中的i + 1，这时phi本身不是常数
+// 把phi的输入换成常数会破坏归纳变量的形式，让后面的循环优化无法识别它，所以不替换这样的值
+bool used_by_phi(Inst *i) {
+  for (Use *u = i->uses.head; u; u = u->next) {
+    if (isa<PhiInst>(u->user)) return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+void propagate_interprocedural_range(IrProgram *p) {
+  Solver s;
+  std::vector<IrFunc *> work_list;
+  for (IrFunc *f = p->func.head; f; f = f->next) {
+    if (f->builtin) continue;
+    if (s.analyzable(f)) {
+      Summary &sum = s.summaries[f];
+      sum.params.assign(f->func->params.size(), EMPTY_RANGE);
+      sum.param_widen.assign(f->func->params.size(), 0);
+    }
+    work_list.push_back(f);
+  }
+  while (!work_list.empty()) {
+    IrFunc *f = work_list.back();
+    work_list.pop_back();
+    s.update(f, work_list);
+  }
+
+  for (IrFunc *f = p->func.head; f; f = f->next) {
+    if (f->builtin) continue;
+    // 用最终的参数和返回值范围重新计算f中的值
+    ValueRange vr = s.analyze(f);
+    if (s.analyzable(f)) {
+      const std::vector<Range> &params = s.summaries[f].params;
+      for (u32 k = 0; k < params.size(); ++k) {
+        if (params[k].single()) replace_param(f, k, params[k].lo);
+      }
+    }
+    for (BasicBlock *bb : compute_rpo(f)) {
+      for (Inst *i = bb->insts.head; i;) {
+        Inst *next = i->next;
+        Range r = vr.get(i);
+        if (!r.single()) {
+          // 空集说明这条指令不会执行(如调用了不会返回的函数)，这时不做任何替换
+        } else if (isa<PhiInst>(i) || (isa<BinaryInst>(i) && !used_by_phi(i))) {
+          i->replaceAllUseWith(ConstValue::get(r.lo));
+          bb->insts.remove(i);
+          i->deleteValue();
+        } else if (isa<CallInst>(i)) {
+          // 调用可能有副作用，留给dce判断能否删除。直接返回调用结果时不替换，以免破坏尾调用
+          std::vector<Use *> uses;
+          for (Use *u = i->uses.head; u; u = u->next) {
+            if (!isa<ReturnInst>(u->user)) uses.push_back(u);
+          }
+          for (Use *u : uses) u->set(ConstValue::get(r.lo));
+        }
+        i = next;
+      }
+    }
+  }
+}
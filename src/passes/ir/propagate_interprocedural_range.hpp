@@ -0,0 +1,5 @@
+#pragma once
+
+#include "../../structure/ir.hpp"
+
+void propagate_interprocedural_range(IrProgram *p);
@@ -2,7 +2,8 @@
 //
 // Deletes non-main functions that have no callers after call-graph analysis.
 // Example: a helper left unreachable after inlining is removed from the IR
-// program before code generation.
+// program before code generation. The removed function's arena is released
+// right away, so its instructions and basic blocks do not outlive it.
 #include "remove_unused_function.hpp"
 #include "../../structure/ast.hpp"
 
@@ -12,6 +13,7 @@ void remove_unused_function(IrProgram *p) {
       auto remove_func = "Function " + std::string(f->func->name) + " not used thus removed from IR";
       dbg(remove_func);
       p->func.remove(f);
+      f->release();
     }
   }
 }
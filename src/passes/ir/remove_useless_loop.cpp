@@ -93,5 +93,6 @@ bool remove_useless_loop(IrFunc *f) {
     }
     fail:;
   }
+  if (changed) f->invalidate_analyses();
   return changed;
 }
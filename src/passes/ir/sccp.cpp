@@ -0,0 +1,166 @@
+// Sparse conditional constant propagation pass.
+//
+// Propagates constants through the SSA graph while only following CFG edges
+// that can execute, so a phi only merges values from executable predecessors.
+// Example: after `f(a, 0)` is inlined, `if (flag) { ... } x = phi [1, then] [2, else]`
+// with a constant `flag` folds `x` to one constant and the dead arm disappears.
+// Branches on constants become jumps and unreachable blocks are deleted.
+#include "sccp.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../../structure/op.hpp"
+#include "bbopt.hpp"
+
+namespace {
+
+// Top: 还没有确定的值(如只有不可执行的前驱的phi)，Const: 一定是imm，Bottom: 不是常数
+struct Lattice {
+  enum Kind { Top, Const, Bottom } kind;
+  i32 imm;
+
+  bool operator==(const Lattice &rhs) const { return kind == rhs.kind && (kind != Const || imm == rhs.imm); }
+};
+
+constexpr Lattice TOP{Lattice::Top, 0}, BOTTOM{Lattice::Bottom, 0};
+
+Lattice meet(Lattice a, Lattice b) {
+  if (a.kind == Lattice::Top) return b;
+  if (b.kind == Lattice::Top) return a;
+  return a == b ? a : BOTTOM;
+}
+
+struct Solver {
+  std::unordered_map<Value *, Lattice> values;
+  std::set<std::pair<BasicBlock *, BasicBlock *>> edges;  // 可执行的边
+  std::vector<BasicBlock *> bb_worklist;
+  std::vector<Inst *> inst_worklist;
+
+  Lattice get(Value *v) {
+    if (auto x = dyn_cast<ConstValue>(v)) return {Lattice::Const, x->imm};
+    // 参数，全局变量，undef都当作不是常数，undef当作任意值可以得到更多的常数，但不值得处理它带来的麻烦
+    if (!isa<Inst>(v)) return BOTTOM;
+    auto it = values.find(v);
+    return it == values.end() ? TOP : it->second;
+  }
+
+  bool executable(BasicBlock *bb) { return bb->vis; }
+
+  void add_edge(BasicBlock *from, BasicBlock *to) {
+    if (!edges.insert({from, to}).second) return;
+    if (!to->vis) {
+      to->vis = true;
+      bb_worklist.push_back(to);
+    } else {
+      // 新的可执行的边只影响phi
+      for (Inst *i = to->insts.head; isa<PhiInst>(i); i = i->next) inst_worklist.push_back(i);
+    }
+  }
+
+  void update(Inst *i, Lattice v) {
+    Lattice &old = values.try_emplace(i, TOP).first->second;
+    if (old == v) return;
+    old = v;
+    for (Use *u = i->uses.head; u; u = u->next) {
+      if (executable(u->user->bb)) inst_worklist.push_back(u->user);
+    }
+  }
+
+  Lattice eval(BinaryInst *x) {
+    Lattice l = get(x->lhs.value), r = get(x->rhs.value);
+    if (l.kind == Lattice::Const && r.kind == Lattice::Const) {
+      // 不在编译期间执行除0和溢出的除法
+      bool div = x->tag == Value::Tag::Div || x->tag == Value::Tag::Mod;
+      if (div && (r.imm == 0 || (l.imm == INT_MIN && r.imm == -1))) return BOTTOM;
+      return {Lattice::Const, op::eval((op::Op)x->tag, l.imm, r.imm)};
+    }
+    // 一个操作数就能确定结果的情形，另一个操作数是什么都不影响
+    auto is = [](Lattice v, i32 imm) { return v.kind == Lattice::Const && v.imm == imm; };
+    if ((x->tag == Value::Tag::Mul || x->tag == Value::Tag::And) && (is(l, 0) || is(r, 0))) return {Lattice::Const, 0};
+    if (x->tag == Value::Tag::Or && ((l.kind == Lattice::Const && l.imm) || (r.kind == Lattice::Const && r.imm))) {
+      return {Lattice::Const, 1};
+    }
+    if (l.kind == Lattice::Top || r.kind == Lattice::Top) return TOP;
+    return BOTTOM;
+  }
+
+  void visit(Inst *i) {
+    if (auto x = dyn_cast<PhiInst>(i)) {
+      Lattice v = TOP;
+      for (u32 k = 0; k < x->incoming_values.size(); ++k) {
+        if (edges.count({x->bb->pred[k], x->bb})) v = meet(v, get(x->incoming_values[k].value));
+      }
+      update(x, v);
+    } else if (auto x = dyn_cast<BinaryInst>(i)) {
+      update(x, eval(x));
+    } else if (auto x = dyn_cast<BranchInst>(i)) {
+      // 条件是Top说明它依赖于没有定义的值，当作不是常数
+      Lattice c = get(x->cond.value);
+      if (c.kind != Lattice::Const || c.imm) add_edge(x->bb, x->left);
+      if (c.kind != Lattice::Const || !c.imm) add_edge(x->bb, x->right);
+    } else if (auto x = dyn_cast<JumpInst>(i)) {
+      add_edge(x->bb, x->next);
+    } else if (!isa<ReturnInst>(i)) {
+      update(i, BOTTOM);
+    }
+  }
+
+  void solve(IrFunc *f) {
+    f->clear_all_vis();
+    f->bb.head->vis = true;
+    bb_worklist.push_back(f->bb.head);
+    while (!bb_worklist.empty() || !inst_worklist.empty()) {
+      while (!inst_worklist.empty()) {
+        Inst *i = inst_worklist.back();
+        inst_worklist.pop_back();
+        visit(i);
+      }
+      if (!bb_worklist.empty()) {
+        BasicBlock *bb = bb_worklist.back();
+        bb_worklist.pop_back();
+        for (Inst *i = bb->insts.head; i; i = i->next) visit(i);
+      }
+    }
+  }
+};
+
+}  // namespace
+
+void sccp(IrFunc *f) {
+  Solver s;
+  s.solve(f);
+
+  for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+    if (!bb->vis) continue;
+    for (Inst *i = bb->insts.head; i;) {
+      Inst *next = i->next;
+      if (Lattice v = s.get(i); v.kind == Lattice::Const && (isa<PhiInst>(i) || isa<BinaryInst>(i))) {
+        i->replaceAllUseWith(ConstValue::get(v.imm));
+        bb->insts.remove(i);
+        i->deleteValue();
+      }
+      i = next;
+    }
+    // 只有一个后继可以执行的跳转改成jump，从另一个后继的pred和phi中删掉这条边
+    if (auto x = dyn_cast<BranchInst>(bb->insts.tail); x && x->left != x->right) {
+      bool left = s.edges.count({bb, x->left}), right = s.edges.count({bb, x->right});
+      if (left == right) continue;
+      BasicBlock *target = left ? x->left : x->right, *deleted = left ? x->right : x->left;
+      bb->insts.remove(x);
+      x->deleteValue();
+      new JumpInst(target, bb);
+      u32 idx = std::find(deleted->pred.begin(), deleted->pred.end(), bb) - deleted->pred.begin();
+      deleted->pred.erase(deleted->pred.begin() + idx);
+      for (Inst *i = deleted->insts.head; isa<PhiInst>(i); i = i->next) {
+        auto phi = static_cast<PhiInst *>(i);
+        phi->incoming_values.erase(phi->incoming_values.begin() + idx);
+      }
+    }
+  }
+  remove_unreachable_bb(f);
+}
@@ -97,6 +97,7 @@ IrFunc *clone_for_const_args(IrFunc *src, const SpecializationKey &key, int ordi
   dst->load_global = src->load_global;
   dst->has_side_effect = src->has_side_effect;
   dst->can_inline = false;
+  ArenaScope scope(&dst->arena);
 
   // Keep cloned function and local names alive for the rest of compilation.
   static std::vector<std::unique_ptr<std::string>> names;
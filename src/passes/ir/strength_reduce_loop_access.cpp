@@ -8,6 +8,8 @@
 #include <algorithm>
 #include <vector>
 
+#include "../../structure/op.hpp"
+
 namespace {
 
 int pred_index(BasicBlock *bb, BasicBlock *pred) {
@@ -185,19 +187,32 @@ PhiInst *find_unit_iv(BasicBlock *header, const std::vector<BasicBlock *> &prehe
     if (!phi) break;
     if (!match_add_one(incoming_from(phi, body), phi)) continue;
 
-    bool all_zero_init = true;
+    bool invariant_init = true;
     for (BasicBlock *preheader : preheaders) {
-      auto init = dyn_cast<ConstValue>(incoming_from(phi, preheader));
-      if (!init || init->imm != 0) {
-        all_zero_init = false;
+      if (defined_in(incoming_from(phi, preheader), header, body)) {
+        invariant_init = false;
         break;
       }
     }
-    if (all_zero_init) return phi;
+    if (invariant_init) return phi;
   }
   return nullptr;
 }
 
+// Folds constant operands, since codegen does not accept a BinaryInst with two
+// constant operands.
+Value *make_binary_before(Value::Tag tag, Value *lhs, Value *rhs, Inst *before) {
+  auto l = dyn_cast<ConstValue>(lhs), r = dyn_cast<ConstValue>(rhs);
+  if (l && r) return ConstValue::get(op::eval((op::Op)tag, l->imm, r->imm));
+  if (tag == Value::Tag::Add && l && l->imm == 0) return rhs;
+  if (tag == Value::Tag::Add && r && r->imm == 0) return lhs;
+  if (tag == Value::Tag::Mul && ((l && l->imm == 0) || (r && r->imm == 0))) return ConstValue::get(0);
+  auto inst = new BinaryInst(tag, lhs, rhs, before->bb);
+  inst->bb->insts.remove(inst);
+  before->bb->insts.insertBefore(inst, before);
+  return inst;
+}
+
 bool transform(BasicBlock *header) {
   std::vector<BasicBlock *> preheaders;
   BasicBlock *body = nullptr;
@@ -231,7 +246,11 @@ bool transform(BasicBlock *header) {
     for (BasicBlock *preheader : preheaders) {
       int pre_idx = pred_index(header, preheader);
       assert(pre_idx >= 0);
-      auto init = make_gep_before(candidate.access->lhs_sym, candidate.arr, candidate.index.base, terminator(preheader));
+      // The iv starts from a loop-invariant value, so the first address is base + init * stride.
+      Inst *before = terminator(preheader);
+      Value *scaled = make_binary_before(Value::Tag::Mul, incoming_from(iv, preheader), candidate.index.stride, before);
+      Value *offset = make_binary_before(Value::Tag::Add, candidate.index.base, scaled, before);
+      auto init = make_gep_before(candidate.access->lhs_sym, candidate.arr, offset, before);
       ptr->incoming_values[pre_idx].set(init);
     }
     ptr->incoming_values[body_idx].set(next);
@@ -0,0 +1,121 @@
+// Tail recursion elimination pass.
+//
+// Replaces a call of a function to itself whose result is returned right away
+// with a jump back to the start of the function. The old entry becomes a loop
+// header with one phi per parameter, fed by the arguments of each such call.
+// Example: `int gcd(int a, int b) { if (b == 0) return a; return gcd(b, a % b); }`
+// becomes a loop, so it no longer pushes a frame per call, and the loop passes
+// and inline_func (which refuses self-recursive callees) can handle it.
+#include "tail_recursion_to_loop.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include "../../structure/ast.hpp"
+#include "bbopt.hpp"
+
+namespace {
+
+// x的结果直接被返回时x是尾调用，包括跳转到只有return的bb，例如`if (...) { f(...); }`之后的return
+// 这时return的值可能是以x为来自x->bb的输入的phi
+bool is_tail_call(CallInst *x) {
+  Value *ret_value = x;
+  Inst *next = x->next;
+  if (auto j = dyn_cast<JumpInst>(next)) {
+    BasicBlock *target = j->next;
+    next = target->insts.head;
+    if (auto phi = dyn_cast<PhiInst>(next)) {
+      u32 idx = std::find(target->pred.begin(), target->pred.end(), x->bb) - target->pred.begin();
+      if (phi->incoming_values[idx].value != x || phi->uses.head != phi->uses.tail) return false;
+      ret_value = phi;
+      next = phi->next;
+    }
+  }
+  auto ret = dyn_cast<ReturnInst>(next);
+  if (!ret) return false;
+  // 没有返回值的函数中x没有use，有返回值时x唯一的use就是return或者上面的phi
+  if (!ret->ret.value) return !x->uses.head;
+  return ret->ret.value == ret_value && x->uses.head == x->uses.tail;
+}
+
+// 数组参数不能用phi表示(inline_func等要求数组参数是GetElementPtrInst或ParamRef)，只处理原样传递数组参数的调用
+// 前端传递数组参数时生成的下标为0的GetElementPtrInst在gvn_gcm之后才会被替换成ParamRef，所以这个pass在gvn_gcm之后运行
+bool passes_arrays_unchanged(CallInst *x) {
+  std::vector<Decl> &params = x->func->func->params;
+  for (u32 k = 0; k < params.size(); ++k) {
+    auto param = dyn_cast<ParamRef>(x->args[k].value);
+    if (params[k].is_param_array() && !(param && param->decl == &params[k])) return false;
+  }
+  return true;
+}
+
+// 删除from到to的边，to不再以from为前驱
+void remove_edge(BasicBlock *from, BasicBlock *to) {
+  u32 idx = std::find(to->pred.begin(), to->pred.end(), from) - to->pred.begin();
+  to->pred.erase(to->pred.begin() + idx);
+  for (Inst *i = to->insts.head; isa<PhiInst>(i); i = i->next) {
+    auto phi = static_cast<PhiInst *>(i);
+    phi->incoming_values.erase(phi->incoming_values.begin() + idx);
+  }
+}
+
+}  // namespace
+
+void tail_recursion_to_loop(IrFunc *f) {
+  std::vector<CallInst *> calls;
+  for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      if (auto x = dyn_cast<CallInst>(i); x && x->func == f && is_tail_call(x) && passes_arrays_unchanged(x)) {
+        calls.push_back(x);
+      }
+    }
+  }
+  if (calls.empty()) return;
+  dbg("Converting tail recursion to loop");
+
+  // 原来的entry成为循环头，新的entry只跳转到它，它的前驱依次是新的entry和每个调用所在的bb
+  BasicBlock *header = f->bb.head, *entry = new BasicBlock;
+  f->bb.insertAtBegin(entry);
+  new JumpInst(header, entry);
+  header->pred.push_back(entry);
+  for (CallInst *x : calls) {
+    Inst *term = x->bb->insts.tail;
+    if (auto j = dyn_cast<JumpInst>(term)) remove_edge(x->bb, j->next);
+    x->bb->insts.remove(term);
+    term->deleteValue();
+    header->pred.push_back(x->bb);
+  }
+
+  std::vector<Decl> &params = f->func->params;
+  for (u32 k = 0; k < params.size(); ++k) {
+    auto unchanged = [&](CallInst *x) {
+      auto param = dyn_cast<ParamRef>(x->args[k].value);
+      return param && param->decl == &params[k];
+    };
+    if (std::all_of(calls.begin(), calls.end(), unchanged)) continue;
+    // 函数中原来对参数的使用都换成phi，包括调用的参数中的使用，它们是这一次迭代中参数的值
+    auto phi = new PhiInst(header);
+    std::unordered_set<ParamRef *> refs;
+    for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+      for (Inst *i = bb->insts.head; i; i = i->next) {
+        for (auto [u, end] = i->operands(); u < end; ++u) {
+          auto x = u->value ? dyn_cast<ParamRef>(u->value) : nullptr;
+          if (x && x->decl == &params[k]) refs.insert(x);
+        }
+      }
+    }
+    for (ParamRef *x : refs) x->replaceAllUseWith(phi);
+    phi->incoming_values[0].set(new ParamRef(&params[k]));
+    for (u32 j = 0; j < calls.size(); ++j) phi->incoming_values[j + 1].set(calls[j]->args[k].value);
+  }
+
+  for (CallInst *x : calls) {
+    BasicBlock *bb = x->bb;
+    bb->insts.remove(x);
+    x->deleteValue();
+    new JumpInst(header, bb);
+  }
+  // 只能由尾调用到达的return所在的bb现在不可达了
+  remove_unreachable_bb(f);
+}
@@ -9,6 +9,8 @@
 #include <array>
 #include <vector>
 
+#include "value_range.hpp"
+
 namespace {
 
 bool is_cmp(Value::Tag tag) {
@@ -114,6 +116,11 @@ Value *exclusive_bound(Value::Tag tag, Value *bound, BasicBlock *bb) {
   return nullptr;
 }
 
+// exclusive_bound对应的范围
+Range exclusive_range(Value::Tag tag, Range bound) {
+  return tag == Value::Tag::Le ? eval_range(Value::Tag::Add, bound, {1, 1}) : bound;
+}
+
 BasicBlock *single_preheader(BasicBlock *header, BasicBlock *guard, BasicBlock *body) {
   BasicBlock *preheader = nullptr;
   for (BasicBlock *pred : header->pred) {
@@ -301,8 +308,26 @@ bool try_tighten(BasicBlock *header, IrFunc *f) {
     if (phi != iv && phi->incoming_values[guard_idx].value != phi->incoming_values[body_idx].value) return false;
   }
 
+  // 值的范围能确定哪个上界更小时，不需要在preheader中比较：header的上界更小时guard永远成立，直接去掉guard，
+  // guard的上界更小时header的条件永远比guard的条件先不成立，直接把header的条件换成guard的条件
+  bool keep_header_cond = false;
+  if (can_use_min_bound) {
+    ValueRange ranges = compute_value_range(f);
+    Range header_limit = exclusive_range(header_cmp_tag, ranges.get(header_cmp_bound, preheader));
+    Range body_limit = exclusive_range(body_cmp_tag, ranges.get(body_cmp_bound, preheader));
+    if (!header_limit.empty() && !body_limit.empty()) {
+      if (body_limit.hi <= header_limit.lo) {
+        header_br->cond.set(new BinaryInst(body_cmp_tag, iv, body_cmp_bound, header_br));
+        keep_header_cond = true;
+      } else if (header_limit.hi <= body_limit.lo) {
+        keep_header_cond = true;
+      }
+    }
+    can_use_min_bound = !keep_header_cond;
+  }
+
   dbg("Tightening guarded loop bound");
-  if (!can_use_min_bound) {
+  if (!can_use_min_bound && !keep_header_cond) {
     auto body_cmp = new BinaryInst(body_cmp_tag, iv, body_cmp_bound, header_br);
     auto combined_cmp = new BinaryInst(Value::Tag::And, header_br->cond.value, body_cmp, header_br);
     header_br->cond.set(combined_cmp);
@@ -334,6 +359,11 @@ bool try_tighten(BasicBlock *header, IrFunc *f) {
 void tighten_guarded_loop_bound(IrFunc *f) {
   for (BasicBlock *bb = f->bb.head; bb;) {
     BasicBlock *next = bb->next;
-    bb = try_tighten(bb, f) ? f->bb.head : next;
+    if (try_tighten(bb, f)) {
+      f->invalidate_analyses();
+      bb = f->bb.head;
+    } else {
+      bb = next;
+    }
   }
 }
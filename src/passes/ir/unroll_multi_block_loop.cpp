@@ -0,0 +1,355 @@
+// Multi-block loop unrolling pass.
+//
+// Unrolls innermost loops with branches in their body, i.e. an `if` or a `break`,
+// which loop_unroll and vectorize_loop leave alone.  Example: for
+// `while (i < n) { if (a[i] > 0) s = s + a[i]; i = i + 1; }` an unrolled loop that
+// runs k iterations per `i < n - (k - 1)` check is put in front of it, and the
+// original loop stays as the remainder loop for the last 0~k-1 iterations.  Other
+// loops with a single exit block, e.g. a search loop ending in `break`, get k
+// copies of their body chained together, each keeping its own exit tests.
+#include "unroll_multi_block_loop.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../../structure/op.hpp"
+#include "cfg.hpp"
+
+// 展开后循环中最多的指令数，不计phi和跳转
+static constexpr u32 MAX_UNROLLED_SIZE = 64;
+// 整个循环中都存活的值(header中的phi和用到的循环不变量)的个数不超过它们时才展开4次或2次
+// 可分配的寄存器是r0~r12和lr共14个，展开后gvn_gcm还会在各份拷贝之间共享值，比如i + 1, i + 2，需要再留一些余量
+static constexpr u32 MAX_LIVE_FOR_4 = 8, MAX_LIVE_FOR_2 = 11;
+
+namespace {
+
+struct LoopShape {
+  std::vector<BasicBlock *> bbs;  // rpo序，bbs[0]是header
+  std::unordered_set<BasicBlock *> in_loop;
+  BasicBlock *header, *preheader, *latch, *exit;
+  u32 idx_latch;  // latch在header->pred中的下标
+  bool header_only_exit;
+
+  bool defined_outside(Value *v) const {
+    auto i = dyn_cast<Inst>(v);
+    return !i || !in_loop.count(i->bb);
+  }
+};
+
+// 循环的一份拷贝，不在map中的bb和值对应它自己，所以空的Copy就是原来的循环
+struct Copy {
+  std::unordered_map<BasicBlock *, BasicBlock *> bbs;
+  std::unordered_map<Value *, Value *> values;
+
+  BasicBlock *get(BasicBlock *bb) const {
+    auto it = bbs.find(bb);
+    return it != bbs.end() ? it->second : bb;
+  }
+
+  Value *get(Value *v) const {
+    auto it = values.find(v);
+    return it != values.end() ? it->second : v;
+  }
+};
+
+}  // namespace
+
+// 复制循环中的所有bb，依次插入到after之后。调用前c.values中需要已经有header中的phi对应的值
+// 如果c.bbs中已经有header的拷贝就在它的末尾继续复制header中的其他指令，否则新建一个，它的pred由调用者设置
+// 跳转到循环外或者header的目标不变，由调用者修改
+static void clone_loop(IrFunc *f, const LoopShape &s, Copy &c, BasicBlock *&after) {
+  for (BasicBlock *bb : s.bbs) {
+    if (c.bbs.find(bb) == c.bbs.end()) {
+      auto cloned = new BasicBlock;
+      c.bbs.insert({bb, cloned});
+      f->bb.insertAfter(cloned, after);
+      after = cloned;
+    }
+  }
+  // 除header外的bb的pred都在循环中；phi之间可能循环引用，先建好，最后再填值
+  for (BasicBlock *bb : s.bbs) {
+    if (bb == s.header) continue;
+    BasicBlock *cloned = c.get(bb);
+    for (BasicBlock *p : bb->pred) cloned->pred.push_back(c.get(p));
+    for (Inst *i = bb->insts.head; isa<PhiInst>(i); i = i->next) c.values.insert({i, new PhiInst(cloned)});
+  }
+  auto get = [&c](const Use &u) { return c.get(u.value); };
+  auto target = [&s, &c](BasicBlock *bb) { return bb == s.header ? bb : c.get(bb); };
+  for (BasicBlock *bb : s.bbs) {
+    BasicBlock *cloned = c.get(bb);
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      if (isa<PhiInst>(i)) continue;
+      Inst *res;
+      if (auto x = dyn_cast<BinaryInst>(i))
+        res = new BinaryInst(x->tag, get(x->lhs), get(x->rhs), cloned);
+      else if (auto x = dyn_cast<BranchInst>(i))
+        res = new BranchInst(get(x->cond), target(x->left), target(x->right), cloned);
+      else if (auto x = dyn_cast<JumpInst>(i))
+        res = new JumpInst(target(x->next), cloned);
+      else if (auto x = dyn_cast<GetElementPtrInst>(i))
+        res = new GetElementPtrInst(x->lhs_sym, get(x->arr), get(x->index), x->multiplier, cloned);
+      else if (auto x = dyn_cast<LoadInst>(i))
+        res = new LoadInst(x->lhs_sym, get(x->arr), get(x->index), cloned);  // 不维护内存依赖
+      else if (auto x = dyn_cast<StoreInst>(i))
+        res = new StoreInst(x->lhs_sym, get(x->arr), get(x->data), get(x->index), cloned);
+      else
+        UNREACHABLE();
+      c.values.insert({i, res});
+    }
+  }
+  for (BasicBlock *bb : s.bbs) {
+    if (bb == s.header) continue;
+    for (Inst *i = bb->insts.head; isa<PhiInst>(i); i = i->next) {
+      auto x = static_cast<PhiInst *>(i), cloned = static_cast<PhiInst *>(c.get(x));
+      for (u32 j = 0, sz = x->incoming_values.size(); j < sz; ++j) {
+        cloned->incoming_values[j].set(get(x->incoming_values[j]));
+      }
+    }
+  }
+}
+
+// header中的phi在第j份拷贝中的值是第j-1份拷贝的latch传过来的值
+static void map_header_phis(const LoopShape &s, const Copy &prev, Copy &c) {
+  for (Inst *i = s.header->insts.head; isa<PhiInst>(i); i = i->next) {
+    c.values.insert({i, prev.get(static_cast<PhiInst *>(i)->incoming_values[s.idx_latch].value)});
+  }
+}
+
+static void retarget(BasicBlock *bb, BasicBlock *from, BasicBlock *to) {
+  for (BasicBlock **succ : bb->succ_ref()) {
+    if (succ && *succ == from) *succ = to;
+  }
+}
+
+// 只有header中的条件跳出循环，且循环变量i每次迭代加常数时，在原来的循环前面放一个展开k次的循环:
+// bb_guard: ; preds = [bb_pre]，n是常数时不需要这个bb，bb_pre直接跳到h0
+//   if (n - (k - 1) * c < n) br h0 else br bb_cond
+// h0: ; preds = [bb_guard, 第k-1份拷贝的latch]
+//   i' = phi [i0, bb_guard] [..]
+//   if (i' < n - (k - 1) * c) br 第0份拷贝的body else br bb_cond
+// 第0份拷贝 -> 第1份拷贝 -> ... -> 第k-1份拷贝 -> h0，各份拷贝的header中不再判断是否跳出
+// bb_cond: ; preds = [bb_guard, bb_latch, h0]，即原来的循环，执行剩下的迭代
+// i < n也可以是<=，反过来写的>, >=，或者c < 0时的>, >=, <, <=
+static bool unroll_counted(IrFunc *f, const LoopShape &s, u32 k) {
+  BasicBlock *header = s.header;
+  auto br = dyn_cast<BranchInst>(header->insts.tail);
+  if (!br || br->right != s.exit) return false;
+  auto cond = dyn_cast<BinaryInst>(br->cond.value);
+  if (!cond || cond->bb != header || cond->tag < Value::Tag::Lt || cond->tag > Value::Tag::Gt ||
+      cond->uses.head != cond->uses.tail) {
+    return false;
+  }
+  u32 iv_pos = !(isa<PhiInst>(cond->lhs.value) && static_cast<Inst *>(cond->lhs.value)->bb == header);
+  auto iv = dyn_cast<PhiInst>((&cond->lhs)[iv_pos].value);
+  Value *n = (&cond->lhs)[!iv_pos].value;
+  if (!iv || iv->bb != header || !s.defined_outside(n)) return false;
+  // 转换成i在左边的写法
+  Value::Tag tag = cond->tag;
+  if (iv_pos == 1) {
+    tag = tag == Value::Tag::Lt   ? Value::Tag::Gt
+          : tag == Value::Tag::Le ? Value::Tag::Ge
+          : tag == Value::Tag::Ge ? Value::Tag::Le
+                                  : Value::Tag::Lt;
+  }
+  auto iv1 = dyn_cast<BinaryInst>(iv->incoming_values[s.idx_latch].value);
+  if (!iv1 || iv1->tag != Value::Tag::Add || iv1->lhs.value != iv) return false;
+  auto step = dyn_cast<ConstValue>(iv1->rhs.value);
+  if (!step || step->imm == 0) return false;
+  bool up = tag == Value::Tag::Lt || tag == Value::Tag::Le;
+  if (up != (step->imm > 0)) return false;
+
+  // 展开的循环执行的条件是i + (k - 1) * c < n，写成i < n - (k - 1) * c避免溢出
+  int64_t delta = int64_t(k - 1) * step->imm;
+  if (delta <= INT32_MIN || delta > INT32_MAX) return false;
+  auto nc = dyn_cast<ConstValue>(n);
+  Value *i0 = iv->incoming_values[!s.idx_latch].value;
+  Value *last = nullptr;
+  if (nc) {
+    int64_t v = nc->imm - delta;
+    if (v < INT32_MIN || v > INT32_MAX) return false;
+    // 循环次数是常数且不到k次时展开的循环一次都不会执行
+    if (auto i0c = dyn_cast<ConstValue>(i0); i0c && !op::eval((op::Op)tag, i0c->imm, (i32)v)) return false;
+    last = ConstValue::get((i32)v);
+  }
+
+  dbg("Unrolling counted multi-block loop");
+  BasicBlock *after = header->prev, *entry = s.preheader;
+  BinaryInst *no_overflow = nullptr;
+  if (!nc) {
+    auto bb_guard = new BasicBlock;
+    f->bb.insertAfter(bb_guard, after);
+    after = bb_guard;
+    bb_guard->pred.push_back(s.preheader);
+    last = new BinaryInst(Value::Tag::Add, n, ConstValue::get((i32)-delta), bb_guard);
+    no_overflow = new BinaryInst(up ? Value::Tag::Lt : Value::Tag::Gt, last, n, bb_guard);
+    entry = bb_guard;
+  }
+  auto h0 = new BasicBlock;
+  f->bb.insertAfter(h0, after);
+  after = h0;
+  h0->pred = {entry, nullptr};  // pred[1]是最后一份拷贝的latch，复制完再填
+
+  std::vector<Copy> copies(k);
+  copies[0].bbs.insert({header, h0});
+  for (Inst *i = header->insts.head; isa<PhiInst>(i); i = i->next) copies[0].values.insert({i, new PhiInst(h0)});
+  clone_loop(f, s, copies[0], after);
+  for (u32 j = 1; j < k; ++j) {
+    map_header_phis(s, copies[j - 1], copies[j]);
+    clone_loop(f, s, copies[j], after);
+    BasicBlock *hj = copies[j].get(header);
+    hj->pred.push_back(copies[j - 1].get(s.latch));
+    retarget(copies[j - 1].get(s.latch), header, hj);
+    // 第1~k-1份拷贝中不用判断是否跳出，cond的拷贝之后由dce删除
+    auto brj = static_cast<BranchInst *>(hj->insts.tail);
+    BasicBlock *body = brj->left;
+    hj->insts.remove(brj);
+    delete brj;
+    new JumpInst(body, hj);
+  }
+  BasicBlock *last_latch = copies[k - 1].get(s.latch);
+  retarget(last_latch, header, h0);
+  h0->pred[1] = last_latch;
+  auto br0 = static_cast<BranchInst *>(h0->insts.tail);
+  br0->right = header;
+  (&static_cast<BinaryInst *>(br0->cond.value)->lhs)[!iv_pos].set(last);
+  for (Inst *i = header->insts.head; isa<PhiInst>(i); i = i->next) {
+    auto x = static_cast<PhiInst *>(i), x0 = static_cast<PhiInst *>(copies[0].get(x));
+    x0->incoming_values[0].set(x->incoming_values[!s.idx_latch].value);
+    x0->incoming_values[1].set(copies[k - 1].get(x->incoming_values[s.idx_latch].value));
+  }
+
+  // 原来的循环从bb_guard或h0进入，n是常数时只从h0进入
+  if (nc) {
+    retarget(s.preheader, header, h0);
+    header->pred[!s.idx_latch] = h0;
+    for (Inst *i = header->insts.head; isa<PhiInst>(i); i = i->next) {
+      auto x = static_cast<PhiInst *>(i);
+      x->incoming_values[!s.idx_latch].set(copies[0].get(x));
+    }
+  } else {
+    retarget(s.preheader, header, entry);
+    header->pred[!s.idx_latch] = entry;
+    header->pred.push_back(h0);
+    for (Inst *i = header->insts.head; isa<PhiInst>(i); i = i->next) {
+      auto x = static_cast<PhiInst *>(i);
+      x->incoming_values.emplace_back(copies[0].get(x), x);
+    }
+    new BranchInst(no_overflow, h0, header, entry);
+  }
+  return true;
+}
+
+// 其他循环把k份拷贝首尾相连，每份都保留原来跳出循环的判断:
+// bb_latch -> 第1份拷贝的header -> ... -> 第k-1份拷贝的latch -> bb_cond
+// 要求循环只有一个出口bb_exit，且它的pred都在循环中，这样每份拷贝跳出时的值可以在bb_exit的phi中合并
+static bool unroll_chained(IrFunc *f, const LoopShape &s, u32 k) {
+  BasicBlock *exit = s.exit;
+  for (BasicBlock *p : exit->pred) {
+    if (!s.in_loop.count(p)) return false;
+  }
+
+  dbg("Unrolling multi-block loop");
+  // 循环中定义，在循环外使用的值先在bb_exit中插入phi，使它们都经过bb_exit的phi
+  for (BasicBlock *bb : s.bbs) {
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      PhiInst *phi = nullptr;
+      for (Use *u = i->uses.head; u;) {
+        Use *next = u->next;
+        Inst *user = u->user;
+        if (!s.in_loop.count(user->bb) && !(isa<PhiInst>(user) && user->bb == exit)) {
+          if (!phi) {
+            phi = new PhiInst(exit);
+            for (Use &v : phi->incoming_values) v.set(i);
+          }
+          u->set(phi);
+        }
+        u = next;
+      }
+    }
+  }
+  std::vector<std::pair<BasicBlock *, u32>> exiting;  // 跳出循环的bb和它在exit->pred中的下标
+  for (u32 j = 0; j < exit->pred.size(); ++j) exiting.emplace_back(exit->pred[j], j);
+
+  std::vector<Copy> copies(k);
+  BasicBlock *after = s.latch;
+  while (s.in_loop.count(after->next)) after = after->next;
+  for (u32 j = 1; j < k; ++j) {
+    map_header_phis(s, copies[j - 1], copies[j]);
+    clone_loop(f, s, copies[j], after);
+    BasicBlock *hj = copies[j].get(s.header), *prev_latch = copies[j - 1].get(s.latch);
+    hj->pred.push_back(prev_latch);
+    // 原来的latch最后再修改，否则之后的拷贝会复制修改后的跳转
+    if (j > 1) retarget(prev_latch, s.header, hj);
+    for (auto [bb, idx] : exiting) {
+      exit->pred.push_back(copies[j].get(bb));
+      for (Inst *i = exit->insts.head; isa<PhiInst>(i); i = i->next) {
+        auto x = static_cast<PhiInst *>(i);
+        x->incoming_values.emplace_back(copies[j].get(x->incoming_values[idx].value), x);
+      }
+    }
+  }
+  retarget(s.latch, s.header, copies[1].get(s.header));
+  s.header->pred[s.idx_latch] = copies[k - 1].get(s.latch);
+  for (Inst *i = s.header->insts.head; isa<PhiInst>(i); i = i->next) {
+    auto x = static_cast<PhiInst *>(i);
+    x->incoming_values[s.idx_latch].set(copies[k - 1].get(x->incoming_values[s.idx_latch].value));
+  }
+  return true;
+}
+
+static bool unroll(IrFunc *f, Loop *l, const std::vector<BasicBlock *> &rpo) {
+  LoopShape s;
+  s.in_loop.insert(l->bbs.begin(), l->bbs.end());
+  s.header = l->header();
+  if (s.header->pred.size() != 2) return false;
+  s.idx_latch = s.in_loop.count(s.header->pred[1]);
+  s.preheader = s.header->pred[!s.idx_latch];
+  s.latch = s.header->pred[s.idx_latch];
+  if (s.in_loop.count(s.preheader) || !s.in_loop.count(s.latch)) return false;
+  for (BasicBlock *bb : rpo) {
+    if (s.in_loop.count(bb)) s.bbs.push_back(bb);
+  }
+
+  s.exit = nullptr;
+  s.header_only_exit = true;
+  bool has_branch = false;
+  u32 size = 0;
+  std::unordered_set<Value *> invariants;
+  for (BasicBlock *bb : s.bbs) {
+    for (BasicBlock *succ : bb->succ()) {
+      if (!succ || s.in_loop.count(succ)) continue;
+      if (s.exit && s.exit != succ) return false;
+      s.exit = succ;
+      if (bb != s.header) s.header_only_exit = false;
+    }
+    if (bb != s.header && isa<BranchInst>(bb->insts.tail)) has_branch = true;
+    for (Inst *i = bb->insts.head; i; i = i->next) {
+      // 包含call的循环没有什么展开的必要，alloca不能复制
+      if (isa<PhiInst>(i) || isa<BranchInst>(i) || isa<JumpInst>(i)) continue;
+      if (!isa<BinaryInst>(i) && !isa<GetElementPtrInst>(i) && !isa<LoadInst>(i) && !isa<StoreInst>(i)) return false;
+      ++size;
+      for (auto [it, end] = i->operands(); it < end; ++it) {
+        if (it->value && !isa<ConstValue>(it->value) && s.defined_outside(it->value)) invariants.insert(it->value);
+      }
+    }
+  }
+  // body中没有跳转的循环由loop_unroll和vectorize_loop处理
+  if (!has_branch || !s.exit) return false;
+
+  u32 live = invariants.size();
+  for (Inst *i = s.header->insts.head; isa<PhiInst>(i); i = i->next) ++live;
+  u32 k = live <= MAX_LIVE_FOR_4 ? 4 : live <= MAX_LIVE_FOR_2 ? 2 : 1;
+  while (k > 1 && k * size > MAX_UNROLLED_SIZE) k /= 2;
+  if (k == 1) return false;
+
+  return (s.header_only_exit && unroll_counted(f, s, k)) || unroll_chained(f, s, k);
+}
+
+// 这个pass不能处理memdep信息，需要保证调用它时没有memdep信息
+void unroll_multi_block_loop(IrFunc *f) {
+  LoopInfo &info = compute_loop_info(f);
+  std::vector<BasicBlock *> rpo = compute_rpo(f);  // 各个最深的循环互不相交，修改一个不影响其他循环的rpo序
+  for (Loop *l : info.deepest_loops()) unroll(f, l, rpo);
+}
@@ -0,0 +1,266 @@
+#include "value_range.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_set>
+
+#include "../../structure/op.hpp"
+#include "cfg.hpp"
+
+namespace {
+
+// 一个phi的范围被扩大这么多次之后就把变化的一侧直接扩大到i32的边界，保证迭代会终止
+constexpr int WIDEN_LIMIT = 2;
+// 扩大到不动点后再利用条件跳转缩小的轮数
+constexpr int NARROW_ROUNDS = 2;
+// 每个bb最多记录这么多个约束，只保留最近的支配者中的，它们一般是最紧的
+constexpr u32 MAX_CONSTRAINTS = 16;
+
+Range make(i64 lo, i64 hi) { return lo < INT32_MIN || hi > INT32_MAX ? FULL_RANGE : Range{(i32) lo, (i32) hi}; }
+
+Range make_bool(bool always, bool never) { return always ? Range{1, 1} : never ? Range{0, 0} : Range{0, 1}; }
+
+Value::Tag negate_cmp(Value::Tag tag) {
+  switch (tag) {
+    case Value::Tag::Lt:
+      return Value::Tag::Ge;
+    case Value::Tag::Le:
+      return Value::Tag::Gt;
+    case Value::Tag::Ge:
+      return Value::Tag::Lt;
+    case Value::Tag::Gt:
+      return Value::Tag::Le;
+    case Value::Tag::Eq:
+      return Value::Tag::Ne;
+    case Value::Tag::Ne:
+      return Value::Tag::Eq;
+    default:
+      UNREACHABLE();
+  }
+}
+
+Value::Tag swap_cmp(Value::Tag tag) {
+  switch (tag) {
+    case Value::Tag::Lt:
+      return Value::Tag::Gt;
+    case Value::Tag::Le:
+      return Value::Tag::Ge;
+    case Value::Tag::Ge:
+      return Value::Tag::Le;
+    case Value::Tag::Gt:
+      return Value::Tag::Lt;
+    default:
+      return tag;
+  }
+}
+
+// cond的值为truth时成立的约束
+void add_cond(std::vector<ValueRange::Constraint> &cons, Value *cond, bool truth) {
+  auto x = dyn_cast<BinaryInst>(cond);
+  if (x && Value::Tag::Lt <= x->tag && x->tag <= Value::Tag::Ne) {
+    Value::Tag tag = truth ? x->tag : negate_cmp(x->tag);
+    if (!isa<ConstValue>(x->lhs.value)) cons.push_back({x->lhs.value, tag, x->rhs.value});
+    if (!isa<ConstValue>(x->rhs.value)) cons.push_back({x->rhs.value, swap_cmp(tag), x->lhs.value});
+  } else if (x && x->tag == (truth ? Value::Tag::And : Value::Tag::Or)) {
+    add_cond(cons, x->lhs.value, truth);
+    add_cond(cons, x->rhs.value, truth);
+  } else if (!isa<ConstValue>(cond)) {
+    cons.push_back({cond, truth ? Value::Tag::Ne : Value::Tag::Eq, ConstValue::get(0)});
+  }
+}
+
+// r中满足`tag bound`的部分，bound在b中
+Range restrict(Range r, Value::Tag tag, Range b) {
+  if (r.empty() || b.empty()) return r;
+  switch (tag) {
+    case Value::Tag::Lt:
+      return b.hi == INT32_MIN ? EMPTY_RANGE : meet(r, {INT32_MIN, b.hi - 1});
+    case Value::Tag::Le:
+      return meet(r, {INT32_MIN, b.hi});
+    case Value::Tag::Gt:
+      return b.lo == INT32_MAX ? EMPTY_RANGE : meet(r, {b.lo + 1, INT32_MAX});
+    case Value::Tag::Ge:
+      return meet(r, {b.lo, INT32_MAX});
+    case Value::Tag::Eq:
+      return meet(r, b);
+    case Value::Tag::Ne:
+      // 只能去掉区间端点上的值
+      if (b.single() && r.lo == b.lo) return r.single() ? EMPTY_RANGE : Range{r.lo + 1, r.hi};
+      if (b.single() && r.hi == b.lo) return Range{r.lo, r.hi - 1};
+      return r;
+    default:
+      UNREACHABLE();
+  }
+}
+
+Range apply(ValueRange &vr, Range r, Value *v, const std::vector<ValueRange::Constraint> &cons) {
+  for (auto &c : cons) {
+    if (c.v == v) r = restrict(r, c.tag, vr.get(c.bound));
+  }
+  return r;
+}
+
+Range visit(ValueRange &vr, const std::unordered_set<BasicBlock *> &reachable, Inst *i) {
+  if (auto x = dyn_cast<BinaryInst>(i)) {
+    return eval_range(x->tag, vr.get(x->lhs.value, x->bb), vr.get(x->rhs.value, x->bb));
+  } else if (auto x = dyn_cast<PhiInst>(i)) {
+    Range res = EMPTY_RANGE;
+    for (u32 k = 0; k < x->incoming_values.size(); ++k) {
+      BasicBlock *pred = x->bb->pred[k];
+      if (reachable.count(pred)) res = join(res, vr.get(x->incoming_values[k].value, pred, x->bb));
+    }
+    return res;
+  } else if (isa<CallInst>(i) && vr.leaf) {
+    return vr.leaf(i);
+  }
+  return FULL_RANGE;
+}
+
+}  // namespace
+
+Range join(Range a, Range b) {
+  if (a.empty()) return b;
+  if (b.empty()) return a;
+  return {std::min(a.lo, b.lo), std::max(a.hi, b.hi)};
+}
+
+Range meet(Range a, Range b) {
+  Range res{std::max(a.lo, b.lo), std::min(a.hi, b.hi)};
+  return res.empty() ? EMPTY_RANGE : res;
+}
+
+Range eval_range(Value::Tag tag, Range l, Range r) {
+  if (l.empty() || r.empty()) return EMPTY_RANGE;
+  if (l.single() && r.single()) {
+    // 不在编译期间执行除0和溢出的除法
+    bool div = tag == Value::Tag::Div || tag == Value::Tag::Mod;
+    if (div && (r.lo == 0 || (l.lo == INT32_MIN && r.lo == -1))) return FULL_RANGE;
+    i32 res = op::eval((op::Op) tag, l.lo, r.lo);
+    return {res, res};
+  }
+  i64 ll = l.lo, lh = l.hi, rl = r.lo, rh = r.hi;
+  auto corners = [&](i64 (*f)(i64, i64)) {
+    i64 a = f(ll, rl), b = f(ll, rh), c = f(lh, rl), d = f(lh, rh);
+    return make(std::min({a, b, c, d}), std::max({a, b, c, d}));
+  };
+  switch (tag) {
+    case Value::Tag::Add:
+      return make(ll + rl, lh + rh);
+    case Value::Tag::Sub:
+      return make(ll - rh, lh - rl);
+    case Value::Tag::Rsb:
+      return make(rl - lh, rh - ll);
+    case Value::Tag::Mul:
+      return corners([](i64 a, i64 b) { return a * b; });
+    case Value::Tag::Div:
+      // 除数不跨过0时商关于两个操作数都是单调的，在i64中计算也避开了INT_MIN / -1
+      if (rl > 0 || rh < 0) return corners([](i64 a, i64 b) { return a / b; });
+      return FULL_RANGE;
+    case Value::Tag::Mod: {
+      if (!(rl > 0 || rh < 0)) return FULL_RANGE;
+      // 余数的符号和被除数相同，绝对值小于除数的绝对值，也不超过被除数的绝对值
+      i64 m = std::max(std::abs(rl), std::abs(rh)) - 1;
+      return make(ll >= 0 ? 0 : std::max(ll, -m), lh <= 0 ? 0 : std::min(lh, m));
+    }
+    case Value::Tag::Lt:
+      return make_bool(lh < rl, ll >= rh);
+    case Value::Tag::Le:
+      return make_bool(lh <= rl, ll > rh);
+    case Value::Tag::Ge:
+      return make_bool(ll >= rh, lh < rl);
+    case Value::Tag::Gt:
+      return make_bool(ll > rh, lh <= rl);
+    case Value::Tag::Eq:
+      return make_bool(l.single() && r == l, lh < rl || rh < ll);
+    case Value::Tag::Ne:
+      return make_bool(lh < rl || rh < ll, l.single() && r == l);
+    case Value::Tag::And:
+    case Value::Tag::Or: {
+      bool l_true = ll > 0 || lh < 0, r_true = rl > 0 || rh < 0;
+      bool l_false = l == Range{0, 0}, r_false = r == Range{0, 0};
+      if (tag == Value::Tag::And) return make_bool(l_true && r_true, l_false || r_false);
+      return make_bool(l_true || r_true, l_false && r_false);
+    }
+    default:
+      UNREACHABLE();
+  }
+}
+
+Range ValueRange::get(Value *v) {
+  if (auto x = dyn_cast<ConstValue>(v)) return {x->imm, x->imm};
+  if (isa<Inst>(v)) {
+    // 不在values中的是不可达的bb中的指令，它们的值不会被用到，但为了安全还是认为它们可以是任何值
+    auto it = values.find(v);
+    return it == values.end() ? FULL_RANGE : it->second;
+  }
+  return leaf ? leaf(v) : FULL_RANGE;
+}
+
+Range ValueRange::get(Value *v, BasicBlock *bb) {
+  Range r = get(v);
+  if (isa<ConstValue>(v)) return r;
+  if (auto it = constraints.find(bb); it != constraints.end()) r = apply(*this, r, v, it->second);
+  return r;
+}
+
+Range ValueRange::get(Value *v, BasicBlock *pred, BasicBlock *bb) {
+  Range r = get(v, pred);
+  if (auto br = dyn_cast<BranchInst>(pred->insts.tail); br && br->left != br->right && !isa<ConstValue>(v)) {
+    std::vector<Constraint> cons;
+    add_cond(cons, br->cond.value, bb == br->left);
+    r = apply(*this, r, v, cons);
+  }
+  return r;
+}
+
+ValueRange compute_value_range(IrFunc *f, std::function<Range(Value *)> leaf) {
+  ValueRange vr;
+  vr.leaf = std::move(leaf);
+  compute_dom_info(f);
+  std::vector<BasicBlock *> &rpo = compute_rpo(f);
+  std::unordered_set<BasicBlock *> reachable(rpo.begin(), rpo.end());
+
+  // bb中成立的约束就是它的idom中成立的约束，加上唯一的前驱跳转到它的条件
+  for (BasicBlock *bb : rpo) {
+    std::vector<ValueRange::Constraint> cons;
+    if (bb->idom) {
+      if (auto it = vr.constraints.find(bb->idom); it != vr.constraints.end()) cons = it->second;
+    }
+    if (bb->pred.size() == 1) {
+      auto br = dyn_cast<BranchInst>(bb->pred[0]->insts.tail);
+      if (br && br->left != br->right) add_cond(cons, br->cond.value, bb == br->left);
+    }
+    if (cons.size() > MAX_CONSTRAINTS) cons.erase(cons.begin(), cons.end() - MAX_CONSTRAINTS);
+    if (!cons.empty()) vr.constraints.emplace(bb, std::move(cons));
+    for (Inst *i = bb->insts.head; i; i = i->next) vr.values.emplace(i, EMPTY_RANGE);
+  }
+
+  // 从空集开始扩大到不动点，phi被扩大多次后直接扩大到边界
+  std::unordered_map<Inst *, int> widen;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (BasicBlock *bb : rpo) {
+      for (Inst *i = bb->insts.head; i; i = i->next) {
+        Range &old = vr.values.find(i)->second;
+        Range res = join(old, visit(vr, reachable, i));
+        if (res == old) continue;
+        if (isa<PhiInst>(i) && !old.empty() && ++widen[i] > WIDEN_LIMIT) {
+          if (res.lo < old.lo) res.lo = INT32_MIN;
+          if (res.hi > old.hi) res.hi = INT32_MAX;
+        }
+        old = res;
+        changed = true;
+      }
+    }
+  }
+  // 此时每个值的范围都包含了它真正的范围，再计算几轮并与原来的范围取交集，例如在`i < n`的循环中i + 1 <= n.hi
+  for (int round = 0; round < NARROW_ROUNDS; ++round) {
+    for (BasicBlock *bb : rpo) {
+      for (Inst *i = bb->insts.head; i; i = i->next) {
+        Range &old = vr.values.find(i)->second;
+        old = meet(old, visit(vr, reachable, i));
+      }
+    }
+  }
+  return vr;
+}
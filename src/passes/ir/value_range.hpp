@@ -0,0 +1,55 @@
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "../../structure/ir.hpp"
+
+// 一个i32值所有可能的取值[lo, hi]，lo > hi表示空集，即还没有任何信息(如还没有计算过的值，不会执行的指令)
+struct Range {
+  i32 lo, hi;
+
+  bool empty() const { return lo > hi; }
+  bool single() const { return lo == hi; }
+  bool non_negative() const { return !empty() && lo >= 0; }
+  bool operator==(const Range &rhs) const { return lo == rhs.lo && hi == rhs.hi; }
+  bool operator!=(const Range &rhs) const { return !(*this == rhs); }
+};
+
+constexpr Range EMPTY_RANGE{1, 0}, FULL_RANGE{INT32_MIN, INT32_MAX};
+
+// 并集的凸包
+Range join(Range a, Range b);
+
+// 交集
+Range meet(Range a, Range b);
+
+// BinaryInst的两个操作数分别在l和r中时，结果的范围，算不出来时返回FULL_RANGE
+Range eval_range(Value::Tag tag, Range l, Range r);
+
+// 函数中每个值的范围。一个值在不同的bb中使用时范围可能不同：支配这个bb的条件跳转的条件成立或不成立，例如
+// `if (i < n)`的true分支中i <= n.hi - 1，所以除了每个值本身的范围外还记录了每个bb中由条件跳转得到的约束
+struct ValueRange {
+  // v在bb中满足v tag bound
+  struct Constraint {
+    Value *v;
+    Value::Tag tag;
+    Value *bound;
+  };
+
+  std::unordered_map<Value *, Range> values;
+  std::unordered_map<BasicBlock *, std::vector<Constraint>> constraints;
+  std::function<Range(Value *)> leaf;
+
+  // v本身的范围，不考虑使用它的位置
+  Range get(Value *v);
+  // v在bb中使用时的范围
+  Range get(Value *v, BasicBlock *bb);
+  // v作为bb的phi中来自pred的值时的范围，除了pred中的约束外，还考虑了pred跳转到bb的条件
+  Range get(Value *v, BasicBlock *pred, BasicBlock *bb);
+};
+
+// 对函数中的值做区间分析，循环中的phi先扩大到i32的边界，再利用循环条件缩小，所以能得到归纳变量的范围
+// leaf给出参数和函数调用结果的范围，为空时它们都是FULL_RANGE。结果只在f被修改之前有效
+ValueRange compute_value_range(IrFunc *f, std::function<Range(Value *)> leaf = nullptr);
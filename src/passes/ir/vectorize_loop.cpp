@@ -0,0 +1,277 @@
+// Loop vectorization pass.
+//
+// Runs four iterations of a simple counted loop at once on NEON registers, each
+// holding <4 x i32>.  Example: `while (i < n) { a[i] = b[i] + c[i] * k; i = i + 1; }`
+// gets a vector loop in front of it that handles i..i+3 per iteration; the
+// original loop stays as the epilogue for the remaining 0~3 iterations.
+// Add/sub/mul reductions such as `s = s + a[i] * b[i]` keep four partial results
+// in the lanes of a vector, which are combined after the vector loop.
+#include "vectorize_loop.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "cfg.hpp"
+#include "memdep.hpp"
+
+// 常数的循环次数小于这个值时不值得向量化
+static constexpr int64_t MIN_TRIP_COUNT = 8;
+
+namespace {
+
+// s = phi [s0, bb_pre] [s1, bb_body]，其中s1 = s op x
+struct Reduction {
+  PhiInst *phi;
+  BinaryInst *inst;  // s1
+  // 合并各个lane以及s0用的运算，Sub的各个lane是s0之外减去的部分，所以也用Add合并
+  Value::Tag combine;
+};
+
+// vs的初值，每个lane都是运算的单位元
+ConstValue *identity(const Reduction &r) { return ConstValue::get(r.combine == Value::Tag::Mul ? 1 : 0); }
+
+}  // namespace
+
+static bool vectorize(IrFunc *f, Loop *l) {
+  // 只考虑这样的循环，前端生成的while循环如果body内没有跳转，经过gvn_gcm后就是这样
+  // bb_cond: ; preds = [bb_pre, bb_body]
+  //   i = phi [i0, bb_pre] [i1, bb_body]
+  //   s = phi [s0, bb_pre] [s1, bb_body] ; 可以有任意个这样的归约变量，也可以没有
+  //   if (i < n) br bb_body else br bb_end
+  // bb_body: ; preds = [bb_cond]
+  //   ... 下标都是i的Load/Store，以及它们之间的Add/Sub/Mul
+  //   s1 = s + x ; 或者s - x, s * x，x是上面计算出的值
+  //   i1 = i + 1
+  //   br bb_cond
+  // 其中n, i0和数组地址都在循环外定值，大小关系也可以是<=，或者反过来写的>, >=
+  // 变换后:
+  // bb_guard: ; preds = [bb_pre]
+  //   循环不变量和归约初值(0或1)的VectorDup
+  //   if (n - 3 < n && i0 < n - 3) br bb_vec else br bb_cond
+  // bb_vec: ; preds = [bb_guard, bb_vec]
+  //   vi = phi [i0, bb_guard] [vi1, bb_vec]
+  //   vs = phi [dup(0), bb_guard] [vs1, bb_vec]
+  //   ... 下标是vi的VectorLoad/VectorStore，以及VectorBinary
+  //   vs1 = vs + vx
+  //   vi1 = vi + 4
+  //   if (vi1 < n - 3) br bb_vec else br bb_vec_end
+  // bb_vec_end: ; preds = [bb_vec]，没有归约变量时不需要这个bb，bb_vec直接跳到bb_cond
+  //   s2 = s0 + reduce_add(vs1)
+  //   br bb_cond
+  // bb_cond: ; preds = [bb_guard, bb_body, bb_vec_end]
+  //   i = phi [i0, bb_guard] [i1, bb_body] [vi1, bb_vec_end]
+  //   s = phi [s0, bb_guard] [s1, bb_body] [s2, bb_vec_end]
+  //   ...
+  if (l->bbs.size() != 2) return false;
+  BasicBlock *header = l->bbs[0], *body = l->bbs[1];
+  if (header->pred.size() != 2 || body->pred.size() != 1) return false;
+  auto jump = dyn_cast<JumpInst>(body->insts.tail);
+  auto br = dyn_cast<BranchInst>(header->insts.tail);
+  if (!jump || jump->next != header || !br || br->left != body) return false;
+  u32 idx_in_header = header->pred[1] == body;
+  BasicBlock *preheader = header->pred[!idx_in_header];
+
+  auto cond = dyn_cast<BinaryInst>(br->cond.value);
+  if (!cond || cond->bb != header || cond->next != br || cond->uses.head != cond->uses.tail) return false;
+  auto defined_outside = [header, body](Value *v) {
+    auto i = dyn_cast<Inst>(v);
+    return !i || (i->bb != header && i->bb != body);
+  };
+  Value::Tag tag = cond->tag;
+  Value *iv_value, *n;
+  if (tag == Value::Tag::Lt || tag == Value::Tag::Le) {
+    iv_value = cond->lhs.value;
+    n = cond->rhs.value;
+  } else if (tag == Value::Tag::Gt || tag == Value::Tag::Ge) {
+    iv_value = cond->rhs.value;
+    n = cond->lhs.value;
+    tag = tag == Value::Tag::Gt ? Value::Tag::Lt : Value::Tag::Le;
+  } else {
+    return false;
+  }
+  auto iv = dyn_cast<PhiInst>(iv_value);
+  if (!iv || iv->bb != header || !defined_outside(n)) return false;
+
+  Value *i0 = iv->incoming_values[!idx_in_header].value;
+  auto iv1 = dyn_cast<BinaryInst>(iv->incoming_values[idx_in_header].value);
+  if (!iv1 || iv1->bb != body || iv1->tag != Value::Tag::Add || iv1->lhs.value != iv) return false;
+  if (auto step = dyn_cast<ConstValue>(iv1->rhs.value); !step || step->imm != 1) return false;
+  for (Use *u = iv1->uses.head; u; u = u->next) {
+    if (u->user->bb == body) return false;
+  }
+  // n - 3不能溢出，n是常数时在这里检查，否则在bb_guard中检查
+  auto nc = dyn_cast<ConstValue>(n);
+  if (nc && (int64_t)nc->imm - 3 < INT32_MIN) return false;
+  if (auto i0c = dyn_cast<ConstValue>(i0);
+      i0c && nc && (int64_t)nc->imm - i0c->imm + (tag == Value::Tag::Le) < MIN_TRIP_COUNT) {
+    return false;
+  }
+
+  // i在循环中只能作为Load/Store的下标，或者用来计算i1
+  for (Use *u = iv->uses.head; u; u = u->next) {
+    Inst *user = u->user;
+    if (user == cond || user == iv1 || user->bb != body) continue;
+    auto x = dyn_cast<AccessInst>(user);
+    if (!x || isa<GetElementPtrInst>(x) || u != &x->index) return false;
+  }
+
+  // header中除了i以外的phi都必须是归约变量，s在循环中只被s1使用，s1只被s使用
+  std::vector<Reduction> reductions;
+  for (Inst *i = header->insts.head; i != cond; i = i->next) {
+    auto phi = dyn_cast<PhiInst>(i);
+    if (!phi) return false;
+    if (phi == iv) continue;
+    auto x = dyn_cast<BinaryInst>(phi->incoming_values[idx_in_header].value);
+    if (!x || x->bb != body) return false;
+    if (x->tag == Value::Tag::Add || x->tag == Value::Tag::Mul) {
+      if (x->lhs.value != phi && x->rhs.value != phi) return false;
+    } else if (x->tag != Value::Tag::Sub || x->lhs.value != phi) {
+      return false;
+    }
+    for (Use *u = phi->uses.head; u; u = u->next) {
+      if (u->user != x && !defined_outside(u->user)) return false;
+    }
+    for (Use *u = x->uses.head; u; u = u->next) {
+      if (u->user != phi) return false;
+    }
+    reductions.push_back({phi, x, x->tag == Value::Tag::Mul ? Value::Tag::Mul : Value::Tag::Add});
+  }
+  auto find_reduction = [&reductions](Value *v) {
+    return std::find_if(reductions.begin(), reductions.end(), [v](const Reduction &r) { return r.inst == v; });
+  };
+
+  std::vector<Inst *> insts;        // 需要向量化的指令，保持原来的顺序
+  std::vector<Value *> invariants;  // 用到的循环不变量，每个需要一条VectorDup
+  std::vector<AccessInst *> accesses;
+  std::vector<StoreInst *> stores;
+  u32 num_vectors = 0;
+  auto is_vector = [&](Value *v) {
+    auto i = dyn_cast<Inst>(v);
+    return i && i->bb == body && i != iv1 && find_reduction(i) == reductions.end();
+  };
+  // 操作数要么是已经向量化的值，要么是循环不变量
+  auto check_operand = [&](Value *v) {
+    if (is_vector(v)) return true;
+    if (!defined_outside(v)) return false;
+    if (std::find(invariants.begin(), invariants.end(), v) == invariants.end()) invariants.push_back(v);
+    return true;
+  };
+  for (Inst *i = body->insts.head; i != jump; i = i->next) {
+    if (i == iv1) continue;
+    if (auto r = find_reduction(i); r != reductions.end()) {
+      Value *x = r->inst->lhs.value == r->phi ? r->inst->rhs.value : r->inst->lhs.value;
+      if (!is_vector(x)) return false;
+      check_operand(identity(*r));
+      num_vectors += 2;  // vs和vs1
+      insts.push_back(i);
+      continue;
+    }
+    if (auto x = dyn_cast<LoadInst>(i)) {
+      if (x->index.value != iv || !defined_outside(x->arr.value)) return false;
+      accesses.push_back(x);
+      ++num_vectors;
+    } else if (auto x = dyn_cast<StoreInst>(i)) {
+      if (x->index.value != iv || !defined_outside(x->arr.value) || !check_operand(x->data.value)) return false;
+      accesses.push_back(x);
+      stores.push_back(x);
+    } else if (auto x = dyn_cast<BinaryInst>(i);
+               x && (x->tag == Value::Tag::Add || x->tag == Value::Tag::Sub || x->tag == Value::Tag::Mul)) {
+      if (!is_vector(x->lhs.value) && !is_vector(x->rhs.value)) return false;
+      if (!check_operand(x->lhs.value) || !check_operand(x->rhs.value)) return false;
+      ++num_vectors;
+    } else {
+      return false;
+    }
+    // 向量化后循环中的标量值就不存在了，所以它们不能在循环外被使用
+    for (Use *u = i->uses.head; u; u = u->next) {
+      if (u->user->bb != body) return false;
+    }
+    insts.push_back(i);
+  }
+  // 不溢出到栈上，所以最坏情况下所有向量同时存活也要放得下
+  if (stores.empty() && reductions.empty()) return false;
+  if (num_vectors + invariants.size() > NUM_VECTOR_REGS) return false;
+  // 不同迭代之间不能有内存依赖：下标都是i，所以同一个数组地址的访问只在同一个迭代内相关
+  for (StoreInst *s : stores) {
+    for (AccessInst *x : accesses) {
+      if (x->arr.value != s->arr.value && alias(s->lhs_sym, x->lhs_sym)) return false;
+    }
+  }
+
+  dbg("Vectorizing loop");
+  auto bb_guard = new BasicBlock, bb_vec = new BasicBlock;
+  f->bb.insertBefore(bb_guard, header);
+  f->bb.insertBefore(bb_vec, header);
+  for (BasicBlock **succ : preheader->succ_ref()) {
+    if (succ && *succ == header) *succ = bb_guard;
+  }
+  bb_guard->pred.push_back(preheader);
+  bb_vec->pred = {bb_guard, bb_vec};
+  BasicBlock *bb_vec_end = bb_vec;
+  if (!reductions.empty()) {
+    bb_vec_end = new BasicBlock;
+    f->bb.insertBefore(bb_vec_end, header);
+    bb_vec_end->pred.push_back(bb_vec);
+  }
+
+  std::unordered_map<Value *, Value *> vectors;  // 循环中的标量值或循环不变量 -> 对应的向量
+  for (Value *v : invariants) vectors.insert({v, new VectorDupInst(v, bb_guard)});
+  Value *last;  // 向量循环执行的条件是i + 3 < n，写成i < n - 3避免i + 3溢出
+  BinaryInst *no_overflow = nullptr;
+  if (nc) {
+    last = ConstValue::get(nc->imm - 3);
+  } else {
+    last = new BinaryInst(Value::Tag::Add, n, ConstValue::get(-3), bb_guard);
+    no_overflow = new BinaryInst(Value::Tag::Lt, last, n, bb_guard);
+  }
+  // i0和n都是常数时上面已经检查过循环次数足够，codegen不接受两个操作数都是常数的BinaryInst
+  Value *enter = ConstValue::get(1);
+  if (!isa<ConstValue>(i0) || !nc) enter = new BinaryInst(tag, i0, last, bb_guard);
+  // codegen会把紧接着branch的and翻译成两个条件跳转
+  if (no_overflow) enter = new BinaryInst(Value::Tag::And, no_overflow, enter, bb_guard);
+  new BranchInst(enter, bb_vec, header, bb_guard);
+
+  auto viv = new PhiInst(bb_vec);
+  for (Reduction &r : reductions) vectors.insert({r.phi, new PhiInst(bb_vec)});
+  for (Inst *i : insts) {
+    auto get = [&vectors](const Use &u) { return vectors.find(u.value)->second; };
+    Inst *res;
+    if (auto x = dyn_cast<LoadInst>(i)) {
+      res = new VectorLoadInst(x->lhs_sym, x->arr.value, viv, bb_vec);
+    } else if (auto x = dyn_cast<StoreInst>(i)) {
+      res = new VectorStoreInst(x->lhs_sym, x->arr.value, get(x->data), viv, bb_vec);
+    } else {
+      auto y = static_cast<BinaryInst *>(i);
+      res = new VectorBinaryInst(y->tag, get(y->lhs), get(y->rhs), bb_vec);
+    }
+    vectors.insert({i, res});
+  }
+  auto viv1 = new BinaryInst(Value::Tag::Add, viv, ConstValue::get(4), bb_vec);
+  new BranchInst(new BinaryInst(tag, viv1, last, bb_vec), bb_vec, bb_vec_end == bb_vec ? header : bb_vec_end, bb_vec);
+  viv->incoming_values[0].set(i0);
+  viv->incoming_values[1].set(viv1);
+
+  // 原来的循环从bb_guard或bb_vec_end进入，i的初值分别是i0和vi1，s的初值分别是s0和s2
+  header->pred[!idx_in_header] = bb_guard;
+  header->pred.push_back(bb_vec_end);
+  iv->incoming_values.emplace_back(viv1, iv);
+  for (Reduction &r : reductions) {
+    auto vs = static_cast<PhiInst *>(vectors.find(r.phi)->second);
+    Value *vs1 = vectors.find(r.inst)->second;
+    vs->incoming_values[0].set(vectors.find(identity(r))->second);
+    vs->incoming_values[1].set(vs1);
+    Value *s0 = r.phi->incoming_values[!idx_in_header].value;
+    Value *s2 = new VectorReduceInst(r.combine, vs1, bb_vec_end);
+    if (s0 != identity(r)) s2 = new BinaryInst(r.combine, s0, s2, bb_vec_end);
+    r.phi->incoming_values.emplace_back(s2, r.phi);
+  }
+  if (bb_vec_end != bb_vec) new JumpInst(header, bb_vec_end);
+  return true;
+}
+
+void vectorize_loop(IrFunc *f) {
+  std::vector<Loop *> deepest = compute_loop_info(f).deepest_loops();
+  for (Loop *l : deepest) vectorize(f, l);
+}
@@ -1,12 +1,17 @@
 #include "pass_manager.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <utility>
 #include <variant>
+#include <vector>
 
+#include "../thread_pool.hpp"
 #include "asm/allocate_register.hpp"
+#include "asm/allocate_vector_register.hpp"
 #include "asm/compute_stack_info.hpp"
 #include "asm/if_to_cond.hpp"
+#include "asm/modulo_schedule.hpp"
 #include "asm/scheduling.hpp"
 #include "asm/simplify_asm.hpp"
 #include "ir/bbopt.hpp"
@@ -21,70 +26,172 @@
 #include "ir/loop_unroll.hpp"
 #include "ir/mark_global_const.hpp"
 #include "ir/mem2reg.hpp"
+#include "ir/memoize_pure_function.hpp"
+#include "ir/optimize_loop_nest.hpp"
+#include "ir/partial_redundancy_elim.hpp"
 #include "ir/promote_const_local_array.hpp"
 #include "ir/promote_loop_store.hpp"
+#include "ir/propagate_interprocedural_range.hpp"
 #include "ir/remove_dead_local_init.hpp"
 #include "ir/remove_identical_branch.hpp"
 #include "ir/remove_unused_function.hpp"
+#include "ir/sccp.hpp"
 #include "ir/sink_local_init.hpp"
 #include "ir/specialize_const_arg.hpp"
 #include "ir/strength_reduce_loop_access.hpp"
+#include "ir/tail_recursion_to_loop.hpp"
 #include "ir/tighten_guarded_loop_bound.hpp"
+#include "ir/unroll_multi_block_loop.hpp"
+#include "ir/vectorize_loop.hpp"
 #include "ir/zero_loop_to_memset.hpp"
+#include "time_report.hpp"
 
 using IrFuncPass = void (*)(IrFunc *);
 using IrProgramPass = void (*)(IrProgram *);
 using MachineFuncPass = void (*)(MachineFunc *);
 using MachineProgramPass = void (*)(MachineProgram *);
 using CompilePass = std::variant<IrFuncPass, IrProgramPass, MachineFuncPass, MachineProgramPass>;
-using PassDesc = std::pair<CompilePass, const char *>;
+
+// required: 运行前需要保证有效的程序级分析，目前只有AnalysisCallGraph。函数级的分析由pass自己通过cfg.hpp中的函数获取
+// preserved: 运行后仍然有效的分析，其余的分析在运行后失效。asm pass不使用它们
+struct PassDesc {
+  CompilePass pass;
+  const char *name;
+  u32 required = 0;
+  u32 preserved = 0;
+};
 
 #define DEFINE_PASS(p) \
   { p, #p }
 
-static PassDesc ir_passes[] = {
-    DEFINE_PASS(compute_callgraph),
-    DEFINE_PASS(mark_global_const),
-    DEFINE_PASS(mem2reg),
-    DEFINE_PASS(gvn_gcm),
-    DEFINE_PASS(compute_callgraph),
-    DEFINE_PASS(gvn_gcm),
-
-    DEFINE_PASS(loop_unroll),
-    DEFINE_PASS(gvn_gcm),
-    DEFINE_PASS(dead_store_elim),
-
-    DEFINE_PASS(loop_unroll),
-    DEFINE_PASS(gvn_gcm),
-    DEFINE_PASS(dead_store_elim),
-
-    DEFINE_PASS(extract_stack_array),
-    DEFINE_PASS(sink_local_init),
-    DEFINE_PASS(inline_func),
-    DEFINE_PASS(specialize_const_arg),
-    DEFINE_PASS(fold_counted_div_loop),
-    DEFINE_PASS(zero_loop_to_memset),
-    DEFINE_PASS(remove_dead_local_init),
-    DEFINE_PASS(promote_const_local_array),
-    DEFINE_PASS(inline_func),
-    DEFINE_PASS(promote_loop_store),
-    DEFINE_PASS(compute_callgraph),
-    DEFINE_PASS(gvn_gcm),
-    DEFINE_PASS(tighten_guarded_loop_bound),
-    DEFINE_PASS(strength_reduce_loop_access),
-    DEFINE_PASS(gvn_gcm),
-    DEFINE_PASS(loop_unroll),
-    DEFINE_PASS(gvn_gcm),
-    DEFINE_PASS(dead_store_elim),
-    DEFINE_PASS(compute_callgraph),
-    DEFINE_PASS(dce),
-    DEFINE_PASS(compute_callgraph),
-    DEFINE_PASS(remove_unused_function),
+// 每个IR pass只在这里声明一次它需要和保持的分析，见enum Analysis
+#define DEFINE_IR_PASS(p, required, preserved) static const PassDesc p##_pass{p, #p, required, preserved}
+
+DEFINE_IR_PASS(compute_callgraph, 0, AnalysisCfg | AnalysisCallGraph);
+DEFINE_IR_PASS(mark_global_const, AnalysisCallGraph, AnalysisCfg | AnalysisCallGraph);
+DEFINE_IR_PASS(mem2reg, 0, AnalysisCfg);
+DEFINE_IR_PASS(tail_recursion_to_loop, 0, 0);
+DEFINE_IR_PASS(gvn_gcm, AnalysisCallGraph, AnalysisCfg);
+DEFINE_IR_PASS(gvn_gcm_with_range, AnalysisCallGraph, AnalysisCfg);
+DEFINE_IR_PASS(dead_store_elim, AnalysisCallGraph, AnalysisCfg);
+DEFINE_IR_PASS(dce, AnalysisCallGraph, AnalysisCfg);
+DEFINE_IR_PASS(loop_unroll, 0, 0);
+DEFINE_IR_PASS(extract_stack_array, 0, AnalysisCfg);
+DEFINE_IR_PASS(sink_local_init, 0, 0);
+DEFINE_IR_PASS(inline_func, 0, 0);
+DEFINE_IR_PASS(specialize_const_arg, AnalysisCallGraph, 0);
+DEFINE_IR_PASS(propagate_interprocedural_range, AnalysisCallGraph, AnalysisCfg);
+DEFINE_IR_PASS(sccp, 0, 0);
+DEFINE_IR_PASS(fold_counted_div_loop, 0, 0);
+DEFINE_IR_PASS(zero_loop_to_memset, 0, 0);
+DEFINE_IR_PASS(remove_dead_local_init, AnalysisCallGraph, 0);
+DEFINE_IR_PASS(promote_const_local_array, AnalysisCallGraph, 0);
+DEFINE_IR_PASS(promote_loop_store, AnalysisCallGraph, 0);
+DEFINE_IR_PASS(partial_redundancy_elim, AnalysisCallGraph, AnalysisCfg);
+DEFINE_IR_PASS(tighten_guarded_loop_bound, 0, 0);
+DEFINE_IR_PASS(optimize_loop_nest, 0, 0);
+DEFINE_IR_PASS(strength_reduce_loop_access, 0, 0);
+DEFINE_IR_PASS(unroll_multi_block_loop, 0, 0);
+DEFINE_IR_PASS(vectorize_loop, 0, 0);
+DEFINE_IR_PASS(memoize_pure_function, AnalysisCallGraph, 0);
+DEFINE_IR_PASS(remove_unused_function, AnalysisCallGraph, AnalysisCfg);
+
+#undef DEFINE_IR_PASS
+
+// -O2的IR pass，也是-O3的基础
+// gvn_gcm_with_range只用在第一次gvn_gcm和改变循环结构的pass之后，在其他位置它折叠不出新的比较，区间分析却占了gvn_gcm约1/4的时间
+static const std::vector<PassDesc> o2_ir_passes = {
+    mark_global_const_pass,
+    mem2reg_pass,
+    gvn_gcm_with_range_pass,
+    tail_recursion_to_loop_pass,
+    gvn_gcm_pass,
+
+    loop_unroll_pass,
+    gvn_gcm_pass,
+    dead_store_elim_pass,
+
+    loop_unroll_pass,
+    gvn_gcm_pass,
+    dead_store_elim_pass,
+
+    extract_stack_array_pass,
+    sink_local_init_pass,
+    inline_func_pass,
+    specialize_const_arg_pass,
+    propagate_interprocedural_range_pass,
+    sccp_pass,
+    fold_counted_div_loop_pass,
+    zero_loop_to_memset_pass,
+    remove_dead_local_init_pass,
+    promote_const_local_array_pass,
+    inline_func_pass,
+    sccp_pass,
+    promote_loop_store_pass,
+    partial_redundancy_elim_pass,
+    gvn_gcm_pass,
+    tighten_guarded_loop_bound_pass,
+    optimize_loop_nest_pass,
+    strength_reduce_loop_access_pass,
+    gvn_gcm_with_range_pass,
+    loop_unroll_pass,
+    unroll_multi_block_loop_pass,
+    gvn_gcm_with_range_pass,
+    dead_store_elim_pass,
+    dce_pass,
+    vectorize_loop_pass,
+    remove_unused_function_pass,
+};
+
+// passes中after之后插入pass
+static std::vector<PassDesc> insert_after(std::vector<PassDesc> passes, const PassDesc &after, const PassDesc &pass) {
+  auto it = std::find_if(passes.begin(), passes.end(), [&](const PassDesc &desc) { return desc.name == after.name; });
+  passes.insert(it + 1, pass);
+  return passes;
+}
+
+// ir_passes[level]和asm_passes[level]是-O<level>使用的pass，level大于3时与3相同
+// -O0只做正确生成代码所必需的事情，-O1做一轮gvn_gcm，不展开循环也不内联，-O2是完整的优化
+// -O3在-O2的基础上对纯的递归函数做记忆化，它用额外的全局数组换时间，所以只在明确要求时使用
+// call graph不需要列出，pass manager会在需要它的pass之前按需计算
+static std::vector<PassDesc> ir_passes[] = {
+    {
+        mem2reg_pass,
+    },
+    {
+        mark_global_const_pass,
+        mem2reg_pass,
+        gvn_gcm_with_range_pass,
+        dead_store_elim_pass,
+        dce_pass,
+        remove_unused_function_pass,
+    },
+    o2_ir_passes,
+    insert_after(o2_ir_passes, unroll_multi_block_loop_pass, memoize_pure_function_pass),
+};
+
+static const std::vector<PassDesc> o2_asm_passes = {
+    DEFINE_PASS(modulo_schedule),      DEFINE_PASS(pre_ra_schedule), DEFINE_PASS(allocate_vector_register),
+    DEFINE_PASS(allocate_register),    DEFINE_PASS(simplify_asm),    DEFINE_PASS(compute_stack_info),
+    DEFINE_PASS(instruction_schedule), DEFINE_PASS(simplify_asm),    DEFINE_PASS(if_to_cond),
+};
+
+static std::vector<PassDesc> asm_passes[] = {
+    {DEFINE_PASS(allocate_register_linear), DEFINE_PASS(compute_stack_info)},
+    {DEFINE_PASS(allocate_register_linear), DEFINE_PASS(simplify_asm), DEFINE_PASS(compute_stack_info),
+     DEFINE_PASS(simplify_asm), DEFINE_PASS(if_to_cond)},
+    o2_asm_passes,
+    o2_asm_passes,
 };
 
-static PassDesc asm_passes[] = {DEFINE_PASS(allocate_register), DEFINE_PASS(simplify_asm),
-                                DEFINE_PASS(compute_stack_info), DEFINE_PASS(instruction_schedule),
-                                DEFINE_PASS(simplify_asm), DEFINE_PASS(if_to_cond)};
+bool use_linear_scan = false;
+
+// -L时-O2及以上也用allocate_register_linear代替allocate_register
+static const PassDesc &asm_pass(const PassDesc &desc) {
+  static const PassDesc linear = DEFINE_PASS(allocate_register_linear);
+  auto pass = std::get_if<MachineFuncPass>(&desc.pass);
+  return use_linear_scan && pass && *pass == allocate_register ? linear : desc;
+}
 
 #undef DEFINE_PASS
 
@@ -95,51 +202,129 @@ struct overloaded : Ts... {
 template <class... Ts>
 overloaded(Ts...)->overloaded<Ts...>;
 
+// 所有非builtin的函数，指令多的在前，这样并行时最慢的函数最先开始，不会最后剩下一个大函数在跑
+// 同样大小的保持原来的顺序。IrFuncPass只修改自己的函数，所以执行的顺序不影响结果
+static std::vector<IrFunc *> ir_funcs(IrProgram *p) {
+  std::vector<std::pair<IrFunc *, u32>> sized;
+  for (auto *f = p->func.head; f != nullptr; f = f->next) {
+    if (f->builtin) continue;
+    u32 size = 0;
+    for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+      for (Inst *i = bb->insts.head; i; i = i->next) ++size;
+    }
+    sized.emplace_back(f, size);
+  }
+  std::stable_sort(sized.begin(), sized.end(), [](auto &l, auto &r) { return l.second > r.second; });
+  std::vector<IrFunc *> ret;
+  ret.reserve(sized.size());
+  for (auto &[f, _] : sized) ret.push_back(f);
+  return ret;
+}
+
+// 连续的IrFuncPass之间不需要等所有函数都完成：每个函数独立地依次运行[first, last)中的所有pass
+// 只有遇到IrProgramPass时才需要等待所有函数
+static void run_ir_func_passes(IrProgram *p, const PassDesc *first, const PassDesc *last) {
+  auto run_passes = std::string("Running passes");
+  for (auto *desc = first; desc != last; ++desc) {
+    run_passes += std::string(" ") + desc->name;
+    p->valid_analyses &= desc->preserved;
+  }
+  dbg(run_passes);
+  auto funcs = ir_funcs(p);
+  parallel_for(funcs.size(), [&](u32 i) {
+    ArenaScope scope(&funcs[i]->arena);
+    for (auto *desc = first; desc != last; ++desc) {
+      std::get<IrFuncPass>(desc->pass)(funcs[i]);
+      funcs[i]->invalidate_analyses(desc->preserved);
+    }
+  });
+}
+
 static inline void run_pass(IntermediateProgram p, const PassDesc &desc) {
-  auto &pass = std::get<0>(desc);
-  auto run_pass = std::string("Running pass ") + std::get<1>(desc);
+  auto &pass = desc.pass;
+  auto run_pass = std::string("Running pass ") + desc.name;
   dbg(run_pass);
+  auto size = [&p]() { return std::visit([](auto p) { return program_size(p); }, p); };
+  if (time_report.enabled) {
+    time_report.begin(desc.name, std::holds_alternative<IrProgram *>(p) ? "ir" : "asm", size());
+  }
   std::visit(overloaded{[&](IrProgram *p) {
                           std::visit(overloaded{[&](IrFuncPass pass) {
+                                                  auto funcs = ir_funcs(p);
+                                                  parallel_for(funcs.size(), [&](u32 i) {
+                                                    ArenaScope scope(&funcs[i]->arena);
+                                                    pass(funcs[i]);
+                                                    funcs[i]->invalidate_analyses(desc.preserved);
+                                                  });
+                                                },
+                                                [&](IrProgramPass pass) {
+                                                  ArenaScope scope(&p->arena);
+                                                  pass(p);
                                                   for (auto *f = p->func.head; f != nullptr; f = f->next) {
-                                                    if (!f->builtin) pass(f);
+                                                    f->invalidate_analyses(desc.preserved);
                                                   }
                                                 },
-                                                [&](IrProgramPass pass) { pass(p); }, [](auto arg) { UNREACHABLE(); }},
+                                                [](auto arg) { UNREACHABLE(); }},
                                      pass);
+                          p->valid_analyses &= desc.preserved;
                         },
                         [&](MachineProgram *p) {
                           std::visit(
                               overloaded{[&](MachineFuncPass pass) {
+                                           // 函数之间互不影响，用-j指定的线程数并行处理
+                                           std::vector<MachineFunc *> funcs;
                                            for (auto *f = p->func.head; f != nullptr; f = f->next) {
-                                             pass(f);
+                                             funcs.push_back(f);
                                            }
+                                           parallel_for(funcs.size(), [&](u32 i) { pass(funcs[i]); });
                                          },
                                          [&](MachineProgramPass pass) { pass(p); }, [](auto arg) { UNREACHABLE(); }},
                               pass);
                         }},
              p);
+  if (time_report.enabled) time_report.end(size());
+}
+
+static u32 clamp_level(u32 opt_level) {
+  constexpr u32 max_level = std::size(ir_passes) - 1;
+  return std::min(opt_level, max_level);
 }
 
-void run_passes(IntermediateProgram p, bool opt) {
+void run_passes(IntermediateProgram p, u32 opt_level) {
+  opt_level = clamp_level(opt_level);
   if (std::get_if<MachineProgram *>(&p)) {
-    for (auto &desc : asm_passes) {
-      run_pass(p, desc);
+    for (auto &desc : asm_passes[opt_level]) {
+      run_pass(p, asm_pass(desc));
     }
-  } else if (std::get_if<IrProgram *>(&p)) {
-    for (auto &desc : ir_passes) {
-      run_pass(p, desc);
+  } else if (auto ir = std::get_if<IrProgram *>(&p)) {
+    auto &passes = ir_passes[opt_level];
+    for (u32 i = 0; i < passes.size();) {
+      if ((passes[i].required & AnalysisCallGraph) && !((*ir)->valid_analyses & AnalysisCallGraph)) {
+        run_pass(p, compute_callgraph_pass);
+      }
+      auto is_func_pass = [&](u32 j) { return std::holds_alternative<IrFuncPass>(passes[j].pass); };
+      // -T需要分别统计每个pass的时间，这时每个pass单独运行，结果是一样的
+      if (num_jobs > 1 && !time_report.enabled && is_func_pass(i)) {
+        // 组中的pass需要的分析必须被组中它之前的pass保持，否则只能在它之前结束这一组，重新计算分析
+        u32 j = i + 1, valid = passes[i].preserved;
+        while (j < passes.size() && is_func_pass(j) && !(passes[j].required & ~valid)) valid &= passes[j++].preserved;
+        run_ir_func_passes(*ir, passes.data() + i, passes.data() + j);
+        i = j;
+      } else {
+        run_pass(p, passes[i++]);
+      }
     }
   }
 }
 
-void print_passes() {
+void print_passes(u32 opt_level) {
+  opt_level = clamp_level(opt_level);
   std::cout << "IR Passes:" << std::endl;
-  for (auto &[pass, name] : ir_passes) {
-    std::cout << "* " << name << std::endl;
+  for (auto &desc : ir_passes[opt_level]) {
+    std::cout << "* " << desc.name << std::endl;
   }
   std::cout << "ASM Passes:" << std::endl;
-  for (auto &[pass, name] : asm_passes) {
-    std::cout << "* " << name << std::endl;
+  for (auto &desc : asm_passes[opt_level]) {
+    std::cout << "* " << asm_pass(desc).name << std::endl;
   }
 }
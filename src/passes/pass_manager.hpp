@@ -5,5 +5,8 @@
 
 using IntermediateProgram = std::variant<IrProgram *, MachineProgram *>;
 
-void run_passes(IntermediateProgram p, bool opt);
-void print_passes();
+// -L: use the linear scan register allocator at every level, not only at -O0 and -O1
+extern bool use_linear_scan;
+
+void run_passes(IntermediateProgram p, u32 opt_level);
+void print_passes(u32 opt_level);
@@ -0,0 +1,141 @@
+// Compile-time report (-T).
+//
+// Every front-end stage in main.cpp and every entry of ir_passes/asm_passes is
+// recorded as one Stage, in execution order, so a pass that runs several times
+// shows up several times.  The table on stderr additionally sums the stages by
+// name; the JSON file keeps the raw per-run records for regression tracking.
+#include "time_report.hpp"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+
+TimeReport time_report;
+
+ProgramSize program_size(IrProgram *p) {
+  ProgramSize ret{0, 0};
+  for (IrFunc *f = p->func.head; f; f = f->next) {
+    for (BasicBlock *bb = f->bb.head; bb; bb = bb->next) {
+      ++ret.bbs;
+      for (Inst *i = bb->insts.head; i; i = i->next) ++ret.insts;
+    }
+  }
+  return ret;
+}
+
+ProgramSize program_size(MachineProgram *p) {
+  ProgramSize ret{0, 0};
+  for (MachineFunc *f = p->func.head; f; f = f->next) {
+    for (MachineBB *bb = f->bb.head; bb; bb = bb->next) {
+      ++ret.bbs;
+      for (MachineInst *i = bb->insts.head; i; i = i->next) ++ret.insts;
+    }
+  }
+  return ret;
+}
+
+static double now_ms() {
+  using namespace std::chrono;
+  return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static long peak_rss_kb() {
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;  // KB on Linux
+}
+
+void TimeReport::begin(const char *name, const char *kind, ProgramSize before) {
+  stages.push_back({name, kind, 0, before, {}, 0});
+  start_rss_kb = peak_rss_kb();
+  start_ms = now_ms();
+}
+
+void TimeReport::end(ProgramSize after) {
+  double end_ms = now_ms();
+  Stage &s = stages.back();
+  s.wall_ms = end_ms - start_ms;
+  s.after = after;
+  s.peak_rss_delta_kb = peak_rss_kb() - start_rss_kb;
+}
+
+static std::string size_change(i32 before, i32 after) {
+  if (before < 0 && after < 0) return "-";
+  auto str = [](i32 x) { return x < 0 ? std::string("-") : std::to_string(x); };
+  return before == after ? str(after) : str(before) + " -> " + str(after);
+}
+
+static void print_json_string(std::ostream &os, const char *s) {
+  os << '"';
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') os << '\\';
+    os << *s;
+  }
+  os << '"';
+}
+
+static void print_json_size(std::ostream &os, i32 x) {
+  if (x < 0) os << "null";
+  else os << x;
+}
+
+void TimeReport::dump(const char *input, const char *json_file) {
+  double total_ms = 0;
+  for (Stage &s : stages) total_ms += s.wall_ms;
+
+  fprintf(stderr, "===== compile time report: %s =====\n", input);
+  fprintf(stderr, "%-32s %-8s %10s %6s %22s %18s %9s\n", "stage", "kind", "time(ms)", "%", "insts", "bbs", "rss+(KB)");
+  for (Stage &s : stages) {
+    fprintf(stderr, "%-32s %-8s %10.3f %6.1f %22s %18s %9ld\n", s.name.c_str(), s.kind, s.wall_ms,
+            total_ms > 0 ? s.wall_ms / total_ms * 100 : 0.0, size_change(s.before.insts, s.after.insts).c_str(),
+            size_change(s.before.bbs, s.after.bbs).c_str(), s.peak_rss_delta_kb);
+  }
+
+  // 同名的pass合并到一起，按时间从大到小排列
+  std::map<std::pair<std::string, std::string>, std::pair<double, u32>> by_name;
+  for (Stage &s : stages) {
+    auto &[ms, runs] = by_name[{s.name, s.kind}];
+    ms += s.wall_ms;
+    ++runs;
+  }
+  std::vector<std::pair<std::pair<std::string, std::string>, std::pair<double, u32>>> sorted(by_name.begin(),
+                                                                                             by_name.end());
+  std::stable_sort(sorted.begin(), sorted.end(), [](auto &l, auto &r) { return l.second.first > r.second.first; });
+  fprintf(stderr, "----- summed by name -----\n");
+  fprintf(stderr, "%-32s %-8s %10s %6s %6s\n", "stage", "kind", "time(ms)", "%", "runs");
+  for (auto &[key, value] : sorted) {
+    fprintf(stderr, "%-32s %-8s %10.3f %6.1f %6u\n", key.first.c_str(), key.second.c_str(), value.first,
+            total_ms > 0 ? value.first / total_ms * 100 : 0.0, value.second);
+  }
+  fprintf(stderr, "%-32s %-8s %10.3f %6.1f\n", "total", "", total_ms, 100.0);
+  fprintf(stderr, "peak rss: %ld KB\n", peak_rss_kb());
+
+  if (json_file) {
+    std::ofstream os(json_file);
+    os << "{\n  \"input\": ";
+    print_json_string(os, input);
+    os << ",\n  \"total_ms\": " << total_ms << ",\n  \"peak_rss_kb\": " << peak_rss_kb() << ",\n  \"stages\": [";
+    for (size_t i = 0; i < stages.size(); ++i) {
+      Stage &s = stages[i];
+      os << (i ? ",\n" : "\n") << "    {\"name\": ";
+      print_json_string(os, s.name.c_str());
+      os << ", \"kind\": ";
+      print_json_string(os, s.kind);
+      os << ", \"wall_ms\": " << s.wall_ms;
+      std::pair<const char *, i32> sizes[] = {{"insts_before", s.before.insts},
+                                              {"insts_after", s.after.insts},
+                                              {"bbs_before", s.before.bbs},
+                                              {"bbs_after", s.after.bbs}};
+      for (auto &[key, x] : sizes) {
+        os << ", \"" << key << "\": ";
+        print_json_size(os, x);
+      }
+      os << ", \"peak_rss_delta_kb\": " << s.peak_rss_delta_kb << "}";
+    }
+    os << "\n  ]\n}\n";
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../structure/ir.hpp"
+#include "../structure/machine_code.hpp"
+
+// number of instructions and basic blocks of a program, -1 when there is no program to count
+struct ProgramSize {
+  i32 insts = -1;
+  i32 bbs = -1;
+};
+
+ProgramSize program_size(IrProgram *p);
+ProgramSize program_size(MachineProgram *p);
+
+// per-stage wall time, program size and peak RSS growth, enabled by -T
+struct TimeReport {
+  struct Stage {
+    std::string name;
+    const char *kind;  // frontend(stages in main.cpp), ir or asm
+    double wall_ms;
+    ProgramSize before, after;
+    long peak_rss_delta_kb;  // ru_maxrss after the stage minus ru_maxrss before it
+  };
+
+  bool enabled = false;
+  std::vector<Stage> stages;
+
+  // stages don't nest, every begin is followed by one end
+  void begin(const char *name, const char *kind, ProgramSize before);
+  void end(ProgramSize after);
+
+  // table goes to stderr, json_file gets the same data as JSON
+  void dump(const char *input, const char *json_file);
+
+ private:
+  double start_ms = 0;
+  long start_rss_kb = 0;
+};
+
+extern TimeReport time_report;
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "../common.hpp"
+
+// IR对象(Inst, BasicBlock)以及CallInst和phi的操作数数组使用的bump allocator
+// 每个对象前有一个Header，记录对象的大小，种类和是否已经被delete，这样整体释放前可以遍历所有仍然存活的对象
+// delete一个对象会运行析构函数，内存放回所属arena的空闲链表中供之后同样大小的对象复用，release时统一归还
+// chunk按CHUNK_SIZE对齐，chunk开头保存所属的arena，所以delete时不需要知道当前的arena是哪个
+struct Arena {
+  // Buffer是ArenaAllocator分配的数组，由拥有它的Inst的析构函数释放
+  enum class Kind : uint8_t { Inst, BasicBlock, Buffer };
+
+  struct Header {
+    u32 size;  // 不含Header，已按8字节对齐
+    Kind kind;
+    bool alive;
+  };
+  static_assert(sizeof(Header) == 8);
+
+  struct Chunk {
+    char *begin;  // 第一个对象的Header
+    char *cur;
+    char *end;
+  };
+
+  static constexpr size_t CHUNK_SIZE = 256 * 1024;
+  // 大小不超过这个值的对象在delete后会被复用
+  static constexpr size_t MAX_REUSE_SIZE = 256;
+
+  std::vector<Chunk> chunks;
+  // free_list[size / 8]，链表的next指针存在对象本身的内存中
+  void *free_list[MAX_REUSE_SIZE / 8 + 1] = {};
+  // 统计信息，单位为字节，包括已经被delete的对象
+  size_t allocated = 0;
+
+  // new出来的IR对象所属的arena，用ArenaScope切换。每个线程有自己的current，这样不同线程可以同时处理不同的函数
+  static thread_local Arena *current;
+
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() { release(); }
+
+  void *alloc(size_t size, Kind kind) {
+    size = (size + 7) & ~size_t(7);
+    if (size <= MAX_REUSE_SIZE && free_list[size / 8]) {
+      void *p = free_list[size / 8];
+      free_list[size / 8] = *(void **)p;
+      auto *h = (Header *)p - 1;
+      h->kind = kind;
+      h->alive = true;
+      return p;
+    }
+    size_t need = sizeof(Header) + size;
+    if (chunks.empty() || size_t(chunks.back().end - chunks.back().cur) < need) {
+      // 超过一个chunk的对象单独占用若干个连续的chunk，它的Header仍然在第一个CHUNK_SIZE之内
+      size_t chunk_size = (need + alignof(std::max_align_t) + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+      char *mem = (char *)aligned_alloc(CHUNK_SIZE, chunk_size);
+      if (!mem) ERR_EXIT(SYSTEM_ERROR, "arena out of memory");
+      *(Arena **)mem = this;
+      char *begin = mem + alignof(std::max_align_t);
+      chunks.push_back({begin, begin, mem + chunk_size});
+    }
+    Chunk &c = chunks.back();
+    auto *h = (Header *)c.cur;
+    h->size = size;
+    h->kind = kind;
+    h->alive = true;
+    c.cur += need;
+    allocated += size;
+    return h + 1;
+  }
+
+  // alloc返回的p所属的arena
+  static Arena *owner(const void *p) {
+    return *(Arena **)((uintptr_t)((const Header *)p - 1) & ~uintptr_t(CHUNK_SIZE - 1));
+  }
+
+  static void dealloc(void *p) {
+    if (!p) return;
+    auto *h = (Header *)p - 1;
+    h->alive = false;
+    if (h->size <= MAX_REUSE_SIZE) {
+      Arena *o = owner(p);
+      *(void **)p = o->free_list[h->size / 8];
+      o->free_list[h->size / 8] = p;
+    }
+  }
+
+  // f(Kind kind, void *obj)，只访问还没有被delete的对象
+  template <class F>
+  void for_each_alive(F f) {
+    for (Chunk &c : chunks) {
+      for (char *p = c.begin; p < c.cur;) {
+        auto *h = (Header *)p;
+        if (h->alive) f(h->kind, (void *)(h + 1));
+        p += sizeof(Header) + h->size;
+      }
+    }
+  }
+
+  // 归还所有内存，不运行析构函数；调用者负责先析构仍然存活的对象(见release_ir_arena)
+  void release() {
+    for (Chunk &c : chunks) free(c.begin - alignof(std::max_align_t));
+    chunks.clear();
+    for (void *&head : free_list) head = nullptr;
+    allocated = 0;
+  }
+};
+
+struct ArenaScope {
+  Arena *prev;
+  explicit ArenaScope(Arena *arena) : prev(Arena::current) { Arena::current = arena; }
+  ~ArenaScope() { Arena::current = prev; }
+};
+
+// 从一个固定的arena中分配std::vector的数组，IR中用它让Inst的操作数数组和Inst本身在同一个arena中
+// 用Inst所在的arena而不是Arena::current，这样IrProgramPass修改某个函数中的phi时不需要切换arena
+template <class T>
+struct ArenaAllocator {
+  using value_type = T;
+  Arena *arena;
+
+  explicit ArenaAllocator(Arena *arena) : arena(arena) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) { return (T *)arena->alloc(n * sizeof(T), Arena::Kind::Buffer); }
+  void deallocate(T *p, size_t) { Arena::dealloc(p); }
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U> &rhs) const {
+    return arena == rhs.arena;
+  }
+  template <class U>
+  bool operator!=(const ArenaAllocator<U> &rhs) const {
+    return arena != rhs.arena;
+  }
+};
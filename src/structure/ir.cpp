@@ -26,6 +26,16 @@ void Value::deleteValue() {
     delete x;
   else if (auto x = dyn_cast<PhiInst>(this))
     delete x;
+  else if (auto x = dyn_cast<VectorBinaryInst>(this))
+    delete x;
+  else if (auto x = dyn_cast<VectorDupInst>(this))
+    delete x;
+  else if (auto x = dyn_cast<VectorLoadInst>(this))
+    delete x;
+  else if (auto x = dyn_cast<VectorStoreInst>(this))
+    delete x;
+  else if (auto x = dyn_cast<VectorReduceInst>(this))
+    delete x;
   else if (auto x = dyn_cast<MemOpInst>(this))
     delete x;
   else if (auto x = dyn_cast<MemPhiInst>(this))
@@ -41,6 +51,46 @@ void Value::deleteValue() {
 }
 
 std::unordered_map<i32, ConstValue *> ConstValue::POOL;
+std::mutex ConstValue::POOL_MUTEX;
+std::mutex Value::GLOBAL_USES_MUTEX;
+
+// 不在任何ArenaScope中时new出来的IR对象放在这里，直到程序退出
+static Arena fallback_arena;
+thread_local Arena *Arena::current = &fallback_arena;
+
+// 析构arena中所有仍然存活的Inst和BasicBlock，然后整体归还内存。Buffer由拥有它的Inst的析构函数释放
+// 被删除的函数中可能有已经从链表中摘下但没有delete的Inst，它们仍然在use别的Value(如GlobalRef)，
+// 所以不能只遍历bb链表，而是遍历arena中所有存活的对象。先断开所有use关系，再析构，避免析构时访问已经析构的Value
+static void release_ir_arena(Arena &arena) {
+  arena.for_each_alive([](Arena::Kind kind, void *obj) {
+    if (kind == Arena::Kind::Inst) {
+      auto *inst = (Inst *)obj;
+      for (auto [it, end] = inst->operands(); it < end; ++it) it->set(nullptr);
+      inst->replaceAllUseWith(nullptr);
+    }
+  });
+  arena.for_each_alive([](Arena::Kind kind, void *obj) {
+    if (kind == Arena::Kind::Inst)
+      ((Inst *)obj)->deleteValue();
+    else if (kind == Arena::Kind::BasicBlock)
+      delete (BasicBlock *)obj;
+  });
+  arena.release();
+}
+
+void IrFunc::release() {
+  release_ir_arena(arena);
+  invalidate_analyses();
+  loop_info.clear();
+  rpo.clear();
+  df.clear();
+  bb.head = bb.tail = nullptr;
+}
+
+void IrProgram::release() {
+  for (IrFunc *f = func.head; f; f = f->next) f->release();
+  release_ir_arena(arena);
+}
 
 UndefValue UndefValue::INSTANCE;
 
@@ -62,6 +112,16 @@ std::pair<Use *, Use *> Inst::operands() {
     return {x->args.data(), x->args.data() + x->args.size()};
   else if (auto x = dyn_cast<PhiInst>(this))
     return {x->incoming_values.data(), x->incoming_values.data() + x->incoming_values.size()};
+  else if (auto x = dyn_cast<VectorBinaryInst>(this))
+    return {&x->lhs, &x->rhs + 1};
+  else if (auto x = dyn_cast<VectorDupInst>(this))
+    return {&x->value, &x->value + 1};
+  else if (auto x = dyn_cast<VectorLoadInst>(this))
+    return {&x->arr, &x->index + 1};
+  else if (auto x = dyn_cast<VectorStoreInst>(this))
+    return {&x->arr, &x->data + 1};
+  else if (auto x = dyn_cast<VectorReduceInst>(this))
+    return {&x->value, &x->value + 1};
   else if (auto x = dyn_cast<MemOpInst>(this))
     return {&x->mem_token, &x->mem_token + 1};
   else if (auto x = dyn_cast<MemPhiInst>(this))
@@ -196,6 +256,15 @@ std::ostream &operator<<(std::ostream &os, const IrProgram &p) {
       u32 idx = bb_index.size();
       bb_index.insert({bb, idx});
     }
+    // 输出&arr[index]转换成<4 x i32>*的两条指令，返回结果的临时变量编号，调用者接着输出load或store
+    auto print_vector_ptr = [&](Value *arr, Value *index) {
+      u32 temp = v_index.alloc();
+      os << "%t" << temp << " = getelementptr inbounds i32, i32* " << pv(v_index, arr) << ", i32 "
+         << pv(v_index, index) << endl;
+      u32 vec_ptr = v_index.alloc();
+      os << "\t%t" << vec_ptr << " = bitcast i32* %t" << temp << " to <4 x i32>*" << endl;
+      return vec_ptr;
+    };
     for (auto bb = f->bb.head; bb; bb = bb->next) {
       u32 index = bb_index.find(bb)->second;
       os << "_" << index << ": ; preds = ";
@@ -323,13 +392,48 @@ std::ostream &operator<<(std::ostream &os, const IrProgram &p) {
         } else if (auto x = dyn_cast<PhiInst>(inst)) {
           bool is_pointer_phi = std::any_of(x->incoming_values.begin(), x->incoming_values.end(),
                                             [](const Use &u) { return is_pointer_value(u.value); });
-          os << pv(v_index, inst) << " = phi " << (is_pointer_phi ? "i32* " : "i32 ");
+          const char *type = is_pointer_phi ? "i32* " : is_vector_value(x) ? "<4 x i32> " : "i32 ";
+          os << pv(v_index, inst) << " = phi " << type;
           for (u32 i = 0; i < x->incoming_values.size(); ++i) {
             if (i != 0) os << ", ";
             os << "[" << pv(v_index, x->incoming_values[i].value) << ", %_"
                << bb_index.find(x->incoming_bbs()[i])->second << "]";
           }
           os << endl;
+        } else if (auto x = dyn_cast<VectorBinaryInst>(inst)) {
+          os << pv(v_index, inst) << " = " << BinaryInst::LLVM_OPS[(int)x->op] << " <4 x i32> "
+             << pv(v_index, x->lhs.value) << ", " << pv(v_index, x->rhs.value) << endl;
+        } else if (auto x = dyn_cast<VectorDupInst>(inst)) {
+          u32 temp = v_index.alloc();
+          os << "%t" << temp << " = insertelement <4 x i32> undef, i32 " << pv(v_index, x->value.value) << ", i32 0"
+             << endl;
+          os << "\t" << pv(v_index, inst) << " = shufflevector <4 x i32> %t" << temp
+             << ", <4 x i32> undef, <4 x i32> zeroinitializer" << endl;
+        } else if (auto x = dyn_cast<VectorLoadInst>(inst)) {
+          u32 temp = print_vector_ptr(x->arr.value, x->index.value);
+          os << "\t" << pv(v_index, inst) << " = load <4 x i32>, <4 x i32>* %t" << temp << ", align 4" << endl;
+        } else if (auto x = dyn_cast<VectorStoreInst>(inst)) {
+          u32 temp = print_vector_ptr(x->arr.value, x->index.value);
+          os << "\tstore <4 x i32> " << pv(v_index, x->data.value) << ", <4 x i32>* %t" << temp << ", align 4" << endl;
+        } else if (auto x = dyn_cast<VectorReduceInst>(inst)) {
+          // 依次取出4个lane并合并
+          u32 acc = 0;
+          for (u32 i = 0; i < 4; ++i) {
+            u32 lane = v_index.alloc();
+            os << (i ? "\t%t" : "%t") << lane << " = extractelement <4 x i32> " << pv(v_index, x->value.value)
+               << ", i32 " << i << endl;
+            if (i == 0) {
+              acc = lane;
+            } else if (i < 3) {
+              u32 temp = v_index.alloc();
+              os << "\t%t" << temp << " = " << BinaryInst::LLVM_OPS[(int)x->op] << " i32 %t" << acc << ", %t" << lane
+                 << endl;
+              acc = temp;
+            } else {
+              os << "\t" << pv(v_index, inst) << " = " << BinaryInst::LLVM_OPS[(int)x->op] << " i32 %t" << acc
+                 << ", %t" << lane << endl;
+            }
+          }
         } else if (auto x = dyn_cast<MemOpInst>(inst)) {
           os << "; mem" << v_index.get(x) << " for load@" << x->load << ", use " << pv(v_index, x->mem_token.value)
              << endl;
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cstdint>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string_view>
 #include <unordered_map>
@@ -12,6 +13,7 @@
 
 #include "../casting.hpp"
 #include "../common.hpp"
+#include "arena.hpp"
 
 // 声明ast中用到的类型，从而让这里不需要include "ast.hpp"。真正需要访问字段的文件里自己include
 struct Func;
@@ -37,6 +39,11 @@ struct Value {
     Call,
     Alloca,
     Phi,
+    VectorBinary,
+    VectorDup,
+    VectorLoad,
+    VectorStore,
+    VectorReduce,  // 4个i32组成的向量，见VectorBinaryInst
     MemOp,
     MemPhi,  // 虚拟的MemPhi指令，保证不出现在指令序列中，只出现在BasicBlock::mem_phis中
     Const,
@@ -47,12 +54,33 @@ struct Value {
 
   Value(Tag tag) : tag(tag) {}
 
-  void addUse(Use *u) { uses.insertAtEnd(u); }
-  void killUse(Use *u) { uses.remove(u); }
+  // ConstValue和UndefValue是所有函数共享的，不记录它们的use，这样它们创建后就不再被修改，可以被多个线程同时使用
+  // 也就是说不能遍历它们的uses，也不能对它们调用replaceAllUseWith
+  bool tracks_uses() const { return tag != Tag::Const && tag != Tag::Undef; }
+  // GlobalRef也是共享的，但是mark_global_const需要它的uses，所以修改时加锁
+  // 只有IrProgramPass会遍历GlobalRef的uses，那时没有其他线程在运行，所以遍历时不需要加锁
+  static std::mutex GLOBAL_USES_MUTEX;
+  void addUse(Use *u) {
+    if (tag == Tag::Global) {
+      std::lock_guard lock(GLOBAL_USES_MUTEX);
+      uses.insertAtEnd(u);
+    } else if (tracks_uses()) {
+      uses.insertAtEnd(u);
+    }
+  }
+  void killUse(Use *u) {
+    if (tag == Tag::Global) {
+      std::lock_guard lock(GLOBAL_USES_MUTEX);
+      uses.remove(u);
+    } else if (tracks_uses()) {
+      uses.remove(u);
+    }
+  }
 
   // 将对自身所有的使用替换成对v的使用
   inline void replaceAllUseWith(Value *v);
-  // 调用deleteValue语义上相当于delete掉它，但是按照现在的实现不能直接delete它
+  // 调用deleteValue语义上相当于delete掉它，会根据tag调用正确的析构函数
+  // Inst的内存来自所在函数的arena，delete只是运行析构函数，内存在arena释放时统一归还
   void deleteValue();
 };
 
@@ -94,14 +122,39 @@ struct Use {
   }
 };
 
+// CallInst和phi的操作数数组，和拥有它的Inst分配在同一个arena中，见ArenaAllocator
+// 它只能作为Inst的成员，用Inst::use_allocator()构造
+using UseVector = std::vector<Use, ArenaAllocator<Use>>;
+
 void Value::replaceAllUseWith(Value *v) {
   // head->set会将head从链表中移除
   while (uses.head) uses.head->set(v);
 }
 
+// IrFunc::valid_analyses和IrProgram::valid_analyses中的位，为1表示对应的分析结果仍然有效
+// pass在pass_manager.cpp中声明它需要和保持哪些分析，pass运行后它没有保持的分析都会失效
+enum Analysis : u32 {
+  AnalysisDom = 1 << 0,        // BasicBlock::idom, dom_by, doms, dom_level
+  AnalysisLoop = 1 << 1,       // IrFunc::loop_info
+  AnalysisRpo = 1 << 2,        // IrFunc::rpo
+  AnalysisDf = 1 << 3,         // IrFunc::df
+  AnalysisCallGraph = 1 << 4,  // IrFunc::callee_func, caller_func, load_global, has_side_effect，记录在IrProgram中
+  // 只依赖于cfg的分析，不修改cfg的pass保持它们
+  AnalysisCfg = AnalysisDom | AnalysisLoop | AnalysisRpo | AnalysisDf,
+};
+
 struct IrProgram {
   ilist<IrFunc> func;
   std::vector<Decl *> glob_decl;
+  // 只会包含AnalysisCallGraph
+  u32 valid_analyses = 0;
+  // 运行IrProgramPass时的默认arena，在编译结束时释放
+  // IrFuncPass会在不同线程中同时运行，它们delete的对象必须在各自函数的arena中，
+  // 所以IrProgramPass在函数中新建Inst和BasicBlock时应该用ArenaScope切换到那个函数的arena
+  Arena arena;
+
+  // 释放所有函数和程序本身的arena，之后不能再访问任何Inst和BasicBlock
+  void release();
 
   friend std::ostream &operator<<(std::ostream &os, const IrProgram &dt);
 };
@@ -122,6 +175,63 @@ struct BasicBlock {
   inline std::array<BasicBlock *, 2> succ();
   inline std::array<BasicBlock **, 2> succ_ref();  // 想修改succ时使用
   inline bool valid();
+
+  static void *operator new(size_t size) { return Arena::current->alloc(size, Arena::Kind::BasicBlock); }
+  static void operator delete(void *p) { Arena::dealloc(p); }
+};
+
+struct Loop {
+  Loop *parent;
+  std::vector<Loop *> sub_loops;
+  // bbs[0]是loop header
+  std::vector<BasicBlock *> bbs;
+
+  explicit Loop(BasicBlock *header) : parent(nullptr), bbs{header} {}
+
+  BasicBlock *header() { return bbs[0]; }
+
+  // 对于顶层的循环返回1
+  u32 depth() {
+    u32 ret = 0;
+    for (Loop *x = this; x; x = x->parent) ++ret;
+    return ret;
+  }
+
+  void get_deepest_loops(std::vector<Loop *> &deepest) {
+    if (sub_loops.empty()) deepest.push_back(this);
+    else for (Loop *x : sub_loops) x->get_deepest_loops(deepest);
+  }
+};
+
+struct LoopInfo {
+  // 返回bb所处的最深的循环
+  std::unordered_map<BasicBlock *, Loop *> loop_of_bb;
+  std::vector<Loop *> top_level;
+
+  // 若bb不在任何循环中，返回0
+  u32 depth_of(BasicBlock *bb) {
+    auto it = loop_of_bb.find(bb);
+    return it == loop_of_bb.end() ? 0 : it->second->depth();
+  }
+
+  std::vector<Loop *> deepest_loops() {
+    std::vector<Loop *> deepest;
+    for (Loop *l : top_level) l->get_deepest_loops(deepest);
+    return deepest;
+  }
+
+  // 释放所有Loop
+  void clear() {
+    std::vector<Loop *> worklist = top_level;
+    while (!worklist.empty()) {
+      Loop *l = worklist.back();
+      worklist.pop_back();
+      worklist.insert(worklist.end(), l->sub_loops.begin(), l->sub_loops.end());
+      delete l;
+    }
+    loop_of_bb.clear();
+    top_level.clear();
+  }
 };
 
 struct IrFunc {
@@ -138,6 +248,16 @@ struct IrFunc {
   // no side effect函数的没有user的调用可以删除
   bool has_side_effect;
   bool can_inline;
+  // 这个函数的Inst和BasicBlock都从这里分配
+  Arena arena;
+  // 缓存的分析结果，只有valid_analyses中对应的位为1时才有效，通过passes/ir/cfg.hpp中的函数访问
+  u32 valid_analyses = 0;
+  LoopInfo loop_info;
+  std::vector<BasicBlock *> rpo;
+  std::unordered_map<BasicBlock *, std::unordered_set<BasicBlock *>> df;
+
+  // 修改了cfg之后调用，之后再访问分析结果时会重新计算
+  void invalidate_analyses(u32 preserved = 0) { valid_analyses &= preserved; }
 
   // pure函数的参数相同的调用可以删除
   bool pure() const { return !(load_global || has_side_effect); }
@@ -146,6 +266,9 @@ struct IrFunc {
   void clear_all_vis() {
     for (BasicBlock *b = bb.head; b; b = b->next) b->vis = false;
   }
+
+  // 函数被删除时调用，释放arena中所有的Inst和BasicBlock
+  void release();
 };
 
 struct ConstValue : Value {
@@ -153,8 +276,10 @@ struct ConstValue : Value {
   const i32 imm;
 
   static std::unordered_map<i32, ConstValue *> POOL;
+  static std::mutex POOL_MUTEX;
 
   static ConstValue *get(i32 imm) {
+    std::lock_guard lock(POOL_MUTEX);
     auto [it, inserted] = POOL.insert({imm, nullptr});
     if (inserted) it->second = new ConstValue(imm);
     return it->second;
@@ -183,7 +308,7 @@ struct UndefValue : Value {
   DEFINE_CLASSOF(Value, p->tag == Tag::Undef);
 
   UndefValue() : Value(Tag::Undef) {}
-  // 这是一个全局可变变量，不过反正也不涉及多线程，不会有冲突
+  // 不记录use(见Value::tracks_uses)，所以多个线程同时使用它也不会冲突
   static UndefValue INSTANCE;
 };
 
@@ -207,6 +332,12 @@ struct Inst : Value {
   std::pair<Use *, Use *> operands();
 
   inline bool has_side_effect();
+
+  static void *operator new(size_t size) { return Arena::current->alloc(size, Arena::Kind::Inst); }
+  static void operator delete(void *p) { Arena::dealloc(p); }
+
+  // 从这条指令所在的arena中分配，只能在构造UseVector成员时调用
+  ArenaAllocator<Use> use_allocator() const { return ArenaAllocator<Use>(Arena::owner(this)); }
 };
 
 struct BinaryInst : Inst {
@@ -355,7 +486,7 @@ struct StoreInst : AccessInst {
 struct CallInst : Inst {
   DEFINE_CLASSOF(Value, p->tag == Tag::Call);
   IrFunc *func;
-  std::vector<Use> args;
+  UseVector args{use_allocator()};
   CallInst(IrFunc *func, BasicBlock *insertAtEnd) : Inst(Tag::Call, insertAtEnd), func(func) {}
 };
 
@@ -368,7 +499,7 @@ struct AllocaInst : Inst {
 
 struct PhiInst : Inst {
   DEFINE_CLASSOF(Value, p->tag == Tag::Phi);
-  std::vector<Use> incoming_values;
+  UseVector incoming_values{use_allocator()};
   std::vector<BasicBlock *> &incoming_bbs() { return bb->pred; }
 
   explicit PhiInst(BasicBlock *insertAtFront) : Inst(Tag::Phi) {
@@ -391,6 +522,64 @@ struct PhiInst : Inst {
   }
 };
 
+// 以下是4个i32组成的向量上的指令，只由IR pass中最后运行的vectorize_loop生成，所以其他IR pass都不需要处理它们
+struct VectorBinaryInst : Inst {
+  DEFINE_CLASSOF(Value, p->tag == Tag::VectorBinary);
+  Tag op;  // Add, Sub, Mul，每个lane分别计算
+  Use lhs;
+  Use rhs;
+
+  VectorBinaryInst(Tag op, Value *lhs, Value *rhs, BasicBlock *insertAtEnd)
+      : Inst(Tag::VectorBinary, insertAtEnd), op(op), lhs(lhs, this), rhs(rhs, this) {}
+};
+
+// 4个lane都是value
+struct VectorDupInst : Inst {
+  DEFINE_CLASSOF(Value, p->tag == Tag::VectorDup);
+  Use value;
+
+  VectorDupInst(Value *value, BasicBlock *insertAtEnd) : Inst(Tag::VectorDup, insertAtEnd), value(value, this) {}
+};
+
+// 读arr[index]到arr[index + 3]
+struct VectorLoadInst : Inst {
+  DEFINE_CLASSOF(Value, p->tag == Tag::VectorLoad);
+  Decl *lhs_sym;
+  Use arr;
+  Use index;
+
+  VectorLoadInst(Decl *lhs_sym, Value *arr, Value *index, BasicBlock *insertAtEnd)
+      : Inst(Tag::VectorLoad, insertAtEnd), lhs_sym(lhs_sym), arr(arr, this), index(index, this) {}
+};
+
+// 写arr[index]到arr[index + 3]
+struct VectorStoreInst : Inst {
+  DEFINE_CLASSOF(Value, p->tag == Tag::VectorStore);
+  Decl *lhs_sym;
+  Use arr;
+  Use index;
+  Use data;
+
+  VectorStoreInst(Decl *lhs_sym, Value *arr, Value *data, Value *index, BasicBlock *insertAtEnd)
+      : Inst(Tag::VectorStore, insertAtEnd), lhs_sym(lhs_sym), arr(arr, this), index(index, this), data(data, this) {}
+};
+
+// 4个lane用op(Add或Mul)合并成一个i32
+struct VectorReduceInst : Inst {
+  DEFINE_CLASSOF(Value, p->tag == Tag::VectorReduce);
+  Tag op;
+  Use value;
+
+  VectorReduceInst(Tag op, Value *value, BasicBlock *insertAtEnd)
+      : Inst(Tag::VectorReduce, insertAtEnd), op(op), value(value, this) {}
+};
+
+// 结果是否是向量。vectorize_loop生成的向量phi只用于归约，incoming_values[0]总是VectorDup
+inline bool is_vector_value(Value *v) {
+  if (auto x = dyn_cast<PhiInst>(v)) v = x->incoming_values[0].value;
+  return Value::Tag::VectorBinary <= v->tag && v->tag <= Value::Tag::VectorLoad;
+}
+
 struct MemOpInst : Inst {
   DEFINE_CLASSOF(Value, p->tag == Tag::MemOp);
   Use mem_token;
@@ -403,7 +592,7 @@ struct MemOpInst : Inst {
 // 我不希望让它继承PhiInst，这也许会影响以前的一些对PhiInst的使用
 struct MemPhiInst : Inst {
   DEFINE_CLASSOF(Value, p->tag == Tag::MemPhi);
-  std::vector<Use> incoming_values;
+  UseVector incoming_values{use_allocator()};
   std::vector<BasicBlock *> &incoming_bbs() { return bb->pred; }
 
   // load依赖store和store依赖load两种依赖用到的MemPhiInst不一样
@@ -422,7 +611,9 @@ struct MemPhiInst : Inst {
 };
 
 bool Inst::has_side_effect() {
-  if (isa<BranchInst>(this) || isa<JumpInst>(this) || isa<ReturnInst>(this) || isa<StoreInst>(this)) return true;
+  if (isa<BranchInst>(this) || isa<JumpInst>(this) || isa<ReturnInst>(this) || isa<StoreInst>(this) ||
+      isa<VectorStoreInst>(this))
+    return true;
   if (auto x = dyn_cast<CallInst>(this); x && x->func->has_side_effect) return true;
   return false;
 }
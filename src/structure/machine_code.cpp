@@ -1,21 +1,28 @@
 #include "machine_code.hpp"
 
 #include <algorithm>
+#include <cassert>
 #include <functional>
 #include <iomanip>
+#include <sstream>
 
-std::ostream &operator<<(std::ostream &os, const MachineProgram &p) {
+#include "../thread_pool.hpp"
+
+// 输出一个函数的代码，不依赖其他函数的输出，所以各个函数可以并行输出到各自的缓冲区中
+// bb的编号是bb_base加上在这个函数中第一次出现的顺序，常量池的编号中带有函数的下标，从而整个文件中不会重复
+static void print_func(std::ostream &os, MachineFunc *f, u32 func_index, u32 bb_base) {
   using std::endl;
   static const std::string BB_PREFIX = ".L_BB_";
   IndexMapper<MachineBB> bb_index;
 
   // count instructions to solve constant pool problem
+  // 上一个函数总是以b或bx结束，它们之后都插入了常量池，所以每个函数都可以从0开始计数
   auto pool_count = 0;
   auto inst_count = 0;
   auto insert_pool = [&](bool insert_jump = false) {
     inst_count = 0;
     auto pool_num = pool_count++;
-    auto pool_name = "_POOL_" + std::to_string(pool_num++);
+    auto pool_name = "_POOL_" + std::to_string(func_index) + "_" + std::to_string(pool_num);
     auto sec_name = ".L" + pool_name;
     auto after_sec_name = ".L_AFTER" + pool_name;
     if (insert_jump) {
@@ -42,7 +49,7 @@ std::ostream &operator<<(std::ostream &os, const MachineProgram &p) {
 
   // print BB name
   auto pb = [&](MachineBB *bb) {
-    os << BB_PREFIX << bb_index.get(bb);
+    os << BB_PREFIX << bb_base + bb_index.get(bb);
     return "";
   };
 
@@ -218,7 +225,7 @@ std::ostream &operator<<(std::ostream &os, const MachineProgram &p) {
             os << endl;
             increase_count();
           }
-        } else if (isa<MIReturn>(inst)) {
+        } else if (auto x = dyn_cast<MIReturn>(inst)) {
           // function epilogue
           // restore registers and pc from stack
           // increase sp
@@ -234,22 +241,60 @@ std::ostream &operator<<(std::ostream &os, const MachineProgram &p) {
             print_reg_list(os, f);
             if (f->use_lr) {
               if (!f->used_callee_saved_regs.empty()) os << ", ";
-              os << "pc";
-              need_bx = false;
+              // a tail call restores lr, so that the callee returns to our caller
+              os << (x->tail_call ? "lr" : "pc");
+              need_bx = x->tail_call;
             }
             os << "}" << endl;
           }
           if (need_bx) {
-            if (!f->used_callee_saved_regs.empty()) os << "\t";
-            os << "bx"
-               << "\t"
-               << "lr" << endl;
+            if (!f->used_callee_saved_regs.empty() || f->use_lr) os << "\t";
+            if (x->tail_call) {
+              os << "b"
+                 << "\t" << x->tail_call->name << endl;
+            } else {
+              os << "bx"
+                 << "\t"
+                 << "lr" << endl;
+            }
           }
           insert_pool();
           increase_count(2);
         } else if (auto x = dyn_cast<MICall>(inst)) {
           os << "blx\t" << x->func->name << endl;
           increase_count();
+        } else if (auto x = dyn_cast<MIVectorBinary>(inst)) {
+          const char *op = "unknown";
+          if (x->op == MachineInst::Tag::Add) {
+            op = "vadd";
+          } else if (x->op == MachineInst::Tag::Sub) {
+            op = "vsub";
+          } else if (x->op == MachineInst::Tag::Mul) {
+            op = "vmul";
+          } else {
+            UNREACHABLE();
+          }
+          os << op << ".i32\tq" << x->dst << ", q" << x->lhs << ", q" << x->rhs << endl;
+          increase_count();
+        } else if (auto x = dyn_cast<MIVectorFma>(inst)) {
+          assert(x->dst == x->acc);
+          os << "vmla.i32\tq" << x->dst << ", q" << x->lhs << ", q" << x->rhs << endl;
+          increase_count();
+        } else if (auto x = dyn_cast<MIVectorMove>(inst)) {
+          os << "vmov\tq" << x->dst << ", q" << x->src << endl;
+          increase_count();
+        } else if (auto x = dyn_cast<MIVectorDup>(inst)) {
+          os << "vdup.32\tq" << x->dst << ", " << x->src << endl;
+          increase_count();
+        } else if (auto x = dyn_cast<MIVectorExtract>(inst)) {
+          os << "vmov.32\t" << x->dst << ", d" << 2 * x->src + x->lane / 2 << "[" << x->lane % 2 << "]" << endl;
+          increase_count();
+        } else if (auto x = dyn_cast<MIVectorAccess>(inst)) {
+          // q<n> is d<2n> and d<2n+1>
+          i32 q = isa<MIVectorLoad>(x) ? static_cast<MIVectorLoad *>(x)->dst : static_cast<MIVectorStore *>(x)->data;
+          os << (isa<MIVectorLoad>(x) ? "vld1.32" : "vst1.32") << "\t{d" << 2 * q << "-d" << 2 * q + 1 << "}, ["
+             << x->addr << "]" << endl;
+          increase_count();
         } else if (auto x = dyn_cast<MIComment>(inst)) {
           os << "@ " << x->content << endl;
         } else {
@@ -257,72 +302,81 @@ std::ostream &operator<<(std::ostream &os, const MachineProgram &p) {
         }
       };
 
-  // code section
-  os << ".arch armv7ve" << endl;
-  os << ".section .text" << endl;
-  for (auto f = p.func.head; f; f = f->next) {
-    // generate symbol for function
-    os << endl << ".global " << f->func->func->name << endl;
-    os << "\t"
-       << ".type"
-       << "\t" << f->func->func->name << ", %function" << endl;
-    os << f->func->func->name << ":" << endl;
+  // generate symbol for function
+  os << endl << ".global " << f->func->func->name << endl;
+  os << "\t"
+     << ".type"
+     << "\t" << f->func->func->name << ", %function" << endl;
+  os << f->func->func->name << ":" << endl;
 
-    // function prologue
-    if (f->use_lr || !f->used_callee_saved_regs.empty()) {
-      os << "\t"
-         << "push"
-         << "\t"
-         << "{";
-      print_reg_list(os, f);
-      if (f->use_lr) {
-        if (!f->used_callee_saved_regs.empty()) os << ", ";
-        os << "lr";
-      }
-      os << "}" << endl;
-    }
-    // move sp down
-    if (f->stack_size) {
-      move_stack(true, f->stack_size, output_instruction, "\t");
+  // function prologue
+  if (f->use_lr || !f->used_callee_saved_regs.empty()) {
+    os << "\t"
+       << "push"
+       << "\t"
+       << "{";
+    print_reg_list(os, f);
+    if (f->use_lr) {
+      if (!f->used_callee_saved_regs.empty()) os << ", ";
+      os << "lr";
     }
-    increase_count(3);
+    os << "}" << endl;
+  }
+  // move sp down
+  if (f->stack_size) {
+    move_stack(true, f->stack_size, output_instruction, "\t");
+  }
+  increase_count(3);
 
-    // generate code for each BB
-    for (auto bb = f->bb.head; bb; bb = bb->next) {
-      os << pb(bb) << ":" << endl;
-      os << "@ pred:";
-      for (auto &pred : bb->pred) {
-        os << " " << pb(pred);
-      }
-      os << ", succ:";
-      for (auto &succ : bb->succ) {
-        if (succ) {
-          os << " " << pb(succ);
-        }
-      }
-      os << ", livein:";
-      for (auto &op : bb->livein) {
-        os << " " << op;
-      }
-      os << ", liveout:";
-      for (auto &op : bb->liveout) {
-        os << " " << op;
-      }
-      os << ", liveuse:";
-      for (auto &use : bb->liveuse) {
-        os << " " << use;
-      }
-      os << ", def:";
-      for (auto &def : bb->def) {
-        os << " " << def;
+  // generate code for each BB
+  for (auto bb = f->bb.head; bb; bb = bb->next) {
+    os << pb(bb) << ":" << endl;
+    os << "@ pred:";
+    for (auto &pred : bb->pred) {
+      os << " " << pb(pred);
+    }
+    os << ", succ:";
+    for (auto &succ : bb->succ) {
+      if (succ) {
+        os << " " << pb(succ);
       }
-      os << endl;
+    }
+    auto print_regs = [&](const char *name, const RegSet &regs) {
+      os << name;
+      regs.for_each([&](u32 i) { os << " " << MachineOperand::from_reg_index(i); });
+    };
+    print_regs(", livein:", bb->livein);
+    print_regs(", liveout:", bb->liveout);
+    print_regs(", liveuse:", bb->liveuse);
+    print_regs(", def:", bb->def);
+    os << endl;
 
-      for (auto inst = bb->insts.head; inst; inst = inst->next) {
-        output_instruction(inst, f, bb, true);
-      }
+    for (auto inst = bb->insts.head; inst; inst = inst->next) {
+      output_instruction(inst, f, bb, true);
     }
   }
+}
+
+std::ostream &operator<<(std::ostream &os, const MachineProgram &p) {
+  using std::endl;
+  // code section
+  os << ".arch armv7ve" << endl;
+  os << ".section .text" << endl;
+  std::vector<MachineFunc *> funcs;
+  std::vector<u32> bb_base;
+  u32 bb_count = 0;
+  for (auto f = p.func.head; f; f = f->next) {
+    funcs.push_back(f);
+    bb_base.push_back(bb_count);
+    for (auto bb = f->bb.head; bb; bb = bb->next) ++bb_count;
+  }
+  std::vector<std::string> texts(funcs.size());
+  parallel_for(funcs.size(), [&](u32 i) {
+    std::ostringstream func_os;
+    print_func(func_os, funcs[i], i, bb_base[i]);
+    texts[i] = func_os.str();
+  });
+  for (auto &text : texts) os << text;
   // reference to libsysy to avoid optimization
   os << "\tblx getint" << endl;
 
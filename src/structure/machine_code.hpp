@@ -140,6 +140,8 @@ struct MachineFunc {
   IrFunc *func;
   // number of virtual registers allocated
   u32 virtual_max = 0;
+  // number of virtual vector registers allocated, see MIVector
+  u32 vector_virtual_max = 0;
   // size of stack allocated for local alloca and spilled registers
   u32 stack_size = 0;
   // set of callee saved registers used
@@ -150,9 +152,47 @@ struct MachineFunc {
   std::vector<MachineInst *> sp_arg_fixup;
 };
 
+// dense bitset of registers, indexed by MachineOperand::reg_index()
+struct RegSet {
+  std::vector<u64> words;
+
+  RegSet() = default;
+  explicit RegSet(u32 n) : words((n + 63) / 64) {}
+
+  bool test(u32 i) const { return i / 64 < words.size() && (words[i / 64] >> (i % 64) & 1); }
+  void set(u32 i) { words[i / 64] |= u64(1) << (i % 64); }
+  void reset(u32 i) { words[i / 64] &= ~(u64(1) << (i % 64)); }
+
+  bool operator==(const RegSet &other) const { return words == other.words; }
+  bool operator!=(const RegSet &other) const { return words != other.words; }
+
+  // this |= other, both have the same size
+  void merge(const RegSet &other) {
+    for (size_t i = 0; i < words.size(); i++) words[i] |= other.words[i];
+  }
+
+  // this = use | (out - def), all have the same size
+  void assign_transfer(const RegSet &use, const RegSet &out, const RegSet &def) {
+    for (size_t i = 0; i < words.size(); i++) words[i] = use.words[i] | (out.words[i] & ~def.words[i]);
+  }
+
+  // f(u32 index), in ascending order
+  template <class F>
+  void for_each(F f) const {
+    for (size_t i = 0; i < words.size(); i++) {
+      for (u64 w = words[i]; w; w &= w - 1) {
+        f(u32(i * 64 + __builtin_ctzll(w)));
+      }
+    }
+  }
+};
+
 struct MachineBB {
   DEFINE_ILIST(MachineBB)
+  // only valid during machine_code_generation, IR is released after that
   BasicBlock *bb;
+  // loop depth of bb, used as spill cost in register allocation
+  u32 loop_depth = 0;
   ilist<MachineInst> insts;
   // predecessor and successor
   std::vector<MachineBB *> pred;
@@ -160,12 +200,11 @@ struct MachineBB {
   // branch is translated into multiple instructions
   // points to the first one
   MachineInst *control_transfer_inst = nullptr;
-  // liveness analysis
-  // maybe we should use bitset when performance is bad
-  std::set<MachineOperand> liveuse;
-  std::set<MachineOperand> def;
-  std::set<MachineOperand> livein;
-  std::set<MachineOperand> liveout;
+  // liveness analysis, see passes/asm/liveness.hpp
+  RegSet liveuse;
+  RegSet def;
+  RegSet livein;
+  RegSet liveout;
 };
 
 struct MachineOperand {
@@ -187,6 +226,16 @@ struct MachineOperand {
 
   inline static MachineOperand I(int imm) { return MachineOperand{State::Immediate, imm}; }
 
+  // dense index of registers that need color: r0..pc are 0..15, vN is 16 + N
+  static constexpr u32 NUM_PRECOLORED = (u32)ArmReg::pc + 1;
+
+  u32 reg_index() const { return state == State::PreColored ? (u32)value : NUM_PRECOLORED + (u32)value; }
+
+  inline static MachineOperand from_reg_index(u32 i) {
+    return i < NUM_PRECOLORED ? MachineOperand{State::PreColored, (i32)i}
+                              : MachineOperand{State::Virtual, (i32)(i - NUM_PRECOLORED)};
+  }
+
   // both are PreColored or Allocated, and has the same value
   bool is_equiv(const MachineOperand &other) const {
     return (state == State::PreColored || state == State::Allocated) &&
@@ -273,7 +322,14 @@ struct MachineInst {
     Compare,
     Call,
     Global,
-    Comment,  // for printing comments
+    VectorBinary,
+    VectorFma,
+    VectorMove,
+    VectorDup,
+    VectorExtract,
+    VectorLoad,
+    VectorStore,  // NEON, see MIVector
+    Comment,      // for printing comments
   } tag;
 
   MachineInst(Tag tag, MachineBB *insertAtEnd) : bb(insertAtEnd), tag(tag) {
@@ -383,6 +439,8 @@ struct MIJump : MachineInst {
 
 struct MIReturn : MachineInst {
   DEFINE_CLASSOF(MachineInst, p->tag == Tag::Return);
+  // 不为空时是尾调用：参数已经在r0-r3中，恢复现场后用b跳转到这个函数，由它直接返回到调用者
+  Func *tail_call = nullptr;
   MIReturn(MachineBB *insertAtEnd) : MachineInst(Tag::Return, insertAtEnd) {}
 };
 
@@ -445,8 +503,98 @@ struct MIGlobal : MachineInst {
   Decl *sym;
 
   MIGlobal(Decl *sym, MachineBB *insertAtBegin) : MachineInst(Tag::Global), sym(sym) {
+    bb = insertAtBegin;
     insertAtBegin->insts.insertAtBegin(this);
   }
+  MIGlobal(Decl *sym, MachineInst *insertBefore) : MachineInst(Tag::Global, insertBefore), sym(sym) {}
+};
+
+// NEON instructions on 4 x i32 in q registers, generated from the vector IR instructions of vectorize_loop.
+// Vector registers are numbered apart from the core registers and are invisible to liveness and allocate_register:
+// they are virtual (below MachineFunc::vector_virtual_max) until allocate_vector_register replaces them with the
+// number of a caller saved q register. Core register operands (addresses, vdup sources, vmov.32 destinations) are
+// ordinary MachineOperands
+// allocate_vector_register uses the NUM_VECTOR_REGS registers q8-q15 (d16-d31)
+constexpr i32 FIRST_VECTOR_REG = 8;
+
+struct MIVector : MachineInst {
+  DEFINE_CLASSOF(MachineInst, Tag::VectorBinary <= p->tag && p->tag <= Tag::VectorStore);
+
+  MIVector(Tag tag, MachineBB *insertAtEnd) : MachineInst(tag, insertAtEnd) {}
+  MIVector(Tag tag, MachineInst *insertBefore) : MachineInst(tag, insertBefore) {}
+};
+
+struct MIVectorBinary : MIVector {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorBinary);
+  Tag op;  // Add, Sub or Mul
+  i32 dst;
+  i32 lhs;
+  i32 rhs;
+
+  MIVectorBinary(Tag op, MachineBB *insertAtEnd) : MIVector(Tag::VectorBinary, insertAtEnd), op(op) {}
+};
+
+// vmla.i32 dst, lhs, rhs: dst = acc + lhs * rhs
+// acc must be dst when printed, allocate_vector_register inserts a vmov when they get different q registers
+struct MIVectorFma : MIVector {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorFma);
+  i32 dst;
+  i32 acc;
+  i32 lhs;
+  i32 rhs;
+
+  explicit MIVectorFma(MachineBB *insertAtEnd) : MIVector(Tag::VectorFma, insertAtEnd) {}
+};
+
+// vmov dst, src, for phis of vectors
+struct MIVectorMove : MIVector {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorMove);
+  i32 dst;
+  i32 src;
+
+  explicit MIVectorMove(MachineInst *insertBefore) : MIVector(Tag::VectorMove, insertBefore) {}
+  explicit MIVectorMove(MachineBB *insertAtEnd) : MIVector(Tag::VectorMove, insertAtEnd) {}
+};
+
+// vdup.32 dst, src
+struct MIVectorDup : MIVector {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorDup);
+  i32 dst;
+  MachineOperand src;
+
+  explicit MIVectorDup(MachineBB *insertAtEnd) : MIVector(Tag::VectorDup, insertAtEnd) {}
+};
+
+// vmov.32 dst, lane of src
+struct MIVectorExtract : MIVector {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorExtract);
+  MachineOperand dst;
+  i32 src;
+  i32 lane;
+
+  explicit MIVectorExtract(MachineBB *insertAtEnd) : MIVector(Tag::VectorExtract, insertAtEnd) {}
+};
+
+// vld1.32 / vst1.32 of 16 bytes at [addr]
+struct MIVectorAccess : MIVector {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorLoad || p->tag == Tag::VectorStore);
+  MachineOperand addr;
+
+  MIVectorAccess(Tag tag, MachineBB *insertAtEnd) : MIVector(tag, insertAtEnd) {}
+};
+
+struct MIVectorLoad : MIVectorAccess {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorLoad);
+  i32 dst;
+
+  explicit MIVectorLoad(MachineBB *insertAtEnd) : MIVectorAccess(Tag::VectorLoad, insertAtEnd) {}
+};
+
+struct MIVectorStore : MIVectorAccess {
+  DEFINE_CLASSOF(MachineInst, p->tag == Tag::VectorStore);
+  i32 data;
+
+  explicit MIVectorStore(MachineBB *insertAtEnd) : MIVectorAccess(Tag::VectorStore, insertAtEnd) {}
 };
 
 struct MIComment : MachineInst {
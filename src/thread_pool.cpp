@@ -0,0 +1,76 @@
+#include "thread_pool.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+u32 num_jobs = 1;
+
+// 是否在parallel_for的任务中，用于把嵌套的parallel_for变成串行
+static thread_local bool in_parallel = false;
+
+struct ThreadPool {
+  std::mutex mu;
+  std::condition_variable work_cv, done_cv;
+  std::vector<std::thread> workers;
+  // 当前任务，generation每次新任务时加一，worker据此判断有没有新任务
+  const std::function<void(u32)> *job = nullptr;
+  u32 job_size = 0;
+  u64 generation = 0;
+  std::atomic<u32> next{0};
+  u32 running = 0;
+
+  explicit ThreadPool(u32 num_workers) {
+    for (u32 i = 0; i < num_workers; ++i) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  void run_items() {
+    in_parallel = true;
+    for (u32 i; (i = next.fetch_add(1, std::memory_order_relaxed)) < job_size;) (*job)(i);
+    in_parallel = false;
+  }
+
+  void work() {
+    u64 seen = 0;
+    while (true) {
+      {
+        std::unique_lock lock(mu);
+        work_cv.wait(lock, [&] { return generation != seen; });
+        seen = generation;
+      }
+      run_items();
+      std::lock_guard lock(mu);
+      if (--running == 0) done_cv.notify_one();
+    }
+  }
+
+  void run(u32 n, const std::function<void(u32)> &f) {
+    {
+      std::lock_guard lock(mu);
+      job = &f;
+      job_size = n;
+      next.store(0, std::memory_order_relaxed);
+      running = workers.size();
+      ++generation;
+    }
+    work_cv.notify_all();
+    run_items();
+    std::unique_lock lock(mu);
+    done_cv.wait(lock, [&] { return running == 0; });
+    job = nullptr;
+  }
+};
+
+void parallel_for(u32 n, const std::function<void(u32)> &f) {
+  if (num_jobs <= 1 || n <= 1 || in_parallel) {
+    for (u32 i = 0; i < n; ++i) f(i);
+    return;
+  }
+  // worker在整个编译过程中一直存在，并且故意不析构：出错时任何线程都可能直接exit，不能在那时join
+  static ThreadPool *pool = new ThreadPool(num_jobs - 1);
+  pool->run(n, f);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <functional>
+
+#include "common.hpp"
+
+// 由-j指定的线程数，包括主线程。为1时parallel_for就是普通的循环
+extern u32 num_jobs;
+
+// 用num_jobs个线程执行f(0), f(1), ..., f(n - 1)，每个线程每次领取下一个还没有执行的下标，返回时全部执行完毕
+// 调用者需要保证不同的f(i)之间没有数据竞争。在f中再次调用parallel_for时串行执行
+void parallel_for(u32 n, const std::function<void(u32)> &f);
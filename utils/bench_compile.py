@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+# Measure compile time and peak RSS of TrivialCompiler on the largest test cases.
+#
+# usage: bench_compile.py [-n 10 | -a] [-r 3] [--json file] [--csv file] [--compare baseline.json [--threshold 10]]
+#                         compiler [other_compiler] [cases...]
+# If no case is given, the n largest .sy files under custom_test and sysyruntimelibrary are used, or all of them with -a.
+# With two compilers, the speedup of the second one against the first is also reported.
+# With one compiler, --json and --csv save the median CPU time, peak RSS and median time of every stage (from -T) of each
+# case. --compare checks the results against such a JSON file and exits with 1 if a case, a stage or the total got slower
+# (or used more memory) by more than threshold percent. This is what the bench_compile CMake target runs.
+
+import argparse
+import csv
+import glob
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+from tabulate import tabulate
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+
+def all_cases():
+    cases = glob.glob(os.path.join(ROOT, 'custom_test', '*.sy'))
+    cases += glob.glob(os.path.join(ROOT, 'sysyruntimelibrary', '**', '*.sy'), recursive=True)
+    return cases
+
+
+def largest_cases(n):
+    cases = all_cases()
+    cases.sort(key=os.path.getsize, reverse=True)
+    return cases[:n]
+
+
+def run_once(compiler, case, output, level=2, report=None):
+    cmd = [compiler, '-S', f'-O{level}', '-o', output] + (['-T', report] if report else []) + [case]
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    if os.waitstatus_to_exitcode(status) != 0:
+        sys.exit(f'{compiler} failed on {case}')
+    # ru_maxrss is in KB on Linux
+    return usage.ru_utime + usage.ru_stime, usage.ru_maxrss
+
+
+def measure(compiler, case, repeat, output):
+    results = [run_once(compiler, case, output) for _ in range(repeat)]
+    return statistics.median(t for t, _ in results), max(m for _, m in results)
+
+
+# like measure, but also returns the median wall time in ms of every stage, a stage that runs several times is summed
+def measure_stages(compiler, case, repeat, output):
+    report = output + '.json'
+    results, stages = [], {}
+    for _ in range(repeat):
+        results.append(run_once(compiler, case, output, report=report))
+        runs = {}
+        for s in json.load(open(report))['stages']:
+            runs[s['name']] = runs.get(s['name'], 0.0) + s['wall_ms']
+        for name, ms in runs.items():
+            stages.setdefault(name, []).append(ms)
+    return statistics.median(t for t, _ in results), max(m for _, m in results), \
+        {name: statistics.median(ms) for name, ms in stages.items()}
+
+
+def case_name(case):
+    return os.path.relpath(case, ROOT)
+
+
+def write_csv(path, results):
+    stage_names = sorted({name for r in results.values() for name in r['stages']})
+    with open(path, 'w', newline='') as f:
+        writer = csv.writer(f)
+        writer.writerow(['case', 'time_s', 'rss_kb'] + stage_names)
+        for case, r in results.items():
+            writer.writerow([case, f'{r["time_s"]:.4f}', r['rss_kb']] +
+                            [f'{r["stages"][name]:.3f}' if name in r['stages'] else '' for name in stage_names])
+
+
+def stage_totals(results):
+    totals = {}
+    for r in results.values():
+        for name, ms in r['stages'].items():
+            totals[name] = totals.get(name, 0.0) + ms
+    return totals
+
+
+# returns rows describing every regression beyond threshold percent; differences below min_ms (or min_kb for RSS) are
+# treated as noise, small cases easily vary by a few ms between runs
+def compare(results, baseline, threshold, min_ms, min_kb):
+    rows = []
+
+    def check(what, old, new, unit, min_diff):
+        if old is not None and new - old > min_diff and new > old * (1 + threshold / 100):
+            rows.append([what, f'{old:.3f}', f'{new:.3f}', unit, f'+{(new / max(old, 1e-9) - 1) * 100:.1f}%'])
+
+    old_cases = baseline['cases']
+    for case, r in results.items():
+        old = old_cases.get(case)
+        if old is None:
+            continue
+        check(case, old['time_s'] * 1000, r['time_s'] * 1000, 'ms', min_ms)
+        check(case + ' (rss)', old['rss_kb'], r['rss_kb'], 'KB', min_kb)
+    # totals only cover cases present in both runs, so adding or removing a case is not a regression
+    common = {case: r for case, r in results.items() if case in old_cases}
+    old_common = {case: old_cases[case] for case in common}
+    check('total', sum(r['time_s'] for r in old_common.values()) * 1000,
+          sum(r['time_s'] for r in common.values()) * 1000, 'ms', min_ms)
+    old_stages = stage_totals(old_common)
+    for name, ms in sorted(stage_totals(common).items()):
+        check(f'stage {name}', old_stages.get(name), ms, 'ms', min_ms)
+    return rows
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-n', type=int, default=10, help='number of largest cases to use')
+    parser.add_argument('-a', action='store_true', help='use all cases instead of the n largest')
+    parser.add_argument('-r', type=int, default=3, help='runs per case, median time is reported')
+    parser.add_argument('--json', help='save the results of one compiler as JSON, usable as a baseline')
+    parser.add_argument('--csv', help='save the results of one compiler as CSV, one column per stage')
+    parser.add_argument('--compare', help='baseline JSON written by --json to check for regressions')
+    parser.add_argument('--threshold', type=float, default=10, help='allowed slowdown against the baseline in percent')
+    parser.add_argument('--min-ms', type=float, default=5, help='ignore slowdowns smaller than this many ms')
+    parser.add_argument('--min-kb', type=int, default=1024, help='ignore RSS growth smaller than this many KB')
+    parser.add_argument('compilers', nargs='+', help='compiler [other_compiler] [cases...]')
+    args = parser.parse_args()
+
+    compilers = [c for c in args.compilers if not c.endswith('.sy')]
+    cases = [c for c in args.compilers if c.endswith('.sy')] or (sorted(all_cases()) if args.a else largest_cases(args.n))
+    if not 1 <= len(compilers) <= 2:
+        sys.exit('expected one or two compilers')
+    suite = args.json or args.csv or args.compare
+    if suite and len(compilers) != 1:
+        sys.exit('--json, --csv and --compare expect one compiler')
+    # read the baseline first, --json may overwrite the same file
+    baseline = json.load(open(args.compare)) if args.compare else None
+
+    headers = ['case', 'time(s)', 'rss(KB)']
+    if len(compilers) == 2:
+        headers += ['new time(s)', 'new rss(KB)', 'speedup']
+    rows = []
+    total = [0.0, 0.0]
+    results = {}
+    with tempfile.TemporaryDirectory() as tmp:
+        output = os.path.join(tmp, 'out.S')
+        for case in cases:
+            row = [os.path.basename(case)]
+            for i, compiler in enumerate(compilers):
+                if suite:
+                    t, rss, stages = measure_stages(compiler, case, args.r, output)
+                    results[case_name(case)] = {'time_s': t, 'rss_kb': rss, 'stages': stages}
+                else:
+                    t, rss = measure(compiler, case, args.r, output)
+                total[i] += t
+                row += [f'{t:.3f}', rss]
+            if len(compilers) == 2:
+                row.append(f'{float(row[1]) / max(float(row[3]), 1e-6):.2f}x')
+            rows.append(row)
+    footer = ['total', f'{total[0]:.3f}', '']
+    if len(compilers) == 2:
+        footer += [f'{total[1]:.3f}', '', f'{total[0] / max(total[1], 1e-6):.2f}x']
+    rows.append(footer)
+    print(tabulate(rows, headers=headers))
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump({'compiler': os.path.abspath(compilers[0]), 'runs': args.r, 'cases': results}, f, indent=2)
+    if args.csv:
+        write_csv(args.csv, results)
+    if baseline:
+        regressions = compare(results, baseline, args.threshold, args.min_ms, args.min_kb)
+        if regressions:
+            print(f'\ncompile time regressions beyond {args.threshold}% against {args.compare}:')
+            print(tabulate(regressions, headers=['what', 'baseline', 'now', 'unit', 'change']))
+            sys.exit(1)
+        print(f'\nno compile time regression beyond {args.threshold}% against {args.compare}')
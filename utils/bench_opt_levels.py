@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+# Compare compile time against the speed of the generated code for each optimization level.
+#
+# usage: bench_opt_levels.py [-l 0 1 2] [-r 3] compiler [cases...]
+# If no case is given, the performance test cases under sysyruntimelibrary are used.
+# Executables are linked with arm-linux-gnueabihf-gcc and run with qemu-arm unless the host is ARM. The run time is the
+# TOTAL printed by the timer functions of libsysy, or the wall time of the whole process if the case prints none.
+
+import argparse
+import glob
+import os
+import platform
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+from tabulate import tabulate
+
+from bench_compile import ROOT, run_once
+
+LIBSYSY = os.path.join(ROOT, 'sysyruntimelibrary', 'libsysy.a')
+TOTAL = re.compile(r'TOTAL: (\d+)H-(\d+)M-(\d+)S-(\d+)us')
+
+
+def perf_cases():
+    cases = glob.glob(os.path.join(ROOT, 'sysyruntimelibrary', 'section*', 'performance_test', '*.sy'))
+    return sorted(cases)
+
+
+def build(asm, exe):
+    subprocess.run(['arm-linux-gnueabihf-gcc', '-marm', '-march=armv7-a', '-mfpu=neon', '-mfloat-abi=hard', '-static',
+                    asm, LIBSYSY, '-o', exe], check=True)
+
+
+# returns (seconds, output matches .out)
+def run(exe, case):
+    cmd = [exe] if platform.machine().startswith('arm') else ['qemu-arm', exe]
+    case_in, case_out = case[:-3] + '.in', case[:-3] + '.out'
+    stdin = open(case_in) if os.path.exists(case_in) else subprocess.DEVNULL
+    begin = time.perf_counter()
+    proc = subprocess.run(cmd, stdin=stdin, capture_output=True, text=True, timeout=600)
+    wall = time.perf_counter() - begin
+    # same convention as run_case.sh: stdout followed by the exit code
+    output = proc.stdout + ('' if proc.stdout == '' or proc.stdout.endswith('\n') else '\n') + str(proc.returncode)
+    ok = not os.path.exists(case_out) or output.split() == open(case_out).read().split()
+    m = TOTAL.search(proc.stderr)
+    if m:
+        h, mi, s, us = map(int, m.groups())
+        return ((h * 60 + mi) * 60 + s) + us / 1e6, ok
+    return wall, ok
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-l', type=int, nargs='+', default=[0, 1, 2], help='optimization levels to compare')
+    parser.add_argument('-r', type=int, default=1, help='runs per case, the minimal time is reported')
+    parser.add_argument('compiler')
+    parser.add_argument('cases', nargs='*')
+    args = parser.parse_args()
+
+    cases = args.cases or perf_cases()
+    if not cases:
+        sys.exit('no case found, is sysyruntimelibrary checked out?')
+
+    headers = ['case']
+    for level in args.l:
+        headers += [f'O{level} compile(s)', f'O{level} run(s)']
+    rows = []
+    total = {level: [0.0, 0.0] for level in args.l}
+    with tempfile.TemporaryDirectory() as tmp:
+        asm, exe = os.path.join(tmp, 'out.S'), os.path.join(tmp, 'out')
+        for case in cases:
+            row = [os.path.basename(case)]
+            for level in args.l:
+                compile_time = min(run_once(args.compiler, case, asm, level)[0] for _ in range(args.r))
+                build(asm, exe)
+                results = [run(exe, case) for _ in range(args.r)]
+                run_time = min(t for t, _ in results)
+                total[level][0] += compile_time
+                total[level][1] += run_time
+                row += [f'{compile_time:.3f}', f'{run_time:.3f}' + ('' if all(ok for _, ok in results) else ' (WA)')]
+            rows.append(row)
+    footer = ['total']
+    for level in args.l:
+        footer += [f'{total[level][0]:.3f}', f'{total[level][1]:.3f}']
+    rows.append(footer)
+    print(tabulate(rows, headers=headers))
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+# Compare the speed of the code generated by two compilers, e.g. before and after an optimization pass.
+#
+# usage: bench_run.py [-O 2] [-r 3] compiler other_compiler [cases...]
+# If no case is given, the performance test cases under sysyruntimelibrary are used. The executables are built and run
+# like in bench_opt_levels.py, and the speedup of the second compiler against the first is reported.
+# example: bench_run.py -r 3 old/TrivialCompiler build/TrivialCompiler custom_test/{mv2,transpose,floyd}.sy
+
+import argparse
+import os
+import sys
+import tempfile
+
+from tabulate import tabulate
+
+from bench_compile import run_once
+from bench_opt_levels import build, perf_cases, run
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-O', type=int, default=2, help='optimization level used by both compilers')
+    parser.add_argument('-r', type=int, default=1, help='runs per case, the minimal time is reported')
+    parser.add_argument('compiler')
+    parser.add_argument('other_compiler')
+    parser.add_argument('cases', nargs='*')
+    args = parser.parse_args()
+
+    cases = args.cases or perf_cases()
+    if not cases:
+        sys.exit('no case found, is sysyruntimelibrary checked out?')
+
+    compilers = [args.compiler, args.other_compiler]
+    headers = ['case', 'run(s)', 'other run(s)', 'speedup']
+    rows = []
+    total = [0.0, 0.0]
+    with tempfile.TemporaryDirectory() as tmp:
+        asm, exe = os.path.join(tmp, 'out.S'), os.path.join(tmp, 'out')
+        for case in cases:
+            row = [os.path.basename(case)]
+            times = []
+            for i, compiler in enumerate(compilers):
+                run_once(compiler, case, asm, args.O)
+                build(asm, exe)
+                results = [run(exe, case) for _ in range(args.r)]
+                times.append(min(t for t, _ in results))
+                total[i] += times[-1]
+                row.append(f'{times[-1]:.3f}' + ('' if all(ok for _, ok in results) else ' (WA)'))
+            row.append(f'{times[0] / times[1]:.2f}x' if times[1] > 0 else '-')
+            rows.append(row)
+    rows.append(['total', f'{total[0]:.3f}', f'{total[1]:.3f}', f'{total[0] / total[1]:.2f}x' if total[1] > 0 else '-'])
+    print(tabulate(rows, headers=headers))
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Check that compiling with -j N gives exactly the same IR and assembly as the serial compiler.
+# usage: check_parallel.sh compiler case.sy [jobs]
+
+COMPILER="$1"
+CASE="$2"
+JOBS="${3:-4}"
+NAME=$(basename "$CASE" .sy)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for j in 1 "$JOBS"; do
+    if ! "$COMPILER" -j "$j" -l "$TMP/${NAME}_j$j.ll" -o "$TMP/${NAME}_j$j.S" "$CASE" 2> "$TMP/${NAME}_j$j.err"; then
+        tail -n 20 "$TMP/${NAME}_j$j.err"
+        echo "$COMPILER -j $j failed on $CASE"
+        exit 1
+    fi
+done
+
+cmp "$TMP/${NAME}_j1.ll" "$TMP/${NAME}_j$JOBS.ll" && cmp "$TMP/${NAME}_j1.S" "$TMP/${NAME}_j$JOBS.S"